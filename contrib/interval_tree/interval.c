@@ -120,15 +120,20 @@ static void nodes_free(struct intnode *n)
 }
 
 
+/* Missing children count as black leaves. */
+#define IS_BLACK(n) (!(n) || (n)->color == BLACK)
+
 /*
  * Maintain Red-Black tree balance after deleting a black node.
  * http://doxygen.postgresql.org/rbtree_8c_source.html
+ *
+ * There is no sentinel node, so x may be NULL (a missing child counts as
+ * black); its parent is passed separately for that case.
  */
-static void rb_delete_fixup(struct inttree *rb, struct intnode *x)
+static void rb_delete_fixup(struct inttree *rb, struct intnode *x,
+                            struct intnode *parent)
 {
   assert(rb);
-  if (!x)
-	return;
 
   /*
    * x is always a black node.  Initially, it is the former child of the
@@ -136,7 +141,7 @@ static void rb_delete_fixup(struct inttree *rb, struct intnode *x)
    * tree.
    */
   struct intnode *w;
-  while (x != rb->root && x->color == BLACK)
+  while (x != rb->root && IS_BLACK(x))
   {
     /*
      * Left and right cases are symmetric.  Any nodes that are children of
@@ -145,62 +150,65 @@ static void rb_delete_fixup(struct inttree *rb, struct intnode *x)
      * tree: at some stage we'll either fix the problem, or reach the root
      * (where the black-height is allowed to decrease).
      */
-    if (x == x->parent->left)
+    if (x == parent->left)
     {
-      w = x->parent->right;
+      w = parent->right;
       if (w->color == RED)
       {
         w->color = BLACK;
-        x->parent->color = RED;
-        left_rotate(rb, x->parent);
-        w = x->parent->right;
+        parent->color = RED;
+        left_rotate(rb, parent);
+        w = parent->right;
       }
-      if (w->left->color == BLACK && w->right->color == BLACK)
+      if (IS_BLACK(w->left) && IS_BLACK(w->right))
       {
         w->color = RED;
-        x = x->parent;
+        x = parent;
+        parent = x->parent;
       }
       else{
-        if (w->right->color == BLACK){
+        if (IS_BLACK(w->right)){
           w->left->color = BLACK;
           w->color = RED;
 
           right_rotate(rb, w);
-          w = x->parent->right;
+          w = parent->right;
         }
-        w->color = x->parent->color;
-        x->parent->color = BLACK;
+        w->color = parent->color;
+        parent->color = BLACK;
         w->right->color = BLACK;
-        left_rotate(rb, x->parent);
+        left_rotate(rb, parent);
         x = rb->root;   /* Arrange for loop to terminate. */
       }
     } else {
-      w = x->parent->left;
+      w = parent->left;
       if (w->color == RED){
         w->color = BLACK;
-        x->parent->color = RED;
-        right_rotate(rb, x->parent);
-        w = x->parent->left;
+        parent->color = RED;
+        right_rotate(rb, parent);
+        w = parent->left;
       }
-      if (w->right->color == BLACK && w->left->color == BLACK){
+      if (IS_BLACK(w->right) && IS_BLACK(w->left)){
         w->color = RED;
-        x = x->parent;
+        x = parent;
+        parent = x->parent;
       } else{
-        if (w->left->color == BLACK){
+        if (IS_BLACK(w->left)){
           w->right->color = BLACK;
           w->color = RED;
           left_rotate(rb, w);
-          w = x->parent->left;
+          w = parent->left;
         }
-        w->color = x->parent->color;
-        x->parent->color = BLACK;
+        w->color = parent->color;
+        parent->color = BLACK;
         w->left->color = BLACK;
-        right_rotate(rb, x->parent);
+        right_rotate(rb, parent);
         x = rb->root;   /* Arrange for loop to terminate. */
       }
     }
   }
-  x->color = BLACK;
+  if (x)
+    x->color = BLACK;
 }
 
 /*
@@ -269,15 +277,20 @@ rb_delete_node(struct inttree *rb, struct intnode *z)
      z->interval = y->interval;
      z->start = y->start;
      z->end = y->end;
-     z->max = y->max;
   }
 
+  /* Every node above the removed one (z included) may have taken its max from
+     it. */
+  struct intnode *n;
+  for (n = y->parent; n; n = n->parent)
+    fix_node_max(rb, n);
+
   /*
    * Removing a black node might make some paths from root to leaf contain
    * fewer black nodes than others, or it might make two red nodes adjacent.
    */
   if (y->color == BLACK)
-    rb_delete_fixup(rb, x);
+    rb_delete_fixup(rb, x, y->parent);
 
   /* Now we can recycle the y node */
    // printf("freeing y @%p\n",y);
@@ -0,0 +1,155 @@
+/* Insert, lookup and teardown throughput of interval.c against the tree
+   generated by interval_gen.h and the B+-tree of interval_btree.h, on
+   allocator-like address ranges: disjoint, inserted in random order, and
+   looked up by single addresses. */
+
+#define _XOPEN_SOURCE 600
+#include "interval.h"
+#include "interval_gen.h"
+#include "interval_btree.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#define N 1000000
+#define LOOKUPS 4000000
+
+struct range {
+  long start;
+  long end;
+};
+
+void *range_start(void *i) {
+  struct range *r = i;
+  return &r->start;
+}
+void *range_end(void *i) {
+  struct range *r = i;
+  return &r->end;
+}
+int range_endpoint_compare(void *i0, void *i1) {
+  long *p0 = i0;
+  long *p1 = i1;
+  if (*p0 == *p1)
+    return 0;
+  else if (*p0 < *p1)
+    return -1;
+  else
+    return 1;
+}
+
+struct grange {
+  struct itree_node node;
+  long start;
+  long last;
+};
+
+INTERVAL_TREE_DEFINE(grange_tree, struct grange, node)
+
+static void *grange_start(struct grange *r) { return (void *)r->start; }
+static void *grange_last(struct grange *r) { return (void *)r->last; }
+
+INTERVAL_BTREE_DEFINE(grange_index, struct grange, grange_start, grange_last)
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *tree, const char *op, long n, double secs)
+{
+  printf("%-10s %-8s %8.1f ns/op %8.2f Mop/s\n", tree, op, secs * 1e9 / n, n / secs / 1e6);
+}
+
+int main() {
+  static struct range ranges[N], queries[LOOKUPS];
+  static struct grange granges[N];
+  static long order[N];
+  static struct grange *sorted[N];
+  long i, found;
+  double t;
+
+  /* blocks of 16 to 256 bytes, with gaps, shuffled */
+  long addr = 0x10000;
+  for (i = 0; i < N; i++) {
+    long size = 16 + random() % 241;
+    ranges[i].start = granges[i].start = addr;
+    ranges[i].end = granges[i].last = addr + size - 1;
+    addr += size + random() % 64;
+    order[i] = i;
+  }
+  for (i = N - 1; i > 0; i--) {
+    long j = random() % (i + 1), tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+  for (i = 0; i < LOOKUPS; i++)
+    queries[i].start = queries[i].end = 0x10000 + random() % (addr - 0x10000);
+
+  interval_tree tree;
+  interval_tree_init(&tree, range_start, range_end, range_endpoint_compare);
+  t = now();
+  for (i = 0; i < N; i++)
+    interval_tree_insert(&tree, &ranges[order[i]]);
+  report("interval.c", "insert", N, now() - t);
+  t = now();
+  for (i = found = 0; i < LOOKUPS; i++)
+    found += interval_tree_lookup(&tree, &queries[i]) != NULL;
+  report("interval.c", "lookup", LOOKUPS, now() - t);
+  long found_old = found;
+  t = now();
+  interval_tree_free(&tree);
+  report("interval.c", "free", N, now() - t);
+
+  struct itree gtree = ITREE_EMPTY;
+  t = now();
+  for (i = 0; i < N; i++) {
+    struct grange *r = &granges[order[i]];
+    grange_tree_insert(&gtree, r, (void *)r->start, (void *)r->last);
+  }
+  report("generated", "insert", N, now() - t);
+  t = now();
+  for (i = found = 0; i < LOOKUPS; i++)
+    found += grange_tree_lookup(&gtree, (void *)queries[i].start, (void *)queries[i].end) != NULL;
+  report("generated", "lookup", LOOKUPS, now() - t);
+  t = now();
+  grange_tree_teardown(&gtree, NULL);
+  report("generated", "teardown", N, now() - t);
+
+  struct ibtree index = IBTREE_EMPTY;
+  t = now();
+  for (i = 0; i < N; i++) {
+    struct grange *r = &granges[order[i]];
+    grange_index_insert(&index, r, (void *)r->start, (void *)r->last);
+  }
+  report("btree", "insert", N, now() - t);
+  t = now();
+  for (i = 0; i < LOOKUPS; i++)
+    found -= grange_index_lookup(&index, (void *)queries[i].start, (void *)queries[i].end) != NULL;
+  report("btree", "lookup", LOOKUPS, now() - t);
+  assert(found == 0);
+  t = now();
+  grange_index_teardown(&index, NULL);
+  report("btree", "teardown", N, now() - t);
+
+  /* granges were made in order of start */
+  for (i = 0; i < N; i++)
+    sorted[i] = &granges[i];
+  t = now();
+  grange_index_load(&index, sorted, N);
+  report("btree", "load", N, now() - t);
+  t = now();
+  for (i = found = 0; i < LOOKUPS; i++)
+    found += grange_index_lookup(&index, (void *)queries[i].start, (void *)queries[i].end) != NULL;
+  report("btree", "lookup", LOOKUPS, now() - t);
+  grange_index_teardown(&index, NULL);
+
+  /* interval.c only descends left past a max strictly above the query, so
+     it misses a range whose last byte is the address looked up */
+  printf("hits: interval.c %ld, generated %ld of %d\n", found_old, found, LOOKUPS);
+  assert(found >= found_old);
+  return 0;
+}
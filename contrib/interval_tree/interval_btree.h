@@ -0,0 +1,463 @@
+#ifndef INTERVAL_BTREE_H_
+#define INTERVAL_BTREE_H_
+
+/* An interval index over address ranges kept in a B+-tree, for users whose
+   lookups far outnumber their updates.  Each node keeps its keys in one
+   64-byte cache line and is searched by counting the keys at or below the
+   address (with AVX2, four at a time), so a lookup touches a handful of
+   lines where a red-black tree touches a node per level.
+
+   It offers the operations of interval_gen.h, so a user can switch between
+   the two by changing the tree type and the DEFINE line.  Intervals are
+   closed, [start, last].  The index holds pointers to the caller's structs,
+   and needs to read their endpoints for removal and bulk loading:
+
+     INTERVAL_BTREE_DEFINE(range_index, struct range, range_start, range_last)
+
+   with range_start and range_last taking a struct range * and returning
+   void *, defines
+
+     void range_index_insert(struct ibtree *t, struct range *r, void *start, void *last);
+     void range_index_remove(struct ibtree *t, struct range *r);
+     struct range *range_index_lookup(const struct ibtree *t, void *start, void *last);
+     void range_index_load(struct ibtree *t, struct range **rs, size_t n);
+     void range_index_teardown(struct ibtree *t, void (*fn)(struct range *));
+     int range_index_count(const struct ibtree *t);
+
+   range_index_load fills an empty index from structs sorted by start, with
+   every node full.  Removal leaves nodes as they are rather than merging
+   them, so an index that has shrunk a lot is best rebuilt with
+   ibtree_compact. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define IBTREE_FANOUT 8         /* keys per 64-byte line */
+#define IBTREE_NONE UINTPTR_MAX /* unused keys, after the used ones */
+
+struct ibtree_leaf {
+  uintptr_t start[IBTREE_FANOUT] __attribute__((aligned(64)));
+  uintptr_t last[IBTREE_FANOUT];
+  void *item[IBTREE_FANOUT];
+  int n;
+};
+
+struct ibtree_inner {
+  uintptr_t key[IBTREE_FANOUT] __attribute__((aligned(64))); /* smallest start below each child */
+  uintptr_t max[IBTREE_FANOUT];        /* largest last below each child */
+  void *child[IBTREE_FANOUT];
+  int n;
+};
+
+struct ibtree {
+  void *root;
+  int height;                   /* of inner nodes above the leaves */
+  size_t count;
+};
+
+#define IBTREE_EMPTY { NULL, 0, 0 }
+
+/* How many of the first n keys are at or below x. */
+static inline int ibtree_rank(const uintptr_t *keys, int n, uintptr_t x)
+{
+  int r = 0, i;
+#ifdef __AVX2__
+  /* there is no unsigned compare: flip the sign bits and compare signed */
+  const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+  __m256i q = _mm256_xor_si256(_mm256_set1_epi64x((long long)x), bias);
+  for (i = 0; i < IBTREE_FANOUT; i += 4) {
+    __m256i k = _mm256_xor_si256(_mm256_load_si256((const __m256i *)(keys + i)), bias);
+    r += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, q))));
+  }
+  r = IBTREE_FANOUT - r;
+#else
+  for (i = 0; i < IBTREE_FANOUT; i++)
+    r += keys[i] <= x;
+#endif
+  /* unused keys are IBTREE_NONE, which only x == IBTREE_NONE reaches */
+  return r < n ? r : n;
+}
+
+static inline void *ibtree_node_new(size_t size)
+{
+  void *node = aligned_alloc(64, (size + 63) & ~(size_t)63);
+  if (node)
+    memset(node, 0xff, size);   /* every key unused */
+  return node;
+}
+
+static inline struct ibtree_leaf *ibtree_leaf_new(void)
+{
+  struct ibtree_leaf *leaf = ibtree_node_new(sizeof(struct ibtree_leaf));
+  if (leaf)
+    leaf->n = 0;
+  return leaf;
+}
+
+static inline struct ibtree_inner *ibtree_inner_new(void)
+{
+  struct ibtree_inner *in = ibtree_node_new(sizeof(struct ibtree_inner));
+  if (in)
+    in->n = 0;
+  return in;
+}
+
+/* The smallest start and largest last below node (0 if it is empty). */
+static inline uintptr_t ibtree_node_key(void *node, int height)
+{
+  return height ? ((struct ibtree_inner *)node)->key[0] :
+    ((struct ibtree_leaf *)node)->start[0];
+}
+
+static inline uintptr_t ibtree_node_max(void *node, int height)
+{
+  uintptr_t max = 0;
+  int i;
+  if (height) {
+    struct ibtree_inner *in = node;
+    for (i = 0; i < in->n; i++)
+      if (in->max[i] > max)
+        max = in->max[i];
+  } else {
+    struct ibtree_leaf *leaf = node;
+    for (i = 0; i < leaf->n; i++)
+      if (leaf->last[i] > max)
+        max = leaf->last[i];
+  }
+  return max;
+}
+
+static inline void *ibtree_lookup_in(void *node, int height, uintptr_t start, uintptr_t last)
+{
+  int c;
+  if (!height) {
+    struct ibtree_leaf *leaf = node;
+    for (c = ibtree_rank(leaf->start, leaf->n, last); c--; )
+      if (leaf->last[c] >= start)
+        return leaf->item[c];
+    return NULL;
+  }
+  struct ibtree_inner *in = node;
+  /* the nearest child first: with disjoint intervals it is the only one */
+  for (c = ibtree_rank(in->key, in->n, last); c--; )
+    if (in->max[c] >= start) {
+      void *item = ibtree_lookup_in(in->child[c], height - 1, start, last);
+      if (item)
+        return item;
+    }
+  return NULL;
+}
+
+/* Some item overlapping [start, last], or NULL. */
+static inline void *ibtree_lookup(const struct ibtree *t, uintptr_t start, uintptr_t last)
+{
+  return t->root ? ibtree_lookup_in(t->root, t->height, start, last) : NULL;
+}
+
+/* Move the upper half of a full node's entries to a new node.  Entries are
+   three parallel arrays in both kinds of node. */
+#define IBTREE_SPLIT(from, to, a, b, c)                                       \
+  do {                                                                        \
+    int h_ = IBTREE_FANOUT / 2;                                               \
+    memcpy((to)->a, (from)->a + h_, h_ * sizeof((from)->a[0]));               \
+    memcpy((to)->b, (from)->b + h_, h_ * sizeof((from)->b[0]));               \
+    memcpy((to)->c, (from)->c + h_, h_ * sizeof((from)->c[0]));               \
+    memset((from)->a + h_, 0xff, h_ * sizeof((from)->a[0]));                  \
+    (to)->n = (from)->n - h_;                                                 \
+    (from)->n = h_;                                                           \
+  } while (0)
+
+#define IBTREE_OPEN(node, a, b, c, pos)                                       \
+  do {                                                                        \
+    int m_ = (node)->n - (pos);                                               \
+    memmove((node)->a + (pos) + 1, (node)->a + (pos), m_ * sizeof((node)->a[0])); \
+    memmove((node)->b + (pos) + 1, (node)->b + (pos), m_ * sizeof((node)->b[0])); \
+    memmove((node)->c + (pos) + 1, (node)->c + (pos), m_ * sizeof((node)->c[0])); \
+    (node)->n++;                                                              \
+  } while (0)
+
+/* Insert into node's subtree; returns the new right sibling if node had to
+   split, or NULL. */
+static inline void *ibtree_insert_in(void *node, int height, uintptr_t start,
+                                     uintptr_t last, void *item)
+{
+  int pos;
+  if (!height) {
+    struct ibtree_leaf *leaf = node, *right = NULL;
+    pos = ibtree_rank(leaf->start, leaf->n, start);
+    if (leaf->n == IBTREE_FANOUT) {
+      if (!(right = ibtree_leaf_new()))
+        abort();
+      IBTREE_SPLIT(leaf, right, start, last, item);
+      if (pos > leaf->n) {
+        pos -= leaf->n;
+        leaf = right;
+      }
+    }
+    IBTREE_OPEN(leaf, start, last, item, pos);
+    leaf->start[pos] = start;
+    leaf->last[pos] = last;
+    leaf->item[pos] = item;
+    return right;
+  }
+
+  struct ibtree_inner *in = node, *right = NULL;
+  pos = ibtree_rank(in->key, in->n, start);
+  pos = pos ? pos - 1 : 0;
+  if (start < in->key[pos])
+    in->key[pos] = start;
+  if (last > in->max[pos])
+    in->max[pos] = last;
+  void *sibling = ibtree_insert_in(in->child[pos], height - 1, start, last, item);
+  if (!sibling)
+    return NULL;
+  in->max[pos] = ibtree_node_max(in->child[pos], height - 1);
+  pos++;
+  if (in->n == IBTREE_FANOUT) {
+    if (!(right = ibtree_inner_new()))
+      abort();
+    IBTREE_SPLIT(in, right, key, max, child);
+    if (pos > in->n) {
+      pos -= in->n;
+      in = right;
+    }
+  }
+  IBTREE_OPEN(in, key, max, child, pos);
+  in->key[pos] = ibtree_node_key(sibling, height - 1);
+  in->max[pos] = ibtree_node_max(sibling, height - 1);
+  in->child[pos] = sibling;
+  return right;
+}
+
+static inline void ibtree_insert(struct ibtree *t, uintptr_t start, uintptr_t last, void *item)
+{
+  if (!t->root && !(t->root = ibtree_leaf_new()))
+    abort();
+  void *sibling = ibtree_insert_in(t->root, t->height, start, last, item);
+  if (sibling) {
+    struct ibtree_inner *root = ibtree_inner_new();
+    if (!root)
+      abort();
+    root->key[0] = ibtree_node_key(t->root, t->height);
+    root->max[0] = ibtree_node_max(t->root, t->height);
+    root->child[0] = t->root;
+    root->key[1] = ibtree_node_key(sibling, t->height);
+    root->max[1] = ibtree_node_max(sibling, t->height);
+    root->child[1] = sibling;
+    root->n = 2;
+    t->root = root;
+    t->height++;
+  }
+  t->count++;
+}
+
+#define IBTREE_CLOSE(node, a, b, c, pos)                                      \
+  do {                                                                        \
+    int m_ = --(node)->n - (pos);                                             \
+    memmove((node)->a + (pos), (node)->a + (pos) + 1, m_ * sizeof((node)->a[0])); \
+    memmove((node)->b + (pos), (node)->b + (pos) + 1, m_ * sizeof((node)->b[0])); \
+    memmove((node)->c + (pos), (node)->c + (pos) + 1, m_ * sizeof((node)->c[0])); \
+    (node)->a[(node)->n] = IBTREE_NONE;                                       \
+  } while (0)
+
+static inline int ibtree_remove_in(void *node, int height, uintptr_t start, void *item)
+{
+  int c;
+  if (!height) {
+    struct ibtree_leaf *leaf = node;
+    for (c = ibtree_rank(leaf->start, leaf->n, start); c-- && leaf->start[c] == start; )
+      if (leaf->item[c] == item) {
+        IBTREE_CLOSE(leaf, start, last, item, c);
+        return 1;
+      }
+    return 0;
+  }
+  struct ibtree_inner *in = node;
+  /* equal starts may straddle a split */
+  for (c = ibtree_rank(in->key, in->n, start); c--; ) {
+    if (ibtree_remove_in(in->child[c], height - 1, start, item)) {
+      in->max[c] = ibtree_node_max(in->child[c], height - 1);
+      return 1;
+    }
+    if (in->key[c] < start)
+      break;
+  }
+  return 0;
+}
+
+/* Remove item, inserted with start; returns whether it was found. */
+static inline int ibtree_remove(struct ibtree *t, uintptr_t start, void *item)
+{
+  if (!t->root || !ibtree_remove_in(t->root, t->height, start, item))
+    return 0;
+  t->count--;
+  return 1;
+}
+
+/* Filling a tree from items in order of start: ibtree_load_add each, then
+   ibtree_load_end. */
+struct ibtree_loader {
+  struct ibtree *t;
+  struct ibtree_leaf *leaf;
+  void **nodes;                 /* the finished level, left to right */
+  size_t n, cap;
+};
+
+static inline void ibtree_load_push(struct ibtree_loader *l, void *node)
+{
+  if (l->n == l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 64;
+    if (!(l->nodes = realloc(l->nodes, l->cap * sizeof(void *))))
+      abort();
+  }
+  l->nodes[l->n++] = node;
+}
+
+static inline void ibtree_load_add(struct ibtree_loader *l, uintptr_t start,
+                                   uintptr_t last, void *item)
+{
+  if (!l->leaf || l->leaf->n == IBTREE_FANOUT) {
+    if (!(l->leaf = ibtree_leaf_new()))
+      abort();
+    ibtree_load_push(l, l->leaf);
+  }
+  l->leaf->start[l->leaf->n] = start;
+  l->leaf->last[l->leaf->n] = last;
+  l->leaf->item[l->leaf->n++] = item;
+  l->t->count++;
+}
+
+static inline void ibtree_load_end(struct ibtree_loader *l)
+{
+  int height = 0;
+  size_t i, n;
+
+  /* each pass replaces a level with the level of inner nodes above it */
+  while (l->n > 1) {
+    struct ibtree_inner *in = NULL;
+    for (i = n = 0; i < l->n; i++) {
+      void *child = l->nodes[i];
+      /* the new level is written over the old one, behind the reading */
+      if (!in || in->n == IBTREE_FANOUT) {
+        if (!(in = ibtree_inner_new()))
+          abort();
+        l->nodes[n++] = in;
+      }
+      in->key[in->n] = ibtree_node_key(child, height);
+      in->max[in->n] = ibtree_node_max(child, height);
+      in->child[in->n++] = child;
+    }
+    l->n = n;
+    height++;
+  }
+  l->t->root = l->n ? l->nodes[0] : NULL;
+  l->t->height = height;
+  free(l->nodes);
+}
+
+static inline void ibtree_free_in(void *node, int height)
+{
+  int i;
+  if (height)
+    for (i = 0; i < ((struct ibtree_inner *)node)->n; i++)
+      ibtree_free_in(((struct ibtree_inner *)node)->child[i], height - 1);
+  free(node);
+}
+
+static inline void ibtree_compact_in(struct ibtree_loader *l, void *node, int height)
+{
+  int i;
+  if (height) {
+    for (i = 0; i < ((struct ibtree_inner *)node)->n; i++)
+      ibtree_compact_in(l, ((struct ibtree_inner *)node)->child[i], height - 1);
+  } else {
+    struct ibtree_leaf *leaf = node;
+    for (i = 0; i < leaf->n; i++)
+      ibtree_load_add(l, leaf->start[i], leaf->last[i], leaf->item[i]);
+  }
+}
+
+/* Rebuild t with every node full. */
+static inline void ibtree_compact(struct ibtree *t)
+{
+  struct ibtree old = *t;
+  struct ibtree_loader l = { t, NULL, NULL, 0, 0 };
+  t->root = NULL;
+  t->height = 0;
+  t->count = 0;
+  if (!old.root)
+    return;
+  ibtree_compact_in(&l, old.root, old.height);
+  ibtree_load_end(&l);
+  ibtree_free_in(old.root, old.height);
+}
+
+/* Call fn on every item, in order of start (the depth is the tree's height,
+   so recursing is fine). */
+static inline void ibtree_each_in(void *node, int height, void (*fn)(void *))
+{
+  int i;
+  if (height) {
+    for (i = 0; i < ((struct ibtree_inner *)node)->n; i++)
+      ibtree_each_in(((struct ibtree_inner *)node)->child[i], height - 1, fn);
+  } else {
+    for (i = 0; i < ((struct ibtree_leaf *)node)->n; i++)
+      fn(((struct ibtree_leaf *)node)->item[i]);
+  }
+}
+
+#define INTERVAL_BTREE_DEFINE(name, type, start_of, last_of)                  \
+static inline __attribute__((unused))                                         \
+void name##_insert(struct ibtree *t, type *obj, void *start, void *last)      \
+{                                                                             \
+  ibtree_insert(t, (uintptr_t)start, (uintptr_t)last, obj);                   \
+}                                                                             \
+                                                                              \
+static inline __attribute__((unused))                                         \
+void name##_remove(struct ibtree *t, type *obj)                               \
+{                                                                             \
+  ibtree_remove(t, (uintptr_t)start_of(obj), obj);                            \
+}                                                                             \
+                                                                              \
+static inline __attribute__((unused))                                         \
+type *name##_lookup(const struct ibtree *t, void *start, void *last)          \
+{                                                                             \
+  return ibtree_lookup(t, (uintptr_t)start, (uintptr_t)last);                 \
+}                                                                             \
+                                                                              \
+static inline __attribute__((unused))                                         \
+void name##_load(struct ibtree *t, type **objs, size_t n)                     \
+{                                                                             \
+  struct ibtree_loader l = { t, NULL, NULL, 0, 0 };                           \
+  size_t i;                                                                   \
+  for (i = 0; i < n; i++)                                                     \
+    ibtree_load_add(&l, (uintptr_t)start_of(objs[i]),                         \
+                    (uintptr_t)last_of(objs[i]), objs[i]);                    \
+  ibtree_load_end(&l);                                                        \
+}                                                                             \
+                                                                              \
+/* Empty the index, calling fn (if not NULL) on each of its members. */       \
+static inline __attribute__((unused))                                         \
+void name##_teardown(struct ibtree *t, void (*fn)(type *))                    \
+{                                                                             \
+  if (t->root && fn)                                                          \
+    ibtree_each_in(t->root, t->height, (void (*)(void *))fn);                 \
+  if (t->root)                                                                \
+    ibtree_free_in(t->root, t->height);                                       \
+  t->root = NULL;                                                             \
+  t->height = 0;                                                              \
+  t->count = 0;                                                               \
+}                                                                             \
+                                                                              \
+static inline __attribute__((unused))                                         \
+int name##_count(const struct ibtree *t)                                      \
+{                                                                             \
+  return t->count;                                                            \
+}
+
+#endif
@@ -0,0 +1,348 @@
+#ifndef INTERVAL_GEN_H_
+#define INTERVAL_GEN_H_
+
+/* An interval tree over address ranges, generated for the caller's type.
+   Where interval.h mallocs a node for every interval and compares endpoints
+   through callbacks, here the node is embedded in the caller's struct and
+   the endpoints are addresses compared inline, so inserting allocates
+   nothing and no function pointers need fixing up after an update.
+
+   Intervals are closed: [start, last].  For a type
+
+     struct range {
+       struct itree_node node;
+       ...
+     };
+
+   INTERVAL_TREE_DEFINE(range_tree, struct range, node) defines
+
+     void range_tree_insert(struct itree *t, struct range *r, void *start, void *last);
+     void range_tree_remove(struct itree *t, struct range *r);
+     struct range *range_tree_lookup(const struct itree *t, void *start, void *last);
+     void range_tree_teardown(struct itree *t, void (*fn)(struct range *));
+     int range_tree_count(const struct itree *t);
+
+   A struct may be in several trees at once through several nodes. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct itree_node {
+  uintptr_t start;
+  uintptr_t last;
+  uintptr_t max;                /* the largest last in this subtree */
+  struct itree_node *parent;
+  struct itree_node *left;
+  struct itree_node *right;
+  int red;
+};
+
+struct itree {
+  struct itree_node *root;
+};
+
+#define ITREE_EMPTY { NULL }
+
+#define ITREE_IS_BLACK(n) (!(n) || !(n)->red)
+
+static inline void itree_fix_max(struct itree_node *n)
+{
+  n->max = n->last;
+  if (n->left && n->left->max > n->max)
+    n->max = n->left->max;
+  if (n->right && n->right->max > n->max)
+    n->max = n->right->max;
+}
+
+/* Put v where u was, as far as u's parent is concerned. */
+static inline void itree_replace(struct itree *t, struct itree_node *u,
+                                 struct itree_node *v)
+{
+  if (!u->parent)
+    t->root = v;
+  else if (u == u->parent->left)
+    u->parent->left = v;
+  else
+    u->parent->right = v;
+  if (v)
+    v->parent = u->parent;
+}
+
+static inline void itree_rotate_left(struct itree *t, struct itree_node *x)
+{
+  struct itree_node *y = x->right;
+  x->right = y->left;
+  if (y->left)
+    y->left->parent = x;
+  itree_replace(t, x, y);
+  y->left = x;
+  x->parent = y;
+  itree_fix_max(x);
+  itree_fix_max(y);
+}
+
+static inline void itree_rotate_right(struct itree *t, struct itree_node *x)
+{
+  struct itree_node *y = x->left;
+  x->left = y->right;
+  if (y->right)
+    y->right->parent = x;
+  itree_replace(t, x, y);
+  y->right = x;
+  x->parent = y;
+  itree_fix_max(x);
+  itree_fix_max(y);
+}
+
+static inline void itree_insert_node(struct itree *t, struct itree_node *z,
+                                     uintptr_t start, uintptr_t last)
+{
+  struct itree_node *y = NULL, *x = t->root, *u;
+
+  z->start = start;
+  z->last = z->max = last;
+  z->left = z->right = NULL;
+  z->red = 1;
+  while (x) {
+    y = x;
+    /* z will be below x */
+    if (x->max < last)
+      x->max = last;
+    x = start < x->start ? x->left : x->right;
+  }
+  z->parent = y;
+  if (!y)
+    t->root = z;
+  else if (start < y->start)
+    y->left = z;
+  else
+    y->right = z;
+
+  while (z->parent && z->parent->red) {
+    struct itree_node *p = z->parent, *g = p->parent;
+    if (p == g->left) {
+      u = g->right;
+      if (u && u->red) {
+        p->red = u->red = 0;
+        g->red = 1;
+        z = g;
+        continue;
+      }
+      if (z == p->right) {
+        itree_rotate_left(t, p);
+        z = p;
+        p = z->parent;
+      }
+      p->red = 0;
+      g->red = 1;
+      itree_rotate_right(t, g);
+    } else {
+      u = g->left;
+      if (u && u->red) {
+        p->red = u->red = 0;
+        g->red = 1;
+        z = g;
+        continue;
+      }
+      if (z == p->left) {
+        itree_rotate_right(t, p);
+        z = p;
+        p = z->parent;
+      }
+      p->red = 0;
+      g->red = 1;
+      itree_rotate_left(t, g);
+    }
+  }
+  t->root->red = 0;
+}
+
+/* Restore the colours after removing a black node; x (which may be NULL)
+   took its place below parent. */
+static inline void itree_remove_fixup(struct itree *t, struct itree_node *x,
+                                      struct itree_node *parent)
+{
+  struct itree_node *w;
+  while (x != t->root && ITREE_IS_BLACK(x)) {
+    if (x == parent->left) {
+      w = parent->right;
+      if (w->red) {
+        w->red = 0;
+        parent->red = 1;
+        itree_rotate_left(t, parent);
+        w = parent->right;
+      }
+      if (ITREE_IS_BLACK(w->left) && ITREE_IS_BLACK(w->right)) {
+        w->red = 1;
+        x = parent;
+        parent = x->parent;
+        continue;
+      }
+      if (ITREE_IS_BLACK(w->right)) {
+        w->left->red = 0;
+        w->red = 1;
+        itree_rotate_right(t, w);
+        w = parent->right;
+      }
+      w->red = parent->red;
+      parent->red = 0;
+      w->right->red = 0;
+      itree_rotate_left(t, parent);
+    } else {
+      w = parent->left;
+      if (w->red) {
+        w->red = 0;
+        parent->red = 1;
+        itree_rotate_right(t, parent);
+        w = parent->left;
+      }
+      if (ITREE_IS_BLACK(w->left) && ITREE_IS_BLACK(w->right)) {
+        w->red = 1;
+        x = parent;
+        parent = x->parent;
+        continue;
+      }
+      if (ITREE_IS_BLACK(w->left)) {
+        w->right->red = 0;
+        w->red = 1;
+        itree_rotate_left(t, w);
+        w = parent->left;
+      }
+      w->red = parent->red;
+      parent->red = 0;
+      w->left->red = 0;
+      itree_rotate_right(t, parent);
+    }
+    x = t->root;
+  }
+  if (x)
+    x->red = 0;
+}
+
+/* The node itself is unlinked, not copied over: it belongs to the caller. */
+static inline void itree_remove_node(struct itree *t, struct itree_node *z)
+{
+  struct itree_node *x, *parent, *y, *n;
+  int removed_red = z->red;
+
+  if (!z->left || !z->right) {
+    x = z->left ? z->left : z->right;
+    parent = z->parent;
+    itree_replace(t, z, x);
+  } else {
+    /* z's successor y takes z's place */
+    for (y = z->right; y->left; y = y->left)
+      ;
+    removed_red = y->red;
+    x = y->right;
+    if (y->parent == z) {
+      parent = y;
+    } else {
+      parent = y->parent;
+      itree_replace(t, y, x);
+      y->right = z->right;
+      y->right->parent = y;
+    }
+    itree_replace(t, z, y);
+    y->left = z->left;
+    y->left->parent = y;
+    y->red = z->red;
+  }
+  for (n = parent; n; n = n->parent)
+    itree_fix_max(n);
+  if (!removed_red)
+    itree_remove_fixup(t, x, parent);
+}
+
+/* Some node overlapping [start, last], or NULL. */
+static inline struct itree_node *itree_lookup_node(const struct itree *t,
+                                                   uintptr_t start, uintptr_t last)
+{
+  struct itree_node *n = t->root;
+  while (n) {
+    if (start <= n->last && last >= n->start)
+      return n;
+    /* anything overlapping on the left has last >= start */
+    if (n->left && n->left->max >= start)
+      n = n->left;
+    else if (last >= n->start)
+      n = n->right;
+    else
+      return NULL;
+  }
+  return NULL;
+}
+
+static inline int itree_count_nodes(const struct itree *t)
+{
+  struct itree_node *n = t->root, *prev = NULL, *next;
+  int count = 0;
+  /* walk in order by parent pointers, without a stack */
+  while (n) {
+    if (prev == n->parent) {
+      count++;
+      next = n->left ? n->left : n->right ? n->right : n->parent;
+    } else if (prev == n->left) {
+      next = n->right ? n->right : n->parent;
+    } else {
+      next = n->parent;
+    }
+    prev = n;
+    n = next;
+  }
+  return count;
+}
+
+#define INTERVAL_TREE_DEFINE(name, type, field)                               \
+static inline __attribute__((unused))                                         \
+void name##_insert(struct itree *t, type *obj, void *start, void *last)       \
+{                                                                             \
+  itree_insert_node(t, &obj->field, (uintptr_t)start, (uintptr_t)last);       \
+}                                                                             \
+                                                                              \
+static inline __attribute__((unused))                                         \
+void name##_remove(struct itree *t, type *obj)                                \
+{                                                                             \
+  itree_remove_node(t, &obj->field);                                          \
+}                                                                             \
+                                                                              \
+static inline __attribute__((unused))                                         \
+type *name##_lookup(const struct itree *t, void *start, void *last)           \
+{                                                                             \
+  struct itree_node *n = itree_lookup_node(t, (uintptr_t)start,               \
+                                           (uintptr_t)last);                  \
+  return n ? (type *)((char *)n - offsetof(type, field)) : NULL;              \
+}                                                                             \
+                                                                              \
+/* Empty the tree, calling fn (if not NULL) on each of its members once it   \
+   is out of the tree, leaves first. */                                       \
+static inline __attribute__((unused))                                         \
+void name##_teardown(struct itree *t, void (*fn)(type *))                     \
+{                                                                             \
+  struct itree_node *n = t->root, *p;                                         \
+  t->root = NULL;                                                             \
+  while (n) {                                                                 \
+    if (n->left) {                                                            \
+      n = n->left;                                                            \
+    } else if (n->right) {                                                    \
+      n = n->right;                                                           \
+    } else {                                                                  \
+      p = n->parent;                                                          \
+      if (p && p->left == n)                                                  \
+        p->left = NULL;                                                       \
+      else if (p)                                                             \
+        p->right = NULL;                                                      \
+      if (fn)                                                                 \
+        fn((type *)((char *)n - offsetof(type, field)));                      \
+      n = p;                                                                  \
+    }                                                                         \
+  }                                                                           \
+}                                                                             \
+                                                                              \
+static inline __attribute__((unused))                                         \
+int name##_count(const struct itree *t)                                       \
+{                                                                             \
+  return itree_count_nodes(t);                                                \
+}
+
+#endif
@@ -1,4 +1,6 @@
 #include "interval.h"
+#include "interval_gen.h"
+#include "interval_btree.h"
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,6 +10,56 @@ struct range {
   long end;
 };
 
+struct grange {
+  struct itree_node node;
+  long start;
+  long last;
+  int in_tree;
+};
+
+INTERVAL_TREE_DEFINE(grange_tree, struct grange, node)
+
+static void *grange_start(struct grange *r) { return (void *)r->start; }
+static void *grange_last(struct grange *r) { return (void *)r->last; }
+
+INTERVAL_BTREE_DEFINE(grange_index, struct grange, grange_start, grange_last)
+
+static int grange_by_start(const void *a, const void *b)
+{
+  const struct grange *x = *(struct grange **)a, *y = *(struct grange **)b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Check n's subtree is a red-black tree with the right max fields; returns
+   its black height. */
+static int gen_check(struct itree_node *n, struct itree_node *parent)
+{
+  if (!n)
+    return 1;
+  assert(n->parent == parent);
+  assert(!(n->red && parent && parent->red));
+  if (n->left)
+    assert(n->left->start <= n->start);
+  if (n->right)
+    assert(n->right->start >= n->start);
+  int lh = gen_check(n->left, n), rh = gen_check(n->right, n);
+  assert(lh == rh);
+  uintptr_t max = n->last;
+  if (n->left && n->left->max > max)
+    max = n->left->max;
+  if (n->right && n->right->max > max)
+    max = n->right->max;
+  assert(n->max == max);
+  return lh + !n->red;
+}
+
+static int grange_freed;
+
+static void grange_free(struct grange *r)
+{
+  grange_freed++;
+}
+
 void *range_start(void *i) {
   struct range *r = i;
   return &r->start;
@@ -144,6 +196,28 @@ int main() {
   assert(range_lookup(&tree, 10, 20) == NULL);
   assert(range_lookup(&tree, 10, 21) != NULL);
 
+  /* Deleting nodes must keep the tree balanced and its max fields right:
+     every remaining interval is still found afterwards. */
+  for(j=0; j<100; j++) {
+    long starts[1000];
+    interval_tree_free(&tree);
+    interval_tree_init(&tree, range_start, range_end, range_endpoint_compare);
+    srandom(j);
+    for(i=0, start=0; i<1000; i++) {
+      starts[i] = start;
+      range_insert(&tree, start, start + 1 + random() % 299);
+      start += 300 + random() % 100;
+    }
+    for(i=0; i<1000; i++)
+      if (random() % 2) {
+        interval_tree_delete_node(&tree, node_lookup(&tree, starts[i], starts[i]));
+        starts[i] = -1;
+      }
+    for(i=0; i<1000; i++)
+      if (starts[i] >= 0)
+        assert(range_lookup(&tree, starts[i], starts[i])->start == starts[i]);
+  }
+
 #define NTESTS 10000
   for(i=0; i<NTESTS; i++) {
     interval_tree_free(&tree);
@@ -181,5 +255,96 @@ int main() {
        there is an overlap. */
   }
   interval_tree_free(&tree);
+
+  /* The generated tree finds an overlapping interval exactly when there is
+     one, through inserts and removals. */
+  for(j=0; j<200; j++) {
+    static struct grange ranges[500];
+    struct itree gtree = ITREE_EMPTY;
+    srandom(j);
+    for(i=0; i<500; i++) {
+      ranges[i].start = random() % 100000;
+      ranges[i].last = ranges[i].start + random() % (j % 2 ? 50 : 2000);
+      ranges[i].in_tree = 1;
+      grange_tree_insert(&gtree, &ranges[i], (void *)ranges[i].start, (void *)ranges[i].last);
+    }
+    for(i=0; i<500; i++)
+      if (random() % 3 == 0) {
+        grange_tree_remove(&gtree, &ranges[i]);
+        ranges[i].in_tree = 0;
+      }
+    assert(!gtree.root->red);
+    gen_check(gtree.root, NULL);
+    for(i=0; i<2000; i++) {
+      int k, any = 0;
+      start = random() % 101000;
+      end = start + random() % 100;
+      struct grange *r = grange_tree_lookup(&gtree, (void *)start, (void *)end);
+      for(k=0; k<500; k++)
+        any |= ranges[k].in_tree && ranges[k].start <= end && ranges[k].last >= start;
+      assert(!!r == any);
+      if (r)
+        assert(r->in_tree && r->start <= end && r->last >= start);
+    }
+    int live = 0;
+    for(i=0; i<500; i++)
+      live += ranges[i].in_tree;
+    assert(grange_tree_count(&gtree) == live);
+    grange_freed = 0;
+    grange_tree_teardown(&gtree, grange_free);
+    assert(grange_freed == live && !gtree.root);
+  }
+
+  /* Likewise the B+-tree index, filled by inserts or loaded in bulk, and
+     compacted after removals. */
+  for(j=0; j<200; j++) {
+    static struct grange ranges[2000];
+    static struct grange *sorted[2000];
+    struct ibtree index = IBTREE_EMPTY;
+    int n = 1 + j * 10, pass;
+    srandom(j);
+    for(i=0; i<n; i++) {
+      /* few distinct starts, so that equal starts straddle splits */
+      ranges[i].start = random() % (j % 3 ? 100000 : 50);
+      ranges[i].last = ranges[i].start + random() % (j % 2 ? 50 : 2000);
+      ranges[i].in_tree = 1;
+      sorted[i] = &ranges[i];
+    }
+    if (j % 4 == 0) {
+      qsort(sorted, n, sizeof(sorted[0]), grange_by_start);
+      grange_index_load(&index, sorted, n);
+    } else {
+      for(i=0; i<n; i++)
+        grange_index_insert(&index, &ranges[i], (void *)ranges[i].start, (void *)ranges[i].last);
+    }
+    for(pass=0; pass<2; pass++) {
+      for(i=0; i<n; i++)
+        if (ranges[i].in_tree && random() % 3 == 0) {
+          grange_index_remove(&index, &ranges[i]);
+          ranges[i].in_tree = 0;
+        }
+      if (pass)
+        ibtree_compact(&index);
+      int live = 0;
+      for(i=0; i<n; i++)
+        live += ranges[i].in_tree;
+      assert(grange_index_count(&index) == live);
+      for(i=0; i<1000; i++) {
+        int k, any = 0;
+        start = random() % 101000;
+        end = start + random() % 100;
+        struct grange *r = grange_index_lookup(&index, (void *)start, (void *)end);
+        for(k=0; k<n; k++)
+          any |= ranges[k].in_tree && ranges[k].start <= end && ranges[k].last >= start;
+        assert(!!r == any);
+        if (r)
+          assert(r->in_tree && r->start <= end && r->last >= start);
+      }
+    }
+    grange_freed = 0;
+    int live = grange_index_count(&index);
+    grange_index_teardown(&index, grange_free);
+    assert(grange_freed == live && !index.root);
+  }
   return 0;
 }
@@ -0,0 +1,21 @@
+#!/usr/bin/env ruby
+
+NTIMES = 5
+THREADS = [1, 2, 4, 8, 16, 32, 64]
+ITERATIONS = 200_000
+
+["split", "global"].each { |mode|
+  puts "#{mode}"
+  THREADS.each { |n|
+    total = 0.0
+    NTIMES.times {
+      time_str = `./runtime-contention #{n} #{ITERATIONS} #{mode} 2> /dev/null`
+      if time_str =~ /TIME: ([0-9\.]+)/
+        total += $1.to_f
+      else
+        puts "ERROR: #{n} #{mode}"
+      end
+    }
+    puts "#{n}, #{total/NTIMES}\n"
+  }
+}
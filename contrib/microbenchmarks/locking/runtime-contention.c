@@ -0,0 +1,100 @@
+/*
+ * Measures how well the runtime's shared tables (symbol registry and pointer
+ * mappings) scale when many application threads hit them at once.
+ *
+ *   runtime-contention [nthreads] [iterations] [global]
+ *
+ * Passing "global" as the third argument wraps every runtime call in one
+ * recursive mutex, which reproduces the behavior of the single
+ * ktthreads_mutex that used to guard all of these structures.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <registervars.h>
+
+void *transform_find_mapping(void *from);
+void transform_add_mapping(void *from, void *to);
+
+/* libkitsune expects the program to provide main(); this benchmark does, but
+   never enters it through kitsune_init_inplace. */
+
+#define NVARS 256
+
+static int vars[NVARS];
+static char keys[NVARS][16];
+
+static int nthreads = 64;
+static long iterations = 1000000;
+static int use_global = 0;
+static pthread_mutex_t global_mutex;
+
+static double now(void)
+{
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return t.tv_sec + t.tv_usec / 1000000.;
+}
+
+static void *worker(void *arg)
+{
+  long id = (long)arg, i;
+  unsigned found = 0;
+  for (i = 0; i < iterations; i++) {
+    int v = (id + i) % NVARS;
+    if (use_global) pthread_mutex_lock(&global_mutex);
+    found += kitsune_lookup_key_new(keys[v]) != NULL;
+    if (use_global) pthread_mutex_unlock(&global_mutex);
+
+    if (use_global) pthread_mutex_lock(&global_mutex);
+    found += kitsune_lookup_addr_new(&vars[v]) != NULL;
+    if (use_global) pthread_mutex_unlock(&global_mutex);
+
+    if (use_global) pthread_mutex_lock(&global_mutex);
+    found += transform_find_mapping(&vars[v]) != NULL;
+    if (use_global) pthread_mutex_unlock(&global_mutex);
+  }
+  if (found != 3 * iterations) {
+    fprintf(stderr, "thread %ld: lookups failed\n", id);
+    abort();
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  int i;
+  pthread_mutexattr_t attr;
+  pthread_t *threads;
+  double bt, at;
+
+  if (argc > 1) nthreads = atoi(argv[1]);
+  if (argc > 2) iterations = atol(argv[2]);
+  if (argc > 3) use_global = strcmp(argv[3], "global") == 0;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&global_mutex, &attr);
+
+  for (i = 0; i < NVARS; i++) {
+    snprintf(keys[i], sizeof(keys[i]), "var%d", i);
+    kitsune_register_var(keys[i], NULL, NULL, NULL, &vars[i], sizeof(int), 0);
+    transform_add_mapping(&vars[i], &vars[(i + 1) % NVARS]);
+  }
+
+  threads = malloc(sizeof(pthread_t) * nthreads);
+  bt = now();
+  for (i = 0; i < nthreads; i++)
+    pthread_create(&threads[i], NULL, worker, (void *)(long)i);
+  for (i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  at = now();
+
+  fprintf(stderr, "%d threads, %ld iterations, %s locking\n", nthreads,
+          iterations, use_global ? "global" : "split");
+  printf("TIME: %f\n", at - bt);
+  return 0;
+}
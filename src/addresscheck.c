@@ -1,83 +1,81 @@
 
 #include "kitsune_internal.h"
 
-#include <interval.h>
+#include <interval_gen.h>
 #include <stdlib.h>
 #include <stddef.h>
 #include <ktlog.h>
 
 #include "addresscheck_internal.h"
+#include "pageclass_internal.h"
 
 
 struct mem_range {
+  struct itree_node node;
   char *descriptor;
   void *start;
-  void *end;
+  void *end;                    /* the last byte */
 };
 
-void *get_start(void *r) { 
-  return ((struct mem_range *)r)->start; 
-}
-void *get_end(void *r) { 
-  return ((struct mem_range *)r)->end; 
-}
-int addr_compare(void *p0, void *p1) 
+INTERVAL_TREE_DEFINE(range_tree, struct mem_range, node)
+
+struct itree memory_ranges;
+
+static void range_free(struct mem_range *r)
 {
-  /* Strictly speaking, we shouldn't be comparing pointers that might point to
-     arbitary addresses (e.g., not in the same array). */
-  ptrdiff_t diff = p0 - p1;
-  if (diff == 0) 
-    return 0;
-  else if (diff > 0)
-    return 1;
-  else
-    return -1;
+  free(r);
 }
 
-interval_tree memory_ranges;
-
 /* clear should be called once we reach the target update point */
 void addresscheck_free(void)
 {
-  interval_tree_free(&memory_ranges);
+  range_tree_teardown(&memory_ranges, range_free);
 }
 
 /* init should be called during startup */
 void addresscheck_init(void)
 {
-  interval_tree_init(&memory_ranges, get_start, get_end, addr_compare);
+  memory_ranges.root = NULL;
 }
 
 void addresscheck(char *descriptor, void *addr, size_t size)
 {
+  vmarea_type type = pageclass_type(addr);
+  if (type == UNMAPPED || type == STACK)
+    kitsune_log_warn(KT_LOG_ALLOC,
+                     "Address check: %s points to %s memory at %p",
+                     descriptor ? descriptor : "pointer",
+                     type == STACK ? "stack" : "unmapped", addr);
+
   struct mem_range *new_range = malloc(sizeof(struct mem_range));
   new_range->descriptor = descriptor;
   new_range->start = addr;
   new_range->end = addr + (size - 1);
 
-  struct mem_range *lookup = interval_tree_lookup(&memory_ranges, new_range);
+  struct mem_range *lookup = range_tree_lookup(&memory_ranges, new_range->start,
+                                               new_range->end);
   if (lookup && lookup->start != new_range->start && lookup->end != new_range->end) {
     if (descriptor)
-      kitsune_log("Memory overlap: insertion: %s", descriptor);
+      kitsune_log_warn(KT_LOG_ALLOC, "Memory overlap: insertion: %s", descriptor);
     if (lookup->descriptor)
-      kitsune_log("Memory overlap: existing: %s", lookup->descriptor);
+      kitsune_log_warn(KT_LOG_ALLOC, "Memory overlap: existing: %s", lookup->descriptor);
 
     if (lookup->start == new_range->start && lookup->end != new_range->end) {
-      kitsune_log("Memory overlap: matching pointers with differnent sizes!");
+      kitsune_log_warn(KT_LOG_ALLOC, "Memory overlap: matching pointers with differnent sizes!");
     } else if ((lookup->start >= new_range->start && lookup->end <= new_range->end) ||
                (lookup->start <= new_range->start && lookup->end >= new_range->end)) {
-      kitsune_log("Memory overlap: pointer internal to memory region!");
+      kitsune_log_warn(KT_LOG_ALLOC, "Memory overlap: pointer internal to memory region!");
     } else {
-      kitsune_log("Memory overlap: weird overlapping pattern!");
+      kitsune_log_warn(KT_LOG_ALLOC, "Memory overlap: weird overlapping pattern!");
     }
 
     ptrdiff_t d0 = lookup->start - new_range->start;
     ptrdiff_t d1 = lookup->end - lookup->start;
     ptrdiff_t d2 = new_range->end - new_range->start;
 
-    kitsune_log("Memory overlap: start diff [%ld] size1 [%ld] size2 [%ld]", d0, d1, d2);
+    kitsune_log_warn(KT_LOG_ALLOC, "Memory overlap: start diff [%ld] size1 [%ld] size2 [%ld]", d0, d1, d2);
 
   }
 
-  interval_tree_insert(&memory_ranges, new_range);
+  range_tree_insert(&memory_ranges, new_range, new_range->start, new_range->end);
 }
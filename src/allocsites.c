@@ -0,0 +1,265 @@
+/*
+ * Allocation sites.  While recording is on (KITSUNE_ALLOC_SITES=1 in the
+ * environment, or kitsune_alloc_sites(1)), each block from kitsune_malloc and
+ * its siblings is charged to a site: the code that called the allocator, and
+ * the type it asked for (for kitsune_malloc_typed).  alloctrack keeps the
+ * site's compact id with the block, and each site's live count and bytes are
+ * kept current as blocks come and go, so a census (kitsune_heap_census) only
+ * reads counters rather than stopping the program to walk the heap.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <dlfcn.h>
+
+#include "kitsune_internal.h"
+#include "allocsites_internal.h"
+
+#ifdef ENABLE_THREADING
+#include <pthread.h>
+
+/* Only taken to add a site; finding one takes no lock. */
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define SITES_MAX 4096
+#define SITE_INDEX (SITES_MAX * 2)
+
+typedef struct {
+  void *caller;
+  const char *type;             /* a typed arena's name, or NULL */
+  char *where;                  /* caller as "function+offset (object)" */
+  size_t count;
+  size_t bytes;
+} alloc_site;
+
+typedef struct {
+  int enabled;
+  unsigned int nsites;
+  alloc_site sites[SITES_MAX];           /* a site's id is its index + 1 */
+  unsigned short index[SITE_INDEX];      /* ids by hash, 0 where empty */
+} site_table;
+
+/* Passed from version to version (see allocsites_init). */
+site_table *alloc_sites = NULL;
+
+static size_t site_hash(void *caller, const char *type)
+{
+  uint64_t h = ((uintptr_t)caller ^ ((uintptr_t)type << 7)) * 0x9e3779b97f4a7c15ull;
+  return (h ^ (h >> 31)) & (SITE_INDEX - 1);
+}
+
+/* Name the caller now: its version's code may be unloaded by the time of a
+   census. */
+static char *site_where(void *caller)
+{
+  Dl_info info;
+  char *where;
+  if (!dladdr(caller, &info) || !info.dli_fname) {
+    if (asprintf(&where, "%p", caller) < 0)
+      return NULL;
+    return where;
+  }
+  const char *object = strrchr(info.dli_fname, '/');
+  object = object ? object + 1 : info.dli_fname;
+  if (info.dli_sname) {
+    if (asprintf(&where, "%s+0x%lx (%s)", info.dli_sname,
+                 (unsigned long)((char *)caller - (char *)info.dli_saddr), object) < 0)
+      return NULL;
+  } else if (asprintf(&where, "%s+0x%lx", object,
+                      (unsigned long)((char *)caller - (char *)info.dli_fbase)) < 0) {
+    return NULL;
+  }
+  return where;
+}
+
+/* The id of the site allocating type from caller, or 0 if sites are not
+   being recorded (or there are too many). */
+unsigned int allocsites_id(void *caller, const char *type)
+{
+  site_table *t = __atomic_load_n(&alloc_sites, __ATOMIC_ACQUIRE);
+  size_t i, first;
+  unsigned int id;
+
+  if (!t || !__atomic_load_n(&t->enabled, __ATOMIC_RELAXED))
+    return 0;
+  first = i = site_hash(caller, type);
+  for (;;) {
+    id = __atomic_load_n(&t->index[i], __ATOMIC_ACQUIRE);
+    if (!id)
+      break;
+    if (t->sites[id - 1].caller == caller && t->sites[id - 1].type == type)
+      return id;
+    i = (i + 1) & (SITE_INDEX - 1);
+  }
+
+#ifdef ENABLE_THREADING
+  pthread_mutex_lock(&sites_lock);
+#endif
+  /* someone may have added it (or others after it) meanwhile */
+  for (i = first; (id = t->index[i]); i = (i + 1) & (SITE_INDEX - 1))
+    if (t->sites[id - 1].caller == caller && t->sites[id - 1].type == type)
+      goto out;
+  if (t->nsites == SITES_MAX) {
+    id = 0;
+    goto out;
+  }
+  alloc_site *s = &t->sites[t->nsites];
+  s->caller = caller;
+  s->type = type;
+  s->where = site_where(caller);
+  id = t->nsites + 1;
+  __atomic_store_n(&t->nsites, id, __ATOMIC_RELEASE);
+  __atomic_store_n(&t->index[i], id, __ATOMIC_RELEASE);
+ out:
+#ifdef ENABLE_THREADING
+  pthread_mutex_unlock(&sites_lock);
+#endif
+  return id;
+}
+
+void allocsites_charge(unsigned int id, size_t size)
+{
+  if (!id)
+    return;
+  __atomic_add_fetch(&alloc_sites->sites[id - 1].count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&alloc_sites->sites[id - 1].bytes, size, __ATOMIC_RELAXED);
+}
+
+void allocsites_forget(unsigned int id, size_t size)
+{
+  if (!id)
+    return;
+  __atomic_sub_fetch(&alloc_sites->sites[id - 1].count, 1, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&alloc_sites->sites[id - 1].bytes, size, __ATOMIC_RELAXED);
+}
+
+/**
+ * \ingroup public
+ *
+ * Start (or stop) charging kitsune_malloc'd blocks to their allocation
+ * sites.  Blocks allocated while it is off are left out of the census.
+ */
+void kitsune_alloc_sites(int enable)
+{
+  /* may be called from the driver's control thread */
+  site_table *t = __atomic_load_n(&alloc_sites, __ATOMIC_ACQUIRE);
+  if (!t) {
+    site_table *fresh = calloc(1, sizeof(site_table));
+    if (__atomic_compare_exchange_n(&alloc_sites, &t, fresh, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      t = fresh;
+    else
+      free(fresh);
+  }
+  __atomic_store_n(&t->enabled, enable, __ATOMIC_RELAXED);
+}
+
+typedef struct {
+  const char *label;
+  const char *where;
+  size_t count, bytes;
+} census_line;
+
+static int by_bytes(const void *a, const void *b)
+{
+  const census_line *x = a, *y = b;
+  return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+static void append(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+  __attribute__((format(printf, 4, 5)));
+
+static void append(char **buf, size_t *len, size_t *cap, const char *fmt, ...)
+{
+  va_list ap;
+  for (;;) {
+    va_start(ap, fmt);
+    int n = vsnprintf(*buf + *len, *cap - *len, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if (*len + n < *cap) {
+      *len += n;
+      return;
+    }
+    *cap = (*cap + n) * 2;
+    *buf = realloc(*buf, *cap);
+  }
+}
+
+/**
+ * \ingroup public
+ *
+ * The live blocks recorded by kitsune_alloc_sites, as text (which the caller
+ * frees): a "total COUNT BYTES" line, then "type COUNT BYTES TYPE" for each
+ * type and "site COUNT BYTES TYPE WHERE" for each site, largest first.
+ * Blocks not allocated by type show "-" as their type.  The counters are
+ * read while the program runs, so a census taken mid-allocation may be off
+ * by the blocks in flight.
+ */
+char *kitsune_heap_census(void)
+{
+  site_table *t = __atomic_load_n(&alloc_sites, __ATOMIC_ACQUIRE);
+  size_t len = 0, cap = 4096, total_count = 0, total_bytes = 0;
+  char *buf = malloc(cap);
+  unsigned int i, j, n = t ? __atomic_load_n(&t->nsites, __ATOMIC_ACQUIRE) : 0;
+  unsigned int ntypes = 0;
+
+  buf[0] = '\0';
+  if (!t || !t->enabled)
+    append(&buf, &len, &cap, "recording off\n");
+  census_line *sites = malloc(sizeof(census_line) * (n + 1));
+  census_line *types = malloc(sizeof(census_line) * (n + 1));
+  for (i = 0; i < n; i++) {
+    alloc_site *s = &t->sites[i];
+    census_line *l = &sites[i];
+    l->label = s->type ? s->type : "-";
+    l->where = s->where ? s->where : "?";
+    l->count = __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+    l->bytes = __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+    total_count += l->count;
+    total_bytes += l->bytes;
+    for (j = 0; j < ntypes && strcmp(types[j].label, l->label); j++)
+      ;
+    if (j == ntypes) {
+      types[ntypes].label = l->label;
+      types[ntypes].count = types[ntypes].bytes = 0;
+      ntypes++;
+    }
+    types[j].count += l->count;
+    types[j].bytes += l->bytes;
+  }
+  qsort(sites, n, sizeof(census_line), by_bytes);
+  qsort(types, ntypes, sizeof(census_line), by_bytes);
+
+  append(&buf, &len, &cap, "total %lu %lu\n", (unsigned long)total_count,
+         (unsigned long)total_bytes);
+  for (i = 0; i < ntypes; i++)
+    append(&buf, &len, &cap, "type %lu %lu %s\n", (unsigned long)types[i].count,
+           (unsigned long)types[i].bytes, types[i].label);
+  for (i = 0; i < n; i++)
+    if (sites[i].count)
+      append(&buf, &len, &cap, "site %lu %lu %s %s\n", (unsigned long)sites[i].count,
+             (unsigned long)sites[i].bytes, sites[i].label, sites[i].where);
+  free(sites);
+  free(types);
+  return buf;
+}
+
+/* init should be called during startup, before anything is allocated. */
+void allocsites_init(void)
+{
+  if (kitsune_is_updating()) {
+    site_table **prev = kitsune_get_val("alloc_sites");
+    if (prev && *prev)
+      alloc_sites = *prev;
+  }
+  const char *env = getenv("KITSUNE_ALLOC_SITES");
+  if (!alloc_sites && env && strcmp(env, "0") != 0)
+    kitsune_alloc_sites(1);
+}
@@ -0,0 +1,12 @@
+#ifndef ALLOCSITES_INTERNAL_H
+#define ALLOCSITES_INTERNAL_H
+
+#include <stddef.h>
+
+void allocsites_init(void);
+
+unsigned int allocsites_id(void *caller, const char *type);
+void allocsites_charge(unsigned int id, size_t size);
+void allocsites_forget(unsigned int id, size_t size);
+
+#endif
@@ -3,131 +3,366 @@
 #include <stdlib.h>
 #include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
-#include <interval.h>
+#ifdef ALLOCTRACK_BTREE
+#include <interval_btree.h>
+#else
+#include <interval_gen.h>
+#endif
 
 #include "kitsune_internal.h"
 #include "alloctrack_internal.h"
+#include "pageclass_internal.h"
+#include "typedheap_internal.h"
+#include "allocsites_internal.h"
+#include "radix_internal.h"
+
+#ifdef ENABLE_THREADING
+#include <pthread.h>
+#define SHARD_LOCK(s) pthread_mutex_lock(&(s)->lock)
+#define SHARD_UNLOCK(s) pthread_mutex_unlock(&(s)->lock)
+#else
+#define SHARD_LOCK(s)
+#define SHARD_UNLOCK(s)
+#endif
+
+/*
+ * A block from kitsune_malloc/kitsune_calloc is preceded by a header that
+ * points at its alloc_area, tagged with both addresses, so that looking up or
+ * freeing a block by its start takes no search and no lock.  To find the
+ * block holding an interior pointer, areas are also indexed by address in
+ * shards of 1MB of address space, each an interval tree with its own lock; an
+ * area is entered in every shard it overlaps, through a link of its own for
+ * each.  Threads allocate from arenas of their own, so they mostly work in
+ * different shards.
+ */
+struct _alloc_area;
+
+typedef struct {
+#ifndef ALLOCTRACK_BTREE
+  struct itree_node node;
+#endif
+  struct _alloc_area *area;
+} alloc_link;
 
 typedef struct _alloc_area {
   void *start;
   void *end;
+  int headed;                   /* has an alloc_header */
+  void *owner;                  /* typed arena holding the block, or NULL */
+  unsigned int site;            /* see allocsites_id */
+  unsigned int nlinks;
+  alloc_link links[];           /* one per shard, in address order */
 } alloc_area;
 
-interval_tree alloced_areas;
-
-static void *al_area_start(void *r) {
-  return ((alloc_area *)r)->start;
+#ifdef ALLOCTRACK_BTREE
+static void *link_start(alloc_link *link)
+{
+  return link->area->start;
 }
-static void *al_area_end(void *r) {
-  return ((alloc_area *)r)->end;
+
+static void *link_last(alloc_link *link)
+{
+  alloc_area *a = link->area;
+  return a->end > a->start ? (char *)a->end - 1 : a->start;
 }
+
+INTERVAL_BTREE_DEFINE(link_tree, alloc_link, link_start, link_last)
+typedef struct ibtree link_index;
+#else
+INTERVAL_TREE_DEFINE(link_tree, alloc_link, node)
+typedef struct itree link_index;
+#endif
+
+/* Two words, so that the block stays as aligned as malloc made it. */
+typedef struct {
+  alloc_area *area;
+  uintptr_t tag;
+} alloc_header;
+_Static_assert(sizeof(alloc_header) == ALLOC_HEADER_SIZE, "alloc_header size");
+
+#define HEADER_TAG(area, start) \
+  ((uintptr_t)(area) ^ (uintptr_t)(start) ^ (uintptr_t)0x6b697473756e65ull)
+
+#define SHARD_SHIFT 20
+#define SHARD_LEVEL_BITS 14     /* two levels of shard number: 48-bit addresses */
+#define SHARD_LEVEL_SIZE (1 << SHARD_LEVEL_BITS)
+#define SHARD_MAX (1ull << (2 * SHARD_LEVEL_BITS))
+
+typedef struct {
+#ifdef ENABLE_THREADING
+  pthread_mutex_t lock;
+#endif
+  link_index tree;
+} alloc_shard;
+
+typedef struct { alloc_shard *shards[SHARD_LEVEL_SIZE]; } shard_leaf;
+typedef struct { shard_leaf *leaves[SHARD_LEVEL_SIZE]; } shard_table;
+
+/* Passed from version to version (see alloctrack_init). */
+shard_table *alloced_areas = NULL;
+
 void * alareas_get_start(alarea *a) {
   return ((alloc_area *)a)->start;
 }
 
-static int addr_compare(void *p0, void *p1)
+static alloc_shard *new_shard(void)
 {
-  /* Strictly speaking, we shouldn't be comparing pointers that might point to
-     arbitary addresses (e.g., not in the same array). :) */
-  ptrdiff_t diff = p0 - p1;
-  if (diff == 0)
-    return 0;
-  else if (diff > 0)
-    return 1;
-  else
-    return -1;
+  alloc_shard *s = calloc(1, sizeof(alloc_shard));  /* an empty tree */
+#ifdef ENABLE_THREADING
+  pthread_mutex_init(&s->lock, NULL);
+#endif
+  return s;
 }
 
-void * kitsune_calloc(int numobj, int size)
+/* The shard covering addr, or NULL if it does not exist and create is
+   false. */
+static alloc_shard *shard_for(uintptr_t addr, int create)
 {
-  alloc_area *new_area = malloc(sizeof(alloc_area));
-  void * start_addr = calloc(numobj, size);
+  uintptr_t n = addr >> SHARD_SHIFT;
+  shard_table *t = create ?
+    radix_alloc_level((void **)&alloced_areas, sizeof(shard_table)) :
+    __atomic_load_n(&alloced_areas, __ATOMIC_ACQUIRE);
+  if (!t || n >= SHARD_MAX)
+    return NULL;
+  void **leaf_slot = (void **)&t->leaves[n >> SHARD_LEVEL_BITS];
+  shard_leaf *leaf = create ? radix_alloc_level(leaf_slot, sizeof(shard_leaf)) :
+    __atomic_load_n(leaf_slot, __ATOMIC_ACQUIRE);
+  if (!leaf)
+    return NULL;
+  alloc_shard **slot = &leaf->shards[n & (SHARD_LEVEL_SIZE - 1)];
+  alloc_shard *s = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (s || !create)
+    return s;
+  alloc_shard *fresh = new_shard();
+  if (__atomic_compare_exchange_n(slot, &s, fresh, 0, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE))
+    return fresh;
+  free(fresh);
+  return s;
+}
 
-  new_area->start = start_addr;
-  new_area->end = start_addr + (numobj*size);
-  interval_tree_insert(&alloced_areas, new_area);
+static alloc_area *track(void *start, size_t size, int headed, void *owner,
+                         unsigned int site)
+{
+  /* the tree's intervals include their last byte */
+  char *last_byte = (char *)start + (size ? size - 1 : 0);
+  uintptr_t first = (uintptr_t)start >> SHARD_SHIFT;
+  uintptr_t s, last = (uintptr_t)last_byte >> SHARD_SHIFT;
+  alloc_area *area = malloc(sizeof(alloc_area) + (last - first + 1) * sizeof(alloc_link));
 
-  return start_addr;
+  area->start = start;
+  area->end = (char *)start + size;
+  area->headed = headed;
+  area->owner = owner;
+  area->site = site;
+  area->nlinks = last - first + 1;
+  allocsites_charge(site, size);
+  for (s = first; s <= last; s++) {
+    alloc_shard *shard = shard_for(s << SHARD_SHIFT, 1);
+    alloc_link *link = &area->links[s - first];
+    kitsune_assert(shard, "alloctrack: cannot track memory at %p", start);
+    link->area = area;
+    SHARD_LOCK(shard);
+    link_tree_insert(&shard->tree, link, start, last_byte);
+    SHARD_UNLOCK(shard);
+  }
+  return area;
 }
 
-void * kitsune_malloc(int size)
+static void untrack(alloc_area *area)
 {
-  alloc_area *new_area = malloc(sizeof(alloc_area));
-  void * start_addr = malloc(size);
+  uintptr_t first = (uintptr_t)area->start >> SHARD_SHIFT;
+  unsigned int i;
+
+  allocsites_forget(area->site, (char *)area->end - (char *)area->start);
+  for (i = 0; i < area->nlinks; i++) {
+    alloc_shard *shard = shard_for((first + i) << SHARD_SHIFT, 0);
+    SHARD_LOCK(shard);
+    link_tree_remove(&shard->tree, &area->links[i]);
+    SHARD_UNLOCK(shard);
+  }
+  free(area);
+}
 
-  new_area->start = start_addr;
-  new_area->end = start_addr + size;
-  interval_tree_insert(&alloced_areas, new_area);
+/* The area of the block starting at addr, found through its header. */
+static alloc_area *header_area(void *addr)
+{
+  alloc_header *h = (alloc_header *)addr - 1;
+  /* a header is on a tracked page, and blocks stay aligned */
+  if ((uintptr_t)addr % sizeof(alloc_header) || !pageclass_tracked(h))
+    return NULL;
+  /* pages are never untracked, so one that was unmapped may still be */
+  if (((uintptr_t)h ^ (uintptr_t)addr) >= 4096 && pageclass_type(h) == UNMAPPED)
+    return NULL;
+  alloc_area *area = h->area;
+  return h->tag == HEADER_TAG(area, addr) ? area : NULL;
+}
 
-  return start_addr;
+/* Put a block of size bytes in slot, which has room for a header first.
+   kitsune_free hands the slot back to owner if there is one (see
+   typedheap_release), or to free().  caller is the code that asked for the
+   block, for the census. */
+void *alloctrack_place(void *slot, size_t size, void *owner, void *caller)
+{
+  alloc_header *h = slot;
+  if (!h)
+    return NULL;
+  void *start = h + 1;
+  pageclass_mark_tracked(h, sizeof(alloc_header) + size);
+  h->area = track(start, size, 1, owner,
+                  allocsites_id(caller, owner ? typedheap_type(owner) : NULL));
+  h->tag = HEADER_TAG(h->area, start);
+  return start;
 }
 
-void kitsune_migrate_alloced_track(void * new_start_addr, void * new_end_addr, void * old_addr)
+/* Whether a live block from alloctrack_place starts at start. */
+int alloctrack_block_at(void *start)
+{
+  return header_area(start) != NULL;
+}
+
+/* The owner the block at start was placed with (its typed arena), or NULL. */
+void *alloctrack_owner(void *start)
 {
-  alloc_area *new_area = malloc(sizeof(alloc_area));
-  struct alarea *to_del = alloctrack_lookup_node(old_addr);    
+  alloc_area *area = header_area(start);
+  return area ? area->owner : NULL;
+}
 
-  new_area->start = new_start_addr;
-  new_area->end = new_end_addr;
-  interval_tree_insert(&alloced_areas, new_area);
+void * kitsune_calloc(int numobj, int size)
+{
+  return alloctrack_place(calloc(1, ALLOC_HEADER_SIZE + (size_t)numobj * size),
+                          (size_t)numobj * size, NULL, __builtin_return_address(0));
+}
 
-  if(to_del){
-     interval_tree_delete_node(&alloced_areas, to_del);
+void * kitsune_malloc(int size)
+{
+  return alloctrack_place(malloc(ALLOC_HEADER_SIZE + size), size, NULL,
+                          __builtin_return_address(0));
+}
+
+void kitsune_migrate_alloced_track(void * new_start_addr, void * new_end_addr, void * old_addr)
+{
+  alloc_area *old = (alloc_area *)alloctrack_lookup(old_addr);
+
+  pageclass_mark_tracked(new_start_addr, new_end_addr - new_start_addr);
+  /* the block keeps its site */
+  track(new_start_addr, new_end_addr - new_start_addr, 0, NULL,
+        old ? old->site : 0);
+  if (old) {
+     untrack(old);
   } else {
-     kitsune_log("WARNING: Attempted to remove memory from tree at %p but no mapping was found", old_addr);
+     kitsune_log_warn(KT_LOG_ALLOC, "Attempted to remove memory from tree at %p but no mapping was found", old_addr);
   }
 }
 
-//do we need to add thread-safety here, or can we rely on the underlying program (since we are basically just calling free as normal
+/* Frees from different threads only contend if their blocks share a shard. */
 void kitsune_free(void * head)
 {
-  struct alarea *to_del = alloctrack_lookup_node(head);    
-  if(to_del){
-     interval_tree_delete_node(&alloced_areas, to_del);
-     free(head);
+  alloc_area *area = header_area(head);
+  if (area) {
+    alloc_header *h = (alloc_header *)head - 1;
+    void *owner = area->owner;
+    h->tag = 0;
+    untrack(area);
+    if (owner)
+      typedheap_release(owner, h);
+    else
+      free(h);
+    return;
+  }
+  area = (alloc_area *)alloctrack_lookup(head);
+  if (area && area->start == head) {
+    untrack(area);
+    free(head);
   } else {
-     kitsune_assert(0, 
-                    "Attempted to free memory at %p but no mapping was found", 
+     kitsune_assert(0,
+                    "Attempted to free memory at %p but no mapping was found",
                     head);
   }
 }
 
-alarea *alloctrack_lookup_node(void *addr) 
-{  
-  alloc_area query;
-  query.start = query.end = addr;
-  return (alarea *)interval_tree_lookup_node(&alloced_areas, &query);
+alarea *alloctrack_lookup(void *addr)
+{
+  alloc_area *area = header_area(addr);
+  if (area)
+    return (alarea *)area;
+  if (!pageclass_tracked(addr))
+    return NULL;
+
+  alloc_shard *shard = shard_for((uintptr_t)addr, 0);
+  if (!shard)
+    return NULL;
+  SHARD_LOCK(shard);
+  alloc_link *link = link_tree_lookup(&shard->tree, addr, addr);
+  SHARD_UNLOCK(shard);
+  return (alarea *)(link ? link->area : NULL);
 }
 
-alarea *alloctrack_lookup(void *addr) 
-{  
-  alloc_area query;
-  query.start = query.end = addr;
-  return (alarea *)interval_tree_lookup(&alloced_areas, &query);
+/* Call fn on every shard. */
+static void shards_each(void (*fn)(alloc_shard *))
+{
+  int i, j;
+  if (!alloced_areas)
+    return;
+  for (i = 0; i < SHARD_LEVEL_SIZE; i++) {
+    shard_leaf *leaf = alloced_areas->leaves[i];
+    if (!leaf)
+      continue;
+    for (j = 0; j < SHARD_LEVEL_SIZE; j++)
+      if (leaf->shards[j])
+        fn(leaf->shards[j]);
+  }
+}
+
+/* Shards are visited in address order, so an area's last link is the last
+   one torn down. */
+static void link_free(alloc_link *link)
+{
+  if (link == &link->area->links[link->area->nlinks - 1])
+    free(link->area);
+}
+
+static void shard_free(alloc_shard *s)
+{
+  link_tree_teardown(&s->tree, link_free);
+  free(s);
 }
 
+#ifdef ALLOCTRACK_BTREE
+static void shard_compact(alloc_shard *s)
+{
+  ibtree_compact(&s->tree);
+}
+#endif
 
 /* clear should be called once we reach the target update point */
 void alloctrack_free(void)
 {
   //Do we need to check for unmigrated areas?
-  interval_tree_free(&alloced_areas);
+  int i;
+  shards_each(shard_free);
+  if (alloced_areas) {
+    for (i = 0; i < SHARD_LEVEL_SIZE; i++)
+      free(alloced_areas->leaves[i]);
+    free(alloced_areas);
+  }
+  alloced_areas = NULL;
 }
 
 /* init should be called during startup */
 void alloctrack_init(void)
 {
   if (kitsune_is_updating()) {
-    alloced_areas = *(char **)kitsune_get_val("alloced_areas");
-    interval_tree_reinit_fptrs(&alloced_areas, al_area_start, al_area_end, addr_compare);
-    kitsune_log("Updating alloctree:  %p\n", alloced_areas);
+    alloced_areas = *(shard_table **)kitsune_get_val("alloced_areas");
+#ifdef ALLOCTRACK_BTREE
+    /* the transformation is about to look up a great deal: fill the nodes
+       that frees have thinned out */
+    shards_each(shard_compact);
+#endif
+    kitsune_log_debug(KT_LOG_ALLOC, "Updating alloctree:  %p\n", alloced_areas);
   }
-
-  else{
-    interval_tree_init(&alloced_areas, al_area_start, al_area_end, addr_compare);
-  }
-
 }
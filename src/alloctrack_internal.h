@@ -2,6 +2,10 @@
 #define ALLOCT_INTERNAL_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+/* Room to leave before a block for alloctrack_place. */
+#define ALLOC_HEADER_SIZE (2 * sizeof(void *))
 
 struct alarea;
 typedef struct alarea alarea;
@@ -10,11 +14,15 @@ void alloctrack_free(void);
 void alloctrack_init(void);
 
 alarea *alloctrack_lookup(void *addr);
-alarea *alloctrack_lookup_node(void *addr); 
 void * alareas_get_start(alarea *a);
 
+void *alloctrack_place(void *slot, size_t size, void *owner, void *caller);
+int alloctrack_block_at(void *start);
+void *alloctrack_owner(void *start);
+
 void kitsune_migrate_alloced_track(void * new_start_addr, void * new_end_addr, void * old_addr);
 void * kitsune_malloc(int size);
 void * kitsune_calloc(int numobj, int size);
+void * kitsune_malloc_typed(int size, const char *type);
 void kitsune_free(void * head);
 #endif
@@ -1,169 +1,209 @@
-
-#include <sys/time.h> 
-#include <sys/resource.h> 
-#include <unistd.h>
-#include "ktlog.h"
-#include "kitsune.h"
-#include "ktthreads_internal.h"
+/*
+ * Update benchmarking (driver -b FILE).  Each update is divided into a fixed
+ * set of phases, timed on CLOCK_MONOTONIC, each with the page faults and
+ * context switches (from getrusage) that happened during it:
+ *
+ *   quiesce   from the first thread reaching an update point to the old
+ *             version leaving for the driver
+ *   load      the trip through the driver (longjmp and dlopen) and the new
+ *             version's first steps: logging and thread bookkeeping
+ *   migrate   the new version's start-up before main(): waiting for the old
+ *             threads, stack and registered variable migration
+ *   restart   main() back to the update point (the program's own migration)
+ *   teardown  relaunching the threads, committing and unloading the old
+ *             version
+ *
+ * After each update a row per phase, and one for the whole update, is
+ * appended to FILE: as CSV (update,phase,ms,minflt,majflt,nvcsw,nivcsw, with
+ * a header if FILE is new) or, if FILE ends in ".json", as one JSON object
+ * per line.  The counters are kept in one table handed from version to
+ * version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <assert.h>
 
-const char *bench_log_filename = NULL;
-struct timeval bench_start_time;
-float bench_quiesce_time;
-struct timeval bench_restart_time;
-int bench_started = 0;
-
-void bench_init(const char *bench_filename) {
-  bench_log_filename = bench_filename;
-  if (bench_log_filename && kitsune_is_updating()) {
-    bench_start_time = *(struct timeval *)kitsune_get_val("bench_start_time");
-    bench_quiesce_time = *(float *)kitsune_get_val("bench_quiesce_time");
-    bench_started = *(int *)kitsune_get_val("bench_started");
-  }
-}
-
-
-void bench_log_resource_usage(void) {
-
-  if (!bench_log_filename)
-    return; /* benchmarking not enabled */
-
+#include "kitsune_internal.h"
+#include "ktthreads_internal.h"
+#include "bench_internal.h"
+
+typedef struct {
+  uint64_t ns;
+  long minflt;                  /* page faults served without I/O */
+  long majflt;                  /* and with */
+  long nvcsw;                   /* voluntary context switches */
+  long nivcsw;                  /* involuntary ones */
+} bench_counters;
+
+typedef struct {
+  int updates;                  /* written so far */
+  int started;
+  bench_phase phase;            /* the one under way */
+  bench_counters mark;          /* at its start */
+  bench_counters phases[BENCH_PHASES];
+  size_t xform_allocs;
+  size_t xform_bytes;
+} bench_state;
+
+static const char *phase_names[BENCH_PHASES] = {
+  "quiesce", "load", "migrate", "restart", "teardown"
+};
+
+static const char *bench_log_filename = NULL;
+
+/* Passed from version to version (see bench_init). */
+bench_state *kitsune_bench = NULL;
+
+static void counters_now(bench_counters *c)
+{
+  struct timespec ts;
   struct rusage usage;
-  
-  if (getrusage(RUSAGE_SELF, &usage)) {
-    kitsune_log("getrusage: failed");
-    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  c->ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    c->minflt = usage.ru_minflt;
+    c->majflt = usage.ru_majflt;
+    c->nvcsw = usage.ru_nvcsw;
+    c->nivcsw = usage.ru_nivcsw;
   }
-
-  kitsune_log("RESOURCE USAGE:\n"
-             "maxrss: %ul\n" /* maximum resident set size */
-             "ixrss: %ul\n" /* integral shared memory size */
-             "idrss: %ul\n" /* integral unshared data size */
-             "isrss: %ul\n" /* integral unshared stack size */
-             "minfl: %ul\n" /* page reclaims */
-             "majfl: %ul\n" /* page faults */
-             "nswap: %ul\n" /* swaps */
-             "inblo: %ul\n" /* block input operations */
-             "oublo: %ul\n" /* block output operations */
-             "msgsn: %ul\n" /* messages sent */
-             "msgrc: %ul\n" /* messages received */
-             "nsign: %ul\n" /* signals received */
-             "nvcsw: %ul\n" /* voluntary context switches */
-             "nivcs: %ul\n" /* involuntary context switches */,             
-             usage.ru_maxrss, usage.ru_ixrss, usage.ru_idrss, usage.ru_isrss, usage.ru_minflt, 
-             usage.ru_majflt, usage.ru_nswap, usage.ru_inblock, usage.ru_oublock, usage.ru_msgsnd, 
-             usage.ru_msgrcv, usage.ru_nsignals, usage.ru_nvcsw, usage.ru_nivcsw);
-
 }
 
-static int total_alloc_size = 0;
-static int total_alloc_count = 0;
-
-void bench_xform_alloc(int sz) {
-  total_alloc_count++;
-  total_alloc_size += sz;
-}
-
-void bench_start(void) {
+void bench_init(const char *bench_filename) {
+  bench_log_filename = bench_filename;
   if (!bench_log_filename)
     return; /* benchmarking not enabled */
-
-#ifdef ENABLE_THREADING
-  ktthread_lock();
-#endif
-  if (!bench_started) {
-    gettimeofday(&bench_start_time, NULL);
-    bench_started = 1;
+  if (kitsune_is_updating()) {
+    bench_state **prev = kitsune_get_val("kitsune_bench");
+    if (prev && *prev)
+      kitsune_bench = *prev;
   }
-#ifdef ENABLE_THREADING
-  ktthread_unlock();
-#endif
+  if (!kitsune_bench)
+    kitsune_bench = calloc(1, sizeof(bench_state));
 }
 
-/* timeval_subtract taken from: 
-   http://www.gnu.org/s/libc/manual/html_node/Elapsed-Time.html */
-/* Subtract the `struct timeval' values X and Y,
-   storing the result in RESULT.
-   Return 1 if the difference is negative, otherwise 0.  */
-static int timeval_subtract(struct timeval *result, 
-                     struct timeval *x, 
-                     struct timeval *y)
+/* Charge what has passed since the last mark to the phase under way, and
+   start phase next. */
+static void bench_switch(bench_phase next)
 {
-  /* Perform the carry for the later subtraction by updating y. */
-  if (x->tv_usec < y->tv_usec) {
-    int nsec = (y->tv_usec - x->tv_usec) / 1000000 + 1;
-    y->tv_usec -= 1000000 * nsec;
-    y->tv_sec += nsec;
-  }
-  if (x->tv_usec - y->tv_usec > 1000000) {
-    int nsec = (y->tv_usec - x->tv_usec) / 1000000;
-    y->tv_usec += 1000000 * nsec;
-    y->tv_sec -= nsec;
+  bench_counters now;
+  bench_state *b = kitsune_bench;
+  counters_now(&now);
+  if (b->phase < BENCH_PHASES) {
+    bench_counters *c = &b->phases[b->phase];
+    c->ns += now.ns - b->mark.ns;
+    c->minflt += now.minflt - b->mark.minflt;
+    c->majflt += now.majflt - b->mark.majflt;
+    c->nvcsw += now.nvcsw - b->mark.nvcsw;
+    c->nivcsw += now.nivcsw - b->mark.nivcsw;
   }
+  b->mark = now;
+  b->phase = next;
+}
 
-  /* Compute the time remaining to wait.
-     tv_usec is certainly positive. */
-  result->tv_sec = x->tv_sec - y->tv_sec;
-  result->tv_usec = x->tv_usec - y->tv_usec;
-  
-  /* Return 1 if result is negative. */
-  return x->tv_sec < y->tv_sec;
+void bench_xform_alloc(size_t sz) {
+  if (!kitsune_bench)
+    return;
+  __sync_fetch_and_add(&kitsune_bench->xform_allocs, 1);
+  __sync_fetch_and_add(&kitsune_bench->xform_bytes, sz);
 }
 
-void bench_finish(void) {
-  if (!bench_log_filename)
+void bench_start(void) {
+  if (!kitsune_bench)
     return; /* benchmarking not enabled */
 
-  assert(bench_started);
-#ifdef ENABLE_THREADING
-  assert(ktthread_is_main());
-#endif
-  bench_started = 0;
-
-  struct timeval end_time, diff_time;
-  gettimeofday(&end_time, NULL);
-  if (timeval_subtract(&diff_time, &end_time, &bench_start_time)) {
-    assert(0);
-  }
-  long total = diff_time.tv_sec * 1000000 + diff_time.tv_usec;
-
-  if (timeval_subtract(&diff_time, &end_time, &bench_restart_time)) {
-    assert(0);
+  /* Only the first thread to reach an update point starts the clock. */
+  if (__sync_bool_compare_and_swap(&kitsune_bench->started, 0, 1)) {
+    memset(kitsune_bench->phases, 0, sizeof(kitsune_bench->phases));
+    kitsune_bench->xform_allocs = kitsune_bench->xform_bytes = 0;
+    kitsune_bench->phase = BENCH_PHASES;
+    bench_switch(BENCH_QUIESCE);
   }
-  long restart = diff_time.tv_sec * 1000000 + diff_time.tv_usec;
-
-  FILE *results = fopen(bench_log_filename, "a");
-  if (results) {
-    fprintf(results, "%.4f %.4f %.4f\n", bench_quiesce_time, restart/1000.0, total/1000.0);
-    fclose(results);
-  } 
 }
 
-void bench_quiesce_finish(void) {
-  if (!bench_log_filename)
-    return; /* benchmarking not enabled */
+/* The update was abandoned; the next attempt records its own phases. */
+void bench_cancel(void) {
+  if (kitsune_bench)
+    kitsune_bench->started = 0;
+}
 
-  assert(bench_started);
+/**
+ * The update under way has reached phase, which the previous one ends.
+ */
+void bench_phase_start(bench_phase phase) {
+  if (!kitsune_bench || !kitsune_bench->started)
+    return; /* benchmarking not enabled, or no update under way */
 #ifdef ENABLE_THREADING
   assert(ktthread_is_main());
 #endif
-  
-  struct timeval end_time, diff_time;
-  gettimeofday(&end_time, NULL);
-  if (timeval_subtract(&diff_time, &end_time, &bench_start_time)) {
-    assert(0);
-  }
-
-  bench_quiesce_time = (diff_time.tv_sec * 1000000 + diff_time.tv_usec) / 1000.0;
+  bench_switch(phase);
 }
 
-void bench_restart_start(void) {
-  if (!bench_log_filename)
-    return; /* benchmarking not enabled */
+static void write_row(FILE *out, int json, int update, const char *name,
+                      const bench_counters *c, int first)
+{
+  if (json)
+    fprintf(out, "%s\"%s\":{\"ms\":%.4f,\"minflt\":%ld,\"majflt\":%ld,"
+            "\"nvcsw\":%ld,\"nivcsw\":%ld}", first ? "" : ",", name,
+            c->ns / 1000000.0, c->minflt, c->majflt, c->nvcsw, c->nivcsw);
+  else
+    fprintf(out, "%d,%s,%.4f,%ld,%ld,%ld,%ld\n", update, name,
+            c->ns / 1000000.0, c->minflt, c->majflt, c->nvcsw, c->nivcsw);
+}
 
+/**
+ * The update is done: end its last phase and append its counters to the
+ * results file.
+ */
+void bench_finish(void) {
+  bench_state *b = kitsune_bench;
+  if (!b || !b->started)
+    return; /* benchmarking not enabled, or no update under way */
 #ifdef ENABLE_THREADING
   assert(ktthread_is_main());
 #endif
+  bench_switch(BENCH_PHASES);
+  b->started = 0;
+
+  bench_counters total = { 0, 0, 0, 0, 0 };
+  int i;
+  for (i = 0; i < BENCH_PHASES; i++) {
+    total.ns += b->phases[i].ns;
+    total.minflt += b->phases[i].minflt;
+    total.majflt += b->phases[i].majflt;
+    total.nvcsw += b->phases[i].nvcsw;
+    total.nivcsw += b->phases[i].nivcsw;
+  }
 
-  gettimeofday(&bench_restart_time, NULL);
+  size_t len = strlen(bench_log_filename);
+  int json = len > 5 && strcmp(bench_log_filename + len - 5, ".json") == 0;
+  FILE *results = fopen(bench_log_filename, "a");
+  if (!results) {
+    kitsune_log_warn(KT_LOG_UPDATE, "bench: cannot write %s", bench_log_filename);
+    return;
+  }
+  int update = ++b->updates;
+  if (json) {
+    fprintf(results, "{\"update\":%d,\"xform_allocs\":%lu,\"xform_bytes\":%lu,"
+            "\"phases\":{", update, (unsigned long)b->xform_allocs,
+            (unsigned long)b->xform_bytes);
+    for (i = 0; i < BENCH_PHASES; i++)
+      write_row(results, 1, update, phase_names[i], &b->phases[i], i == 0);
+    fputs("},", results);
+    write_row(results, 1, update, "total", &total, 1);
+    fputs("}\n", results);
+  } else {
+    fseek(results, 0, SEEK_END);
+    if (ftell(results) == 0)
+      fputs("update,phase,ms,minflt,majflt,nvcsw,nivcsw\n", results);
+    for (i = 0; i < BENCH_PHASES; i++)
+      write_row(results, 0, update, phase_names[i], &b->phases[i], 0);
+    write_row(results, 0, update, "total", &total, 0);
+  }
+  fclose(results);
 }
@@ -3,12 +3,21 @@
 
 #include <stdlib.h>
 
+/* The phases of an update, in order (see bench.c). */
+typedef enum {
+  BENCH_QUIESCE,
+  BENCH_LOAD,
+  BENCH_MIGRATE,
+  BENCH_RESTART,
+  BENCH_TEARDOWN,
+  BENCH_PHASES
+} bench_phase;
+
 void bench_init(const char *bench_filename);
-void bench_log_resource_usage(void);
 void bench_start(void);
+void bench_phase_start(bench_phase phase);
 void bench_finish(void);
+void bench_cancel(void);
 void bench_xform_alloc(size_t sz);
-void bench_quiesce_finish(void);
-void bench_restart_start(void);
 
 #endif
@@ -0,0 +1,842 @@
+/**
+ * control.c serves the driver's control socket (see control.h) and keeps the
+ * library preloaded by "preload" and "update" until the update takes it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "control.h"
+
+#define CONTROL_MAX_PHASES 64
+#define CONTROL_MAX_CHAIN 8
+#define CONTROL_MAX_PRELOADS 8
+#define CONTROL_LINE 512
+
+static void (**request_update)(void);
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int listen_fd = -1;
+
+static pthread_mutex_t control_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t control_changed = PTHREAD_COND_INITIALIZER;
+
+/* The running version and the phases of the most recent update, in ms since
+   it was requested. */
+static char *cur_version = NULL;
+static void *cur_handle = NULL;
+static char *prev_version = NULL;    /* restored if the update rolls back */
+static void *prev_handle = NULL;
+static int version_changed = 0;      /* ...having loaded the new version */
+static int updates = 0;
+static int aborts = 0;
+static int update_active = 0;
+static int update_aborted = 0;
+static int update_rolled_back = 0;
+static int hops_done = 0;
+static uint64_t request_ns;
+static struct {
+  char name[32];
+  double ms;
+  int hop;
+} phases[CONTROL_MAX_PHASES];
+static int nphases = 0;
+
+/* The versions an update passes through: more than one makes it a
+   multi-version hop, taken in a single pause (see kitsune_driver_event). */
+static char *chain[CONTROL_MAX_CHAIN];
+static int chain_len = 0;
+static int chain_next = 0;
+
+/* Dry runs: the runtime forks at the update point (see
+   kitsune_driver_dry_run) and the child takes the update, writing its phases
+   to dry_run_fd, then exits once it is done.  The parent carries on. */
+static int dry_run_fd = -1;
+static int dry_run_forking = 0;
+static int in_dry_run = 0;
+
+/* Preloaded libraries, oldest first. */
+static int preload_busy = 0;
+static struct {
+  char *path;
+  void *handle;
+} preloads[CONTROL_MAX_PRELOADS];
+static int npreloads = 0;
+static double preload_ms = 0;
+
+/* The preloaded library holding a pre-copy of the running version's state
+   (see precopy.c), and how to cut one short while it is running. */
+static void *precopied = NULL;
+static void (*precopy_cancel)(void) = NULL;
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void reply(int fd, const char *fmt, ...)
+{
+  char buf[CONTROL_LINE];
+  va_list args;
+
+  va_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (len > (int)sizeof(buf) - 1)
+    len = sizeof(buf) - 1;
+  if (len > 0)
+    send(fd, buf, len, MSG_NOSIGNAL);
+}
+
+/* Must hold control_lock. */
+static void clear_chain(void)
+{
+  int i;
+  for (i = 0; i < chain_len; i++)
+    free(chain[i]);
+  chain_len = chain_next = 0;
+}
+
+/* Must hold control_lock. */
+static void begin_update(void)
+{
+  update_active = 1;
+  update_aborted = 0;
+  update_rolled_back = 0;
+  version_changed = 0;
+  hops_done = 0;
+  nphases = 0;
+  request_ns = monotonic_ns();
+}
+
+/*
+ * Returns true on "done" if more versions of a multi-version hop are queued;
+ * the runtime then requests the next update straight away, so that it is
+ * taken at the same update point and the intermediate version never resumes
+ * normal execution.
+ */
+int kitsune_driver_event(const char *phase)
+{
+  int rolled_back = strcmp(phase, "rolledback") == 0;
+  int terminal = strcmp(phase, "done") == 0 || strcmp(phase, "aborted") == 0 ||
+    rolled_back;
+  int more = 0;
+
+  if (in_dry_run) {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "phase %s %.3f\n", phase,
+                       (monotonic_ns() - request_ns) / 1000000.0);
+    /* the child never resumes the old version after a rollback */
+    if (write(dry_run_fd, line, len) != len || terminal)
+      _exit(rolled_back);
+    return 0;
+  }
+
+  pthread_mutex_lock(&control_lock);
+  if (!update_active && terminal) {
+    /* already settled (e.g., by another thread) */
+    pthread_mutex_unlock(&control_lock);
+    return 0;
+  }
+  /* updates requested by signal are only noticed once they are under way */
+  if (!update_active)
+    begin_update();
+  if (nphases < CONTROL_MAX_PHASES) {
+    snprintf(phases[nphases].name, sizeof(phases[nphases].name), "%s", phase);
+    phases[nphases].ms = (monotonic_ns() - request_ns) / 1000000.0;
+    phases[nphases].hop = hops_done + 1;
+    nphases++;
+  }
+  if (strcmp(phase, "done") == 0) {
+    updates++;
+    hops_done++;
+    more = chain_next < chain_len;
+    if (!more) {
+      update_active = 0;
+      clear_chain();
+    }
+  } else if (terminal) {
+    update_active = 0;
+    update_aborted = 1;
+    update_rolled_back = rolled_back;
+    if (rolled_back && version_changed) {
+      free(cur_version);
+      cur_version = prev_version;
+      cur_handle = prev_handle;
+      prev_version = NULL;
+    }
+    aborts++;
+    clear_chain();
+    if (dry_run_fd >= 0) {
+      close(dry_run_fd);
+      dry_run_fd = -1;
+      dry_run_forking = 0;
+    }
+  }
+  pthread_cond_broadcast(&control_changed);
+  pthread_mutex_unlock(&control_lock);
+  return more;
+}
+
+/* Called by the runtime's main thread once the threads are quiescent; if it
+   returns true the runtime forks, and the atfork handlers below tell the
+   parent and the child apart. */
+int kitsune_driver_dry_run(void)
+{
+  pthread_mutex_lock(&control_lock);
+  dry_run_forking = dry_run_fd >= 0;
+  int result = dry_run_forking;
+  pthread_mutex_unlock(&control_lock);
+  return result;
+}
+
+static void dry_run_atfork_parent(void)
+{
+  if (!dry_run_forking)
+    return;
+  pthread_mutex_lock(&control_lock);
+  close(dry_run_fd);
+  dry_run_fd = -1;
+  dry_run_forking = 0;
+  update_active = 0;
+  clear_chain();
+  pthread_cond_broadcast(&control_changed);
+  pthread_mutex_unlock(&control_lock);
+}
+
+/* Returns true in the dry-run child, which reports through the pipe (its
+   stderr too, so that failing assertions reach the client) and needs no
+   control socket of its own. */
+static int dry_run_atfork_child(void)
+{
+  if (!dry_run_forking)
+    return 0;
+  char line[32];
+  int len = snprintf(line, sizeof(line), "child %d\n", getpid());
+  int devnull = open("/dev/null", O_WRONLY);
+  if (devnull >= 0) {
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+  }
+  dup2(dry_run_fd, STDERR_FILENO);
+  in_dry_run = 1;
+  dry_run_forking = 0;
+  if (write(dry_run_fd, line, len) != len)
+    _exit(1);
+  return 1;
+}
+
+/*
+ * Preloading
+ * ==========
+ *
+ * Loading the next version (relocation, symbol binding, running its
+ * constructors and faulting in its pages) would otherwise happen after the
+ * longjmp, while every thread is stopped.  Instead the client's connection
+ * thread dlopens it and touches all of its pages while the current version
+ * keeps running; the update then only has to pick up the handle.
+ */
+static int prefault_segments(struct dl_phdr_info *info, size_t size, void *data)
+{
+  ElfW(Addr) base = *(ElfW(Addr) *)data;
+  long page = sysconf(_SC_PAGESIZE);
+  int i;
+
+  if (info->dlpi_addr != base)
+    return 0;
+  for (i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+    if (ph->p_type != PT_LOAD)
+      continue;
+    /* read only: writable pages may already be read-only again (RELRO) */
+    volatile const char *p = (const char *)((base + ph->p_vaddr) & ~(page - 1));
+    volatile const char *end = (const char *)(base + ph->p_vaddr + ph->p_memsz);
+    for (; p < end; p += page)
+      (void)*p;
+  }
+  return 1;
+}
+
+static void prefault(void *handle)
+{
+  struct link_map *map;
+  if (dlinfo(handle, RTLD_DI_LINKMAP, &map) == 0)
+    dl_iterate_phdr(prefault_segments, &map->l_addr);
+}
+
+/* Preload path unless it already is.  Returns NULL or the dlopen error. */
+static char *preload(const char *path)
+{
+  char *error = NULL;
+
+  int i;
+
+  pthread_mutex_lock(&control_lock);
+  while (preload_busy)
+    pthread_cond_wait(&control_changed, &control_lock);
+  for (i = 0; i < npreloads; i++) {
+    if (strcmp(preloads[i].path, path) == 0) {
+      pthread_mutex_unlock(&control_lock);
+      return NULL;
+    }
+  }
+  preload_busy = 1;
+  pthread_mutex_unlock(&control_lock);
+
+  uint64_t start = monotonic_ns();
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle)
+    prefault(handle);
+  else
+    error = strdup(dlerror());
+
+  pthread_mutex_lock(&control_lock);
+  if (handle) {
+    if (npreloads == CONTROL_MAX_PRELOADS) {
+      dlclose(preloads[0].handle);
+      free(preloads[0].path);
+      memmove(&preloads[0], &preloads[1], sizeof(preloads[0]) * --npreloads);
+    }
+    preloads[npreloads].path = strdup(path);
+    preloads[npreloads].handle = handle;
+    npreloads++;
+  }
+  preload_ms = (monotonic_ns() - start) / 1000000.0;
+  preload_busy = 0;
+  pthread_cond_broadcast(&control_changed);
+  pthread_mutex_unlock(&control_lock);
+  return error;
+}
+
+void *control_take_preloaded(const char *path)
+{
+  void *handle = NULL;
+  int i;
+
+  pthread_mutex_lock(&control_lock);
+  /* the pre-copy stops at the next variable; the update redoes the rest */
+  if (precopy_cancel)
+    precopy_cancel();
+  while (preload_busy)
+    pthread_cond_wait(&control_changed, &control_lock);
+  for (i = 0; i < npreloads; i++) {
+    if (strcmp(preloads[i].path, path) == 0) {
+      handle = preloads[i].handle;
+      if (handle == precopied)
+        precopied = NULL;
+      free(preloads[i].path);
+      memmove(&preloads[i], &preloads[i + 1], sizeof(preloads[0]) * (npreloads - i - 1));
+      npreloads--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&control_lock);
+  return handle;
+}
+
+char *control_take_update_path(void)
+{
+  char *path = NULL;
+  pthread_mutex_lock(&control_lock);
+  if (chain_next < chain_len)
+    path = strdup(chain[chain_next++]);
+  pthread_mutex_unlock(&control_lock);
+  return path;
+}
+
+void control_set_version(const char *path, void *handle)
+{
+  pthread_mutex_lock(&control_lock);
+  free(prev_version);
+  prev_version = cur_version;
+  prev_handle = cur_handle;
+  cur_version = strdup(path);
+  cur_handle = handle;
+  version_changed = update_active;
+  pthread_mutex_unlock(&control_lock);
+}
+
+/*
+ * Commands
+ * ========
+ */
+static void cmd_preload(int fd, char *path)
+{
+  if (path[0] != '/') {
+    reply(fd, "error library paths must be absolute\n");
+    return;
+  }
+  char *error = preload(path);
+  if (error) {
+    reply(fd, "error %s\n", error);
+    free(error);
+    return;
+  }
+  pthread_mutex_lock(&control_lock);
+  double ms = preload_ms;
+  pthread_mutex_unlock(&control_lock);
+  reply(fd, "preload %.3f\n", ms);
+  reply(fd, "ok\n");
+}
+
+/* Preload path and have it transform the running version's state ahead of
+   the update (see kitsune_precopy). */
+static void cmd_precopy(int fd, char *path)
+{
+  int (*run)(void *, void *);
+  void (*cancel)(void), (*discard)(void *);
+  void *handle = NULL, *from;
+  int i;
+
+  if (path[0] != '/') {
+    reply(fd, "error library paths must be absolute\n");
+    return;
+  }
+  char *error = preload(path);
+  if (error) {
+    reply(fd, "error %s\n", error);
+    free(error);
+    return;
+  }
+
+  /* Holding preload_busy keeps the library from being taken (or evicted)
+     while the pre-copy runs; an update that arrives meanwhile cancels it. */
+  pthread_mutex_lock(&control_lock);
+  while (preload_busy)
+    pthread_cond_wait(&control_changed, &control_lock);
+  for (i = 0; i < npreloads; i++)
+    if (strcmp(preloads[i].path, path) == 0)
+      handle = preloads[i].handle;
+  if (!handle) {
+    pthread_mutex_unlock(&control_lock);
+    reply(fd, "error %s is no longer preloaded\n", path);
+    return;
+  }
+  if (update_active || chain_len) {
+    pthread_mutex_unlock(&control_lock);
+    reply(fd, "error an update is already in progress\n");
+    return;
+  }
+  run = (int (*)(void *, void *))dlsym(handle, "kitsune_precopy");
+  cancel = (void (*)(void))dlsym(handle, "kitsune_precopy_cancel");
+  if (!run || !cancel) {
+    pthread_mutex_unlock(&control_lock);
+    reply(fd, "error %s has no kitsune runtime\n", path);
+    return;
+  }
+  /* only one pre-copy is kept */
+  if (precopied && precopied != handle) {
+    for (i = 0; i < npreloads; i++) {
+      if (preloads[i].handle == precopied) {
+        discard = (void (*)(void *))dlsym(precopied, "kitsune_precopy_discard");
+        if (discard)
+          discard(cur_handle);
+      }
+    }
+  }
+  precopied = handle;
+  precopy_cancel = cancel;
+  from = cur_handle;
+  preload_busy = 1;
+  pthread_mutex_unlock(&control_lock);
+
+  uint64_t start = monotonic_ns();
+  int copied = run(from, handle);
+  double ms = (monotonic_ns() - start) / 1000000.0;
+
+  pthread_mutex_lock(&control_lock);
+  precopy_cancel = NULL;
+  preload_busy = 0;
+  pthread_cond_broadcast(&control_changed);
+  pthread_mutex_unlock(&control_lock);
+  if (copied < 0) {
+    reply(fd, "error the pre-copy was abandoned\n");
+    return;
+  }
+  reply(fd, "precopy %d %.3f\n", copied, ms);
+  reply(fd, "ok\n");
+}
+
+/* Update through each of the space-separated paths in turn. */
+static void cmd_update(int fd, char *paths)
+{
+  char *hops[CONTROL_MAX_CHAIN], *path, *save;
+  int count = 0, i;
+
+  for (path = strtok_r(paths, " ", &save); path; path = strtok_r(NULL, " ", &save)) {
+    if (count == CONTROL_MAX_CHAIN) {
+      reply(fd, "error at most %d versions per update\n", CONTROL_MAX_CHAIN);
+      return;
+    }
+    if (path[0] != '/') {
+      reply(fd, "error library paths must be absolute\n");
+      return;
+    }
+    hops[count++] = path;
+  }
+  if (count == 0) {
+    /* "update " with only blanks: the driver would find nothing to load */
+    reply(fd, "error update needs a library path\n");
+    return;
+  }
+  for (i = 0; i < count; i++) {
+    char *error = preload(hops[i]);
+    if (error) {
+      reply(fd, "error %s\n", error);
+      free(error);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&control_lock);
+  if (update_active || chain_len) {
+    pthread_mutex_unlock(&control_lock);
+    reply(fd, "error an update is already in progress\n");
+    return;
+  }
+  begin_update();
+  for (i = 0; i < count; i++)
+    chain[i] = strdup(hops[i]);
+  chain_len = count;
+  pthread_mutex_unlock(&control_lock);
+  (*request_update)();
+
+  /* Stream the phases as the runtime reports them. */
+  int sent = 0;
+  pthread_mutex_lock(&control_lock);
+  for (;;) {
+    while (sent < nphases) {
+      char name[32];
+      double ms = phases[sent].ms;
+      int hop = phases[sent].hop;
+      memcpy(name, phases[sent].name, sizeof(name));
+      sent++;
+      pthread_mutex_unlock(&control_lock);
+      if (count > 1)
+        reply(fd, "phase %s %.3f hop %d\n", name, ms, hop);
+      else
+        reply(fd, "phase %s %.3f\n", name, ms);
+      pthread_mutex_lock(&control_lock);
+    }
+    if (!update_active)
+      break;
+    pthread_cond_wait(&control_changed, &control_lock);
+  }
+  int aborted = update_aborted, rolled_back = update_rolled_back;
+  pthread_mutex_unlock(&control_lock);
+  if (rolled_back)
+    reply(fd, "error update rolled back\n");
+  else
+    reply(fd, aborted ? "error update aborted\n" : "ok\n");
+}
+
+/* Take the update to path in a forked child and report how it went. */
+static void cmd_dryrun(int fd, char *path)
+{
+  int pipefd[2];
+
+  if (path[0] != '/') {
+    reply(fd, "error library paths must be absolute\n");
+    return;
+  }
+  char *error = preload(path);
+  if (error) {
+    reply(fd, "error %s\n", error);
+    free(error);
+    return;
+  }
+  if (pipe2(pipefd, O_CLOEXEC)) {
+    reply(fd, "error pipe: %s\n", strerror(errno));
+    return;
+  }
+
+  pthread_mutex_lock(&control_lock);
+  if (update_active || chain_len) {
+    pthread_mutex_unlock(&control_lock);
+    close(pipefd[0]);
+    close(pipefd[1]);
+    reply(fd, "error an update is already in progress\n");
+    return;
+  }
+  begin_update();
+  chain[0] = strdup(path);
+  chain_len = 1;
+  dry_run_fd = pipefd[1];
+  pthread_mutex_unlock(&control_lock);
+  (*request_update)();
+
+  /* The write end closes in the parent at the fork (or if the update is
+     abandoned first), so this reads until the child is gone. */
+  FILE *in = fdopen(pipefd[0], "r");
+  char line[CONTROL_LINE], name[32];
+  pid_t child = -1;
+  int done = 0, rolled_back = 0;
+  double ms;
+  while (fgets(line, sizeof(line), in)) {
+    if (sscanf(line, "child %d", &child) == 1)
+      continue;
+    if (sscanf(line, "phase %31s %lf", name, &ms) == 2) {
+      done |= strcmp(name, "done") == 0;
+      rolled_back |= strcmp(name, "rolledback") == 0;
+      pthread_mutex_lock(&control_lock);
+      if (nphases < CONTROL_MAX_PHASES) {
+        snprintf(phases[nphases].name, sizeof(phases[nphases].name), "%s", name);
+        phases[nphases].ms = ms;
+        phases[nphases].hop = 1;
+        nphases++;
+      }
+      pthread_mutex_unlock(&control_lock);
+      reply(fd, "%s", line);
+    } else {
+      reply(fd, "stderr %s", line);
+    }
+  }
+  fclose(in);
+
+  int status;
+  if (rolled_back) {
+    if (child > 0)
+      waitpid(child, &status, 0);
+    reply(fd, "error update rolled back\n");
+    return;
+  }
+  if (child > 0 && waitpid(child, &status, 0) == child && !done) {
+    if (WIFSIGNALED(status))
+      reply(fd, "error dry run killed by signal %d\n", WTERMSIG(status));
+    else
+      reply(fd, "error dry run exited with status %d\n", WEXITSTATUS(status));
+    return;
+  }
+  pthread_mutex_lock(&control_lock);
+  int aborted = update_aborted;
+  pthread_mutex_unlock(&control_lock);
+  if (done)
+    reply(fd, "ok\n");
+  else
+    reply(fd, aborted ? "error update aborted\n" : "error dry run failed\n");
+}
+
+static void cmd_status(int fd)
+{
+  char buf[CONTROL_LINE * 4];
+  int len, i;
+
+  pthread_mutex_lock(&control_lock);
+  len = snprintf(buf, sizeof(buf),
+                 "pid %d\nversion %s\nupdates %d\naborts %d\nstate %s\n",
+                 getpid(), cur_version ? cur_version : "-", updates, aborts,
+                 preload_busy ? "preloading" : update_active ? "updating" : "running");
+  for (i = 0; i < npreloads && len < (int)sizeof(buf); i++)
+    len += snprintf(buf + len, sizeof(buf) - len, "preloaded %s\n", preloads[i].path);
+  pthread_mutex_unlock(&control_lock);
+  reply(fd, "%s", buf);
+  reply(fd, "ok\n");
+}
+
+static void cmd_metrics(int fd)
+{
+  char buf[CONTROL_LINE * 4];
+  int len, i;
+
+  pthread_mutex_lock(&control_lock);
+  len = snprintf(buf, sizeof(buf), "updates %d\naborts %d\npreload %.3f\n",
+                 updates, aborts, preload_ms);
+  for (i = 0; i < nphases && len < (int)sizeof(buf); i++)
+    len += snprintf(buf + len, sizeof(buf) - len, "phase %s %.3f hop %d\n",
+                    phases[i].name, phases[i].ms, phases[i].hop);
+  pthread_mutex_unlock(&control_lock);
+  reply(fd, "%s", buf);
+  reply(fd, "ok\n");
+}
+
+/* The census is the running version's to take: its counters live in that
+   version's copy of the runtime (see allocsites.c). */
+static void cmd_census(int fd, char *arg)
+{
+  if (arg && strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0) {
+    reply(fd, "error census takes on or off\n");
+    return;
+  }
+  pthread_mutex_lock(&control_lock);
+  void *census = cur_handle ? dlsym(cur_handle, "kitsune_heap_census") : NULL;
+  void *enable = cur_handle ? dlsym(cur_handle, "kitsune_alloc_sites") : NULL;
+  pthread_mutex_unlock(&control_lock);
+  if (!census || !enable) {
+    reply(fd, "error the running version has no heap census\n");
+    return;
+  }
+  if (arg) {
+    ((void (*)(int))enable)(strcmp(arg, "on") == 0);
+  } else {
+    char *text = ((char *(*)(void))census)();
+    reply(fd, "%s", text);
+    free(text);
+  }
+  reply(fd, "ok\n");
+}
+
+/* Log levels, like the census, belong to the running version, which hands
+   them on at each update. */
+static void cmd_loglevel(int fd, char *spec)
+{
+  pthread_mutex_lock(&control_lock);
+  void *set = cur_handle ? dlsym(cur_handle, "kitsune_set_log_level") : NULL;
+  void *get = cur_handle ? dlsym(cur_handle, "kitsune_get_log_levels") : NULL;
+  pthread_mutex_unlock(&control_lock);
+  if (!set || !get) {
+    reply(fd, "error the running version has no log levels\n");
+    return;
+  }
+  if (spec && !((int (*)(const char *))set)(spec)) {
+    reply(fd, "error bad log level: %s\n", spec);
+    return;
+  }
+  char *text = ((char *(*)(void))get)();
+  if (text)
+    reply(fd, "%s", text);
+  free(text);
+  reply(fd, "ok\n");
+}
+
+static void *serve_client(void *data)
+{
+  int fd = (intptr_t)data;
+  FILE *in = fdopen(fd, "r");
+  char line[CONTROL_LINE];
+
+  if (!in) {
+    close(fd);
+    return NULL;
+  }
+  while (fgets(line, sizeof(line), in)) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *arg = strchr(line, ' ');
+    if (arg)
+      *arg++ = '\0';
+
+    if ((strcmp(line, "update") == 0 || strcmp(line, "preload") == 0 ||
+         strcmp(line, "dryrun") == 0 || strcmp(line, "precopy") == 0) && !arg)
+      reply(fd, "error %s needs a library path\n", line);
+    else if (strcmp(line, "update") == 0)
+      cmd_update(fd, arg);
+    else if (strcmp(line, "preload") == 0)
+      cmd_preload(fd, arg);
+    else if (strcmp(line, "dryrun") == 0)
+      cmd_dryrun(fd, arg);
+    else if (strcmp(line, "precopy") == 0)
+      cmd_precopy(fd, arg);
+    else if (strcmp(line, "status") == 0)
+      cmd_status(fd);
+    else if (strcmp(line, "metrics") == 0)
+      cmd_metrics(fd);
+    else if (strcmp(line, "census") == 0)
+      cmd_census(fd, arg);
+    else if (strcmp(line, "loglevel") == 0)
+      cmd_loglevel(fd, arg);
+    else
+      reply(fd, "error unknown command: %s\n", line);
+  }
+  fclose(in);
+  return NULL;
+}
+
+static void *control_thread(void *_ignored)
+{
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, "control: accept failed (%s)\n", strerror(errno));
+      return NULL;
+    }
+    pthread_t client;
+    if (pthread_create(&client, &attr, serve_client, (void *)(intptr_t)fd))
+      close(fd);
+  }
+}
+
+static void control_start(void)
+{
+  struct sockaddr_un addr;
+  pthread_t server;
+  pthread_attr_t attr;
+
+  snprintf(sock_path, sizeof(sock_path), "/tmp/kitsune-%d.sock", getpid());
+  unlink(sock_path);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, sock_path, sizeof(sock_path));
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      chmod(sock_path, 0600) || listen(listen_fd, 8)) {
+    fprintf(stderr, "control: could not listen on %s (%s)\n", sock_path,
+            strerror(errno));
+    goto fail;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int failed = pthread_create(&server, &attr, control_thread, NULL);
+  pthread_attr_destroy(&attr);
+  if (!failed)
+    return;
+  fprintf(stderr, "control: could not start the control thread\n");
+  unlink(sock_path);
+ fail:
+  if (listen_fd >= 0)
+    close(listen_fd);
+  listen_fd = -1;
+  sock_path[0] = '\0';
+}
+
+static void control_cleanup(void)
+{
+  if (sock_path[0])
+    unlink(sock_path);
+}
+
+/* Threads do not survive fork(); the child gets its own socket and thread,
+   so every process of a forking server can be updated. */
+static void control_atfork_child(void)
+{
+  pthread_mutex_init(&control_lock, NULL);
+  pthread_cond_init(&control_changed, NULL);
+  preload_busy = 0;
+  if (dry_run_atfork_child())
+    return;
+  update_active = 0;
+  if (listen_fd >= 0)
+    close(listen_fd);
+  control_start();
+}
+
+void control_init(void (**request)(void))
+{
+  request_update = request;
+  control_start();
+  atexit(control_cleanup);
+  pthread_atfork(NULL, dry_run_atfork_parent, control_atfork_child);
+}
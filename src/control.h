@@ -0,0 +1,49 @@
+#ifndef KITSUNE_CONTROL_H
+#define KITSUNE_CONTROL_H
+
+/*
+ * The driver's control socket, /tmp/kitsune-PID.sock.  Clients (doupd) send
+ * one command per line and read back lines ending with "ok" or "error ...":
+ *
+ *   update PATH... preload each PATH if needed, then update to it, streaming
+ *                  a "phase NAME MS" line for each phase of the update; with
+ *                  several paths the update hops through each version in
+ *                  turn within one pause, and the lines end in "hop N"
+ *   preload PATH   load PATH in the background for a later update
+ *   precopy PATH   preload PATH and have it transform the running version's
+ *                  state ahead of the update, replying "precopy COUNT MS";
+ *                  the update reuses what has not been written since
+ *   dryrun PATH    take the update to PATH in a forked child, streaming its
+ *                  phases (and its stderr, as "stderr ..." lines); this
+ *                  process resumes as soon as the child has forked
+ *   status         the running version, update count and state
+ *   metrics        phase timings of the most recent update
+ *   census [on|off] the running version's live kitsune_malloc'd blocks by
+ *                  type and allocation site (see kitsune_heap_census), or
+ *                  start or stop recording them
+ *   loglevel [SPEC] the running version's log level for each category,
+ *                  after setting them from SPEC if given: "debug",
+ *                  "transform=trace", "info,threads=debug" (see
+ *                  kitsune_set_log_level)
+ */
+
+/* request points at the current version's kitsune_signal_update. */
+void control_init(void (**request)(void));
+void control_set_version(const char *path, void *handle);
+
+/* The update path requested over the socket, or NULL (caller frees). */
+char *control_take_update_path(void);
+
+/* The preloaded handle for path, or NULL if it was not preloaded. */
+void *control_take_preloaded(const char *path);
+
+/* Called by the runtime (and the driver) as an update moves through its
+   phases; exported from the driver binary for the runtime to find.  True on
+   "done" if another version of a multi-version hop follows. */
+int kitsune_driver_event(const char *phase);
+
+/* Asked by the runtime at the update point: true if it should fork and let
+   the child take the update (a dry run). */
+int kitsune_driver_dry_run(void);
+
+#endif
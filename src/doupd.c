@@ -0,0 +1,206 @@
+/**
+ * doupd is a small client for the driver's control socket (see control.h).
+ *
+ *   doupd [-r] PID LIBRARY...     update PID to LIBRARY (preloading it
+ *                                 first); several libraries are hopped
+ *                                 through in order within one update
+ *   doupd -p [-r] PID LIBRARY...  only preload the libraries
+ *   doupd -n [-r] PID LIBRARY     dry run: take the update in a forked copy
+ *                                 of PID, which then exits, leaving PID as it
+ *                                 was
+ *   doupd -c [-r] PID LIBRARY     pre-copy: preload LIBRARY and have it
+ *                                 transform PID's state ahead of the update
+ *   doupd -s [-r] PID             print the status of PID
+ *   doupd -m [-r] PID             print the timings of PID's last update
+ *
+ * With -r the command goes to PID and every process descended from it (e.g.,
+ * the workers of a forking server), in parallel; each output line is then
+ * prefixed with the process id it came from.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: doupd [-p | -n | -c | -s | -m] [-r] PID [LIBRARY...]\n"
+                  "       doupd -a [-r] PID [on | off]\n"
+                  "       doupd -l [-r] PID [LEVELS]\n");
+  exit(2);
+}
+
+static pid_t parent_of(pid_t pid)
+{
+  char path[64], buf[512];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return -1;
+  size_t len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = '\0';
+
+  /* pid (comm) state ppid ...; comm may itself contain ") " */
+  char *p = strrchr(buf, ')');
+  int ppid;
+  if (!p || sscanf(p + 1, " %*c %d", &ppid) != 1)
+    return -1;
+  return ppid;
+}
+
+/* Fill pids with root and all of its descendants; returns how many. */
+static int process_tree(pid_t root, pid_t **pids)
+{
+  int count = 1, cap = 16, changed = 1;
+  *pids = malloc(sizeof(pid_t) * cap);
+  (*pids)[0] = root;
+
+  /* Repeat until no new descendants turn up, in case /proc lists a child
+     before its parent. */
+  while (changed) {
+    DIR *dir = opendir("/proc");
+    struct dirent *ent;
+    changed = 0;
+    while (dir && (ent = readdir(dir))) {
+      pid_t pid = atoi(ent->d_name), ppid;
+      int i, known = 0, parent_known = 0;
+      if (pid <= 0 || (ppid = parent_of(pid)) <= 0)
+        continue;
+      for (i = 0; i < count; i++) {
+        known |= (*pids)[i] == pid;
+        parent_known |= (*pids)[i] == ppid;
+      }
+      if (known || !parent_known)
+        continue;
+      if (count == cap)
+        *pids = realloc(*pids, sizeof(pid_t) * (cap *= 2));
+      (*pids)[count++] = pid;
+      changed = 1;
+    }
+    if (dir)
+      closedir(dir);
+  }
+  return count;
+}
+
+/* Send cmd to pid's driver and copy its reply to stdout; returns 0 if every
+   command succeeded, 2 if pid has no control socket. */
+static int run_command(pid_t pid, const char *cmd, int tag)
+{
+  struct sockaddr_un addr;
+  char prefix[32] = "", line[512];
+  int ok = 0, failed = 0;
+
+  if (tag)
+    snprintf(prefix, sizeof(prefix), "[%d] ", pid);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/kitsune-%d.sock", pid);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    if (!tag)
+      fprintf(stderr, "no control socket at %s\n", addr.sun_path);
+    return 2;
+  }
+  if (write(fd, cmd, strlen(cmd)) != (ssize_t)strlen(cmd)) {
+    fprintf(stderr, "%scould not send the command\n", prefix);
+    return 1;
+  }
+  shutdown(fd, SHUT_WR);
+
+  FILE *in = fdopen(fd, "r");
+  while (fgets(line, sizeof(line), in)) {
+    printf("%s%s", prefix, line);
+    fflush(stdout);
+    ok = strcmp(line, "ok\n") == 0;
+    failed |= strncmp(line, "error", 5) == 0;
+  }
+  fclose(in);
+  return failed || !ok;
+}
+
+int main(int argc, char **argv)
+{
+  const char *verb = "update";
+  int recursive = 0, opt, i;
+  char *cmd;
+
+  while ((opt = getopt(argc, argv, "pncsmalr")) != -1) {
+    switch (opt) {
+    case 'p': verb = "preload"; break;
+    case 'n': verb = "dryrun"; break;
+    case 'c': verb = "precopy"; break;
+    case 's': verb = "status"; break;
+    case 'm': verb = "metrics"; break;
+    case 'a': verb = "census"; break;
+    case 'l': verb = "loglevel"; break;
+    case 'r': recursive = 1; break;
+    default: usage();
+    }
+  }
+  int needs_lib = verb[0] == 'u' || verb[0] == 'p' || verb[0] == 'd';
+  int one_lib = strcmp(verb, "dryrun") == 0 || strcmp(verb, "precopy") == 0;
+  int nlibs = argc - optind - 1;
+  /* the census and log levels take an optional argument */
+  int takes_arg = strcmp(verb, "census") == 0 || strcmp(verb, "loglevel") == 0;
+  if (nlibs < 0 || (needs_lib ? nlibs < 1 : nlibs > takes_arg))
+    usage();
+  if (one_lib && nlibs > 1)
+    usage();
+  pid_t pid = atoi(argv[optind]);
+  if (pid <= 0)
+    usage();
+
+  /* "update A B C" hops through all three; preloads are one per line. */
+  cmd = malloc((nlibs + 1) * (PATH_MAX + 16));
+  cmd[0] = '\0';
+  if (takes_arg && nlibs)
+    sprintf(cmd, "%s %s\n", verb, argv[optind + 1]);
+  else if (!needs_lib)
+    sprintf(cmd, "%s\n", verb);
+  for (i = 0; i < nlibs && needs_lib; i++) {
+    /* Resolve the library relative to our cwd, not the driver's. */
+    char lib[PATH_MAX];
+    if (!realpath(argv[optind + 1 + i], lib)) {
+      perror(argv[optind + 1 + i]);
+      return 1;
+    }
+    if (strcmp(verb, "preload") == 0 || i == 0)
+      sprintf(cmd + strlen(cmd), "%s%s", i ? "\n" : "", verb);
+    sprintf(cmd + strlen(cmd), " %s", lib);
+  }
+  if (needs_lib)
+    strcat(cmd, "\n");
+
+  if (!recursive)
+    return run_command(pid, cmd, 0);
+
+  pid_t *pids;
+  int count = process_tree(pid, &pids), failed = 0, status;
+  /* Descendants that are not running under the driver are skipped. */
+  for (i = 0; i < count; i++) {
+    pid_t child = fork();
+    if (child == 0) {
+      int result = run_command(pids[i], cmd, 1);
+      if (result == 2 && i == 0)
+        fprintf(stderr, "[%d] no control socket\n", pids[i]);
+      _exit(result == 2 && i > 0 ? 0 : result);
+    }
+    if (child < 0)
+      failed = 1;
+  }
+  while (wait(&status) > 0)
+    failed |= !WIFEXITED(status) || WEXITSTATUS(status);
+  free(pids);
+  return failed;
+}
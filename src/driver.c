@@ -15,6 +15,9 @@
 #include <signal.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+
+#include "control.h"
 
 /** 
  * Update Requests
@@ -33,22 +36,83 @@ void handle_update_signal(int signum)
 
 char **next_version_code = NULL;
 
+/**
+ * When (CLOCK_MONOTONIC, in ns) the driver was last re-entered by an update
+ * and when it then had the next version loaded; the runtime puts the gap on
+ * its update timeline (see trace.c).
+ */
+unsigned long long kitsune_driver_times[2];
+
+static unsigned long long driver_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/** 
+ * absolute_path turns a path relative to the directory driver was run from
+ * into an absolute one, taking ownership of (and possibly freeing) path.
+ */
+char *absolute_path(char *path)
+{
+  if (path[0] == '/')
+    return path;
+
+  /* find the absolute path (requires _GNU_SOURCE)*/
+  char* cwd = get_current_dir_name();
+  int cwd_len = strlen(cwd);
+  int path_len = strlen(path);
+  char* result = malloc(cwd_len + path_len + 2);
+
+  memcpy(result, cwd, cwd_len);
+  result[cwd_len] = '/';
+  memcpy(result + cwd_len + 1, path, path_len + 1);
+
+  free(cwd);
+  free(path);
+  return result;
+}
+
+static char *read_path_file(const char *filename)
+{
+  FILE *fp = fopen(filename, "r");
+  if (!fp)
+    return NULL;
+  char *result = malloc(sizeof(char) * 256);
+  if (!fgets(result, 255, fp)) {
+    free(result);
+    result = NULL;
+  }
+  fclose(fp);
+  return result;
+}
+
 typedef int init_func_t(jmp_buf *, void *, void*, char **,
                         const char *, int, char **);
 
+/**
+ * value the runtime longjmps with when an update fails before committing (see
+ * kitsune_rollback)
+ */
+#define KITSUNE_JMP_ROLLBACK 2
+
 /** 
  * get_upd_path returns the filename of the shared library containing the new
  * version of the program.
  */
 char *get_upd_path() 
 {
+  char *requested = control_take_update_path();
+  if (requested != NULL)
+    return requested;
+
   if (*next_version_code != NULL) {
     char *result = *next_version_code;
     *next_version_code = NULL;
     return result;
   }
     
-  FILE *fp;
   char filename[256];
 
   /** 
@@ -56,10 +120,8 @@ char *get_upd_path()
    * folder with a name based on the pid of the current process.
    */
   snprintf(filename, 256, "/tmp/%d.upd", getpid());
-  fp = fopen(filename, "r");
-  if (fp) {
-    char *result = malloc(sizeof(char) * 256);
-    fgets(result, 255, fp);
+  char *result = read_path_file(filename);
+  if (result) {
     unlink(filename);
     return result;
   } else {
@@ -131,6 +193,9 @@ int main(int argc, char **argv)
   /** register the update signal handler */
   signal(SIGUSR2, handle_update_signal);
 
+  /** and start serving the control socket */
+  control_init(&req_func);
+
   /**
    * allocate lib_handle (the handle to the current version dynamic library) on
    * the heap so assignment will persist across the longjmp
@@ -138,60 +203,81 @@ int main(int argc, char **argv)
   void **lib_handle = malloc(sizeof(void *));
   *lib_handle = NULL;
 
+  /**
+   * and likewise the handle to the version being updated from, which is
+   * re-entered if the update is rolled back
+   */
+  void **old_lib_handle = malloc(sizeof(void *));
+  *old_lib_handle = NULL;
+
   next_version_code = malloc(sizeof(char *));
   *next_version_code = NULL;
 
   /**
    * return to this point in main when an update is requested
    */
-  setjmp(env);
+  int rollback;
+  if (setjmp(env) == KITSUNE_JMP_ROLLBACK)
+    rollback = 1;
+  else
+    rollback = 0;
+  kitsune_driver_times[0] = kitsune_driver_times[1] = driver_now();
 
-  /**
-   * if we're updating, call get_upd_path to get the filename for the next
-   * version, otherwise use the filename passed in at the commandline.
-   */
-  if (*lib_handle) {    
-    upd_path = get_upd_path();
+  void *prev_lib_handle;
+  if (rollback) {
+    /**
+     * the new version failed before it committed to the update: unload it and
+     * re-enter the old version, which takes itself as its previous version and
+     * so resumes from the state it left.
+     */
+    dlclose(*lib_handle);
+    (*lib_handle) = (*old_lib_handle);
+    prev_lib_handle = (*lib_handle);
   } else {
-    upd_path = strdup(init_path);
-  }
+    /**
+     * if we're updating, call get_upd_path to get the filename for the next
+     * version, otherwise use the filename passed in at the commandline.
+     */
+    if (*lib_handle) {    
+      upd_path = get_upd_path();
+    } else {
+      upd_path = strdup(init_path);
+    }
   
-  /**
-   * Find the absolute path if upd_path is a relative path.
-   * Note that this must be relative to the path that driver was run from.
-   */
-  if(upd_path[0] != '/')
-  {
-    /* find the absolute path (requires _GNU_SOURCE)*/
-    char* cwd = get_current_dir_name();
-    int cwd_len = strlen(cwd);
-    int upd_len = strlen(upd_path);
-    char* path = malloc(cwd_len + upd_len + 2);
-    
-    memcpy(path, cwd, cwd_len);
-    path[cwd_len] = '/';
-    memcpy(path + cwd_len + 1, upd_path, upd_len);
-    
-    free(cwd);
-    free(upd_path);
-    upd_path = path;
-  }
+    /**
+     * Find the absolute path if upd_path is a relative path.
+     * Note that this must be relative to the path that driver was run from.
+     */
+    upd_path = absolute_path(upd_path);
 
-  /**
-   * save the previous version library handle so it can be used to access state
-   * from the old version from within the new version
-   */
-  void *prev_lib_handle = (*lib_handle);
+    /**
+     * save the previous version library handle so it can be used to access
+     * state from the old version from within the new version
+     */
+    prev_lib_handle = (*lib_handle);
+    (*old_lib_handle) = prev_lib_handle;
 
-  /**
-   * load next version of the libary
-   */
-  (*lib_handle) = dlopen(upd_path, RTLD_NOW | RTLD_LOCAL);
-  if ((*lib_handle) == NULL) {
-    printf ("[%s] A dynamic linking error occurred: (%s)\n", upd_path, dlerror());
-    exit(1);
+    /**
+     * load next version of the libary, unless it was already preloaded
+     */
+    (*lib_handle) = control_take_preloaded(upd_path);
+    if ((*lib_handle) == NULL)
+      (*lib_handle) = dlopen(upd_path, RTLD_NOW | RTLD_LOCAL);
+    kitsune_driver_times[1] = driver_now();
+    if ((*lib_handle) == NULL) {
+      printf ("[%s] A dynamic linking error occurred: (%s)\n", upd_path, dlerror());
+      if (!prev_lib_handle)
+        exit(1);
+      /* nothing has been changed yet, so roll back as above */
+      kitsune_driver_event("rolledback");
+      (*lib_handle) = prev_lib_handle;
+    } else {
+      if (prev_lib_handle)
+        kitsune_driver_event("loaded");
+      control_set_version(upd_path, *lib_handle);
+    }
+    free(upd_path);
   }
-  free(upd_path);
 
   /**
    * retreive a pointer to the kitsune_init_inplace function from the new version
@@ -1,98 +1,283 @@
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "kitsune_internal.h"
 #include <ktheaptrack.h>
-#include "uthash.h"
 
 #ifdef ENABLE_THREADING
 #include "ktthreads_internal.h"
 #endif
 
-static void nodes_free(struct kitsune_heaplist_node* list_node) {
-	if(list_node) {
-		nodes_free(list_node->next);
-		free(list_node);
-	}
+/*
+ * A heaplist keeps its addresses packed at the front of a chain of chunks:
+ * every chunk but the last is full, and deleting an address moves the last
+ * one into its place.  Chunks are aligned to their size, so an iterator (a
+ * pointer to a node) finds its chunk by masking.  An open-addressing index
+ * from address to node makes adding and deleting take constant time.
+ */
+#define CHUNK_BYTES 4096
+#define CHUNK_NODES ((CHUNK_BYTES - sizeof(struct kitsune_heaplist_chunk)) / \
+                     sizeof(kitsune_heaplist_node))
+#define CHUNK_OF(node) \
+  ((struct kitsune_heaplist_chunk *)((uintptr_t)(node) & ~(uintptr_t)(CHUNK_BYTES - 1)))
+#define NODES_OF(chunk) ((kitsune_heaplist_node *)((chunk) + 1))
+
+struct kitsune_heaplist_chunk {
+  struct kitsune_heaplist_chunk *next;
+  struct kitsune_heaplist_chunk *prev;
+  size_t used;
+};
+
+struct kitsune_heaplist_index {
+  size_t mask;                  /* slots - 1 */
+  kitsune_heaplist_node *slots[];
+};
+
+#define INDEX_FIRST_SLOTS 64
+
+static size_t addr_hash(void *addr)
+{
+  uint64_t h = (uint64_t)((uintptr_t)addr >> 3) * 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 29);
 }
 
+static struct kitsune_heaplist_index *index_new(size_t slots)
+{
+  struct kitsune_heaplist_index *ix =
+    calloc(1, sizeof(struct kitsune_heaplist_index) + slots * sizeof(kitsune_heaplist_node *));
+  assert(ix);
+  ix->mask = slots - 1;
+  return ix;
+}
+
+static void index_put(struct kitsune_heaplist_index *ix, kitsune_heaplist_node *node)
+{
+  size_t i = addr_hash(node->addr) & ix->mask;
+  while (ix->slots[i])
+    i = (i + 1) & ix->mask;
+  ix->slots[i] = node;
+}
+
+/* The slot holding node, or (if node is NULL) some node for addr; -1 if
+   there is none. */
+static long index_find(struct kitsune_heaplist_index *ix, void *addr,
+                       kitsune_heaplist_node *node)
+{
+  size_t i = addr_hash(addr) & ix->mask;
+  for (; ix->slots[i]; i = (i + 1) & ix->mask)
+    if (node ? ix->slots[i] == node : ix->slots[i]->addr == addr)
+      return i;
+  return -1;
+}
+
+/* Empty slot i, shifting later entries of its probe run back so that no
+   lookup stops short. */
+static void index_remove(struct kitsune_heaplist_index *ix, size_t i)
+{
+  size_t j = i, home;
+  for (;;) {
+    ix->slots[i] = NULL;
+    for (;;) {
+      j = (j + 1) & ix->mask;
+      if (!ix->slots[j])
+        return;
+      home = addr_hash(ix->slots[j]->addr) & ix->mask;
+      /* j may fill i unless its home lies cyclically in (i, j] */
+      if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+        break;
+    }
+    ix->slots[i] = ix->slots[j];
+    i = j;
+  }
+}
+
+/* Make room in the index for one more node. */
+static void index_reserve(kitsune_heaplist *list)
+{
+  struct kitsune_heaplist_index *old = list->index, *ix;
+  size_t i;
+  if (old && (list->count + 1) * 2 <= old->mask + 1)
+    return;
+  ix = index_new(old ? (old->mask + 1) * 2 : INDEX_FIRST_SLOTS);
+  if (old) {
+    for (i = 0; i <= old->mask; i++)
+      if (old->slots[i])
+        index_put(ix, old->slots[i]);
+    free(old);
+  }
+  list->index = ix;
+}
 
 void kitsune_heaplist_init(kitsune_heaplist *list)
 {
   assert(list);
-	list->begin = NULL;
-	list->last = NULL;
+  list->begin = NULL;
+  list->last = NULL;
+  list->count = 0;
+  list->index = NULL;
+}
+
+void kitsune_heaplist_free(kitsune_heaplist *list)
+{
+  struct kitsune_heaplist_chunk *c = list->begin, *next;
+  for (; c; c = next) {
+    next = c->next;
+    free(c);
+  }
+  free(list->index);
+  free(list);
 }
 
-void kitsune_heaplist_free(kitsune_heaplist* list)
+void kitsune_heaplist_add(kitsune_heaplist *list, void *addr)
 {
-	nodes_free(list->begin);
-	free(list);
+  struct kitsune_heaplist_chunk *c = list->last;
+  if (!c || c->used == CHUNK_NODES) {
+    c = aligned_alloc(CHUNK_BYTES, CHUNK_BYTES);
+    assert(c);
+    c->next = NULL;
+    c->prev = list->last;
+    c->used = 0;
+    if (list->last)
+      list->last->next = c;
+    else
+      list->begin = c;
+    list->last = c;
+  }
+  index_reserve(list);
+  kitsune_heaplist_node *node = &NODES_OF(c)[c->used++];
+  node->addr = addr;
+  index_put(list->index, node);
+  list->count++;
 }
 
-void kitsune_heaplist_add(kitsune_heaplist* list, void* addr)
+/* Remove one occurrence of addr; returns whether there was one.  The last
+   address takes its place, so iterating after a delete may see addresses in
+   a different order. */
+int kitsune_heaplist_del(kitsune_heaplist *list, void *addr)
 {
-	if (!list->begin) {
-		list->begin = list->last = malloc(sizeof(struct kitsune_heaplist_node));
-		list->last->next = NULL;
-	}	else 	{
-		list->last->next = malloc(sizeof(struct kitsune_heaplist_node));
-		list->last = list->last->next;
-		list->last->next = NULL;
-	}
-	list->last->addr = addr;
+  long i = list->index ? index_find(list->index, addr, NULL) : -1;
+  if (i < 0)
+    return 0;
+  kitsune_heaplist_node *node = list->index->slots[i];
+  struct kitsune_heaplist_chunk *c = list->last;
+  kitsune_heaplist_node *last = &NODES_OF(c)[c->used - 1];
+
+  index_remove(list->index, i);
+  if (node != last) {
+    list->index->slots[index_find(list->index, last->addr, last)] = node;
+    node->addr = last->addr;
+  }
+  if (--c->used == 0) {
+    list->last = c->prev;
+    if (c->prev)
+      c->prev->next = NULL;
+    else
+      list->begin = NULL;
+    free(c);
+  }
+  list->count--;
+  return 1;
 }
 
-int kitsune_heaplist_del(kitsune_heaplist* list, void* addr)
+/**
+ * \ingroup public
+ *
+ * Transform every element of a list carried over from the previous version
+ * through elem_xf (the transformer for @t), replacing each address with that
+ * of the element's new copy.
+ */
+void kitsune_heaplist_transform(kitsune_heaplist *list, closure *elem_xf)
 {
-	kitsune_heaplist_node* cur = list->begin;
-  kitsune_heaplist_node* prev = NULL;
-	
-  while (cur) {
-    if (cur->addr == addr) {
-      if (prev == NULL) 
-        list->begin = cur->next;
-      else 
-        prev->next = cur->next;
+  struct kitsune_heaplist_chunk *c;
+  closure *ptr_xf = XF_PTR(elem_xf);
+  size_t i;
+
+  for (c = list->begin; c; c = c->next) {
+    for (i = 0; i < c->used; i++) {
+      kitsune_heaplist_node *node = &NODES_OF(c)[i];
+      void *new = NULL;
+      XF_INVOKE(ptr_xf, &node->addr, &new);
+      node->addr = new;
+    }
+  }
+  /* the index is keyed by the old addresses */
+  if (list->index) {
+    struct kitsune_heaplist_index *ix = index_new(list->index->mask + 1);
+    for (i = 0; i <= list->index->mask; i++)
+      if (list->index->slots[i])
+        index_put(ix, list->index->slots[i]);
+    free(list->index);
+    list->index = ix;
+  }
+}
 
-      if (list->last == cur)
-        list->last = prev;
+/**
+ * \ingroup internal
+ *
+ * Transformer for a kitsune_heaplist, built by XF_HEAPLIST: the new list
+ * holds the new copies of the old one's elements, transformed through
+ * args[0] (the closure for @t).  The old list is left alone unless it is
+ * being transformed in place, so that an update can still be rolled back.
+ */
+void transform_heaplist(void *in, void *out, int num_args, void **args)
+{
+  kitsune_heaplist old = *(kitsune_heaplist *)in;
+  kitsune_heaplist *list = out;
+  closure *ptr_xf;
+  struct kitsune_heaplist_chunk *c, *next;
+  size_t i;
 
-      free(cur);
-      return 1;
+  assert(num_args == 1);
+  ptr_xf = XF_PTR(args[0]);
+  kitsune_heaplist_init(list);
+  for (c = old.begin; c; c = c->next) {
+    for (i = 0; i < c->used; i++) {
+      void *new = NULL;
+      XF_INVOKE(ptr_xf, &NODES_OF(c)[i].addr, &new);
+      kitsune_heaplist_add(list, new);
     }
-    prev = cur;
-    cur = cur->next;
   }
-  return 0;
+  if (in == out) {
+    for (c = old.begin; c; c = next) {
+      next = c->next;
+      free(c);
+    }
+    free(old.index);
+  }
 }
 
 kitsune_heaplist_iterator* kitsune_heaplist_begin(kitsune_heaplist* list)
 {
-	assert(list);
-	return list->begin;
+  assert(list);
+  return list->begin ? NODES_OF(list->begin) : NULL;
 }
 
 kitsune_heaplist_iterator* kitsune_heaplist_end(kitsune_heaplist* list)
 {
-	assert(list);
-	return NULL;
+  assert(list);
+  return NULL;
 }
 
 kitsune_heaplist_iterator* kitsune_heaplist_last(kitsune_heaplist* list)
 {
-	assert(list);
-	return list->last;
+  assert(list);
+  return list->last ? &NODES_OF(list->last)[list->last->used - 1] : NULL;
 }
 
 kitsune_heaplist_iterator* kitsune_heaplist_next(kitsune_heaplist_iterator* iter)
 {
-	if(iter == NULL)
-		return NULL;
-	else
-		return iter->next;
+  if (iter == NULL)
+    return NULL;
+  struct kitsune_heaplist_chunk *c = CHUNK_OF(iter);
+  if (iter + 1 < NODES_OF(c) + c->used)
+    return iter + 1;
+  /* only the last chunk is partly used, and no chunk is empty */
+  return c->next ? NODES_OF(c->next) : NULL;
 }
 
 int kitsune_heaplist_isempty(kitsune_heaplist* list)
 {
-	return list->begin == NULL;
+  return list->count == 0;
 }
@@ -0,0 +1,229 @@
+/*
+ * Allocation interposer, for programs whose allocations do not go through
+ * kitsune_malloc.  A version linked with
+ *
+ *   -Wl,--wrap=malloc,--wrap=free,--wrap=calloc,--wrap=realloc,--wrap=posix_memalign
+ *
+ * calls the __wrap_ functions here instead of libc's, and each records its
+ * block's start and size in interposed_blocks.  The transformation then knows
+ * a pointer came from malloc (and may be freed) without asking vmareas, which
+ * cannot tell malloc's mmapped arenas from any other mapping.  Versions not
+ * linked this way simply leave the table empty.
+ *
+ * The table is an open-addressing hash of start addresses that is updated
+ * with compare-and-swap only, so allocating threads never wait for each
+ * other.  It grows by adding a level twice the size of the last; only the
+ * newest level takes inserts, and lookups and deletes try the levels newest
+ * first.  Its memory comes from mmap, so that it never calls malloc.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "kitsune_internal.h"
+#include "interpose_internal.h"
+
+/* glibc's own entry points, which the wrappers forward to */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+#define SLOT_EMPTY ((uintptr_t)0)
+#define SLOT_FREED ((uintptr_t)1)
+#define FIRST_LEVEL_SLOTS (1 << 16)
+
+typedef struct {
+  uintptr_t start;
+  size_t size;
+} block_slot;
+
+typedef struct block_level {
+  struct block_level *older;
+  size_t mask;                  /* slots - 1 */
+  size_t used;                  /* slots ever taken, freed or not */
+  block_slot slots[];
+} block_level;
+
+/* Passed from version to version (see interpose_init). */
+block_level *interposed_blocks = NULL;
+
+static size_t slot_hash(uintptr_t start)
+{
+  uint64_t h = (uint64_t)(start >> 4) * 0x9e3779b97f4a7c15ull;
+  return h ^ (h >> 29);
+}
+
+static block_level *level_new(block_level *older)
+{
+  size_t slots = older ? (older->mask + 1) * 2 : FIRST_LEVEL_SLOTS;
+  block_level *l = mmap(NULL, sizeof(block_level) + slots * sizeof(block_slot),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (l == MAP_FAILED)
+    return NULL;
+  /* mmap's memory is zeroed: every slot is empty */
+  l->older = older;
+  l->mask = slots - 1;
+  return l;
+}
+
+/* Replace seen as the newest level, unless another thread got there first. */
+static void level_grow(block_level *seen)
+{
+  block_level *fresh = level_new(seen);
+  if (!fresh)
+    return;
+  if (!__atomic_compare_exchange_n(&interposed_blocks, &seen, fresh, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    munmap(fresh, sizeof(block_level) + (fresh->mask + 1) * sizeof(block_slot));
+}
+
+static void block_insert(void *ptr, size_t size)
+{
+  uintptr_t start = (uintptr_t)ptr;
+
+  for (;;) {
+    block_level *l = __atomic_load_n(&interposed_blocks, __ATOMIC_ACQUIRE);
+    /* keep probe sequences short */
+    if (!l || __atomic_load_n(&l->used, __ATOMIC_RELAXED) * 4 >= (l->mask + 1) * 3) {
+      level_grow(l);
+      if (!__atomic_load_n(&interposed_blocks, __ATOMIC_ACQUIRE))
+        return;                 /* out of memory: the block goes untracked */
+      continue;
+    }
+    size_t i = slot_hash(start) & l->mask, probes;
+    for (probes = 0; probes <= l->mask; probes++, i = (i + 1) & l->mask) {
+      block_slot *s = &l->slots[i];
+      uintptr_t cur = __atomic_load_n(&s->start, __ATOMIC_ACQUIRE);
+      if (cur != SLOT_EMPTY && cur != SLOT_FREED)
+        continue;
+      if (!__atomic_compare_exchange_n(&s->start, &cur, start, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        continue;
+      if (cur == SLOT_EMPTY)
+        __atomic_add_fetch(&l->used, 1, __ATOMIC_RELAXED);
+      __atomic_store_n(&s->size, size, __ATOMIC_RELEASE);
+      return;
+    }
+    level_grow(l);
+  }
+}
+
+/* The slot recording ptr, or NULL. */
+static block_slot *block_find(void *ptr)
+{
+  uintptr_t start = (uintptr_t)ptr;
+  block_level *l;
+
+  if (start == SLOT_EMPTY || start == SLOT_FREED)
+    return NULL;
+  for (l = __atomic_load_n(&interposed_blocks, __ATOMIC_ACQUIRE); l; l = l->older) {
+    size_t i = slot_hash(start) & l->mask, probes;
+    for (probes = 0; probes <= l->mask; probes++, i = (i + 1) & l->mask) {
+      uintptr_t cur = __atomic_load_n(&l->slots[i].start, __ATOMIC_ACQUIRE);
+      if (cur == start)
+        return &l->slots[i];
+      if (cur == SLOT_EMPTY)
+        break;
+    }
+  }
+  return NULL;
+}
+
+static void block_remove(void *ptr)
+{
+  block_slot *s = block_find(ptr);
+  uintptr_t start = (uintptr_t)ptr;
+  if (s)
+    __atomic_compare_exchange_n(&s->start, &start, SLOT_FREED, 0,
+                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/* Whether ptr is the start of a live block from the wrapped allocator; if
+   so, its size is stored in *size (if size is not NULL). */
+int interpose_lookup(void *ptr, size_t *size)
+{
+  block_slot *s = block_find(ptr);
+  if (!s)
+    return 0;
+  if (size)
+    *size = __atomic_load_n(&s->size, __ATOMIC_ACQUIRE);
+  return 1;
+}
+
+void *__wrap_malloc(size_t size)
+{
+  void *p = __libc_malloc(size);
+  if (p)
+    block_insert(p, size);
+  return p;
+}
+
+void __wrap_free(void *ptr)
+{
+  if (!ptr)
+    return;
+  block_remove(ptr);
+  __libc_free(ptr);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+  void *p = __libc_calloc(nmemb, size);
+  if (p)
+    block_insert(p, nmemb * size);
+  return p;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  void *p = __libc_realloc(ptr, size);
+  /* on failure the old block is left as it was */
+  if (!p && size)
+    return NULL;
+  if (ptr)
+    block_remove(ptr);
+  if (p)
+    block_insert(p, size);
+  return p;
+}
+
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  if (alignment % sizeof(void *) || (alignment & (alignment - 1)))
+    return EINVAL;
+  void *p = __libc_memalign(alignment, size);
+  if (!p)
+    return ENOMEM;
+  block_insert(p, size);
+  *memptr = p;
+  return 0;
+}
+
+/* init should be called during startup.  Blocks this version allocated before
+   then (in constructors, say) are moved to the table taken over from the
+   previous version. */
+void interpose_init(void)
+{
+  block_level *mine = interposed_blocks, *l;
+  size_t i;
+
+  if (!kitsune_is_updating())
+    return;
+  block_level **prev = kitsune_get_val("interposed_blocks");
+  if (!prev || !*prev || *prev == mine)
+    return;
+  interposed_blocks = *prev;
+  while ((l = mine)) {
+    for (i = 0; i <= l->mask; i++)
+      if (l->slots[i].start != SLOT_EMPTY && l->slots[i].start != SLOT_FREED)
+        block_insert((void *)l->slots[i].start, l->slots[i].size);
+    mine = l->older;
+    munmap(l, sizeof(block_level) + (l->mask + 1) * sizeof(block_slot));
+  }
+}
@@ -0,0 +1,9 @@
+#ifndef INTERPOSE_INTERNAL_H
+#define INTERPOSE_INTERNAL_H
+
+#include <stddef.h>
+
+void interpose_init(void);
+int interpose_lookup(void *ptr, size_t *size);
+
+#endif
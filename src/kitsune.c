@@ -15,6 +15,7 @@
 #include <dlfcn.h>
 #include <string.h>
 #include <search.h>
+#include <unistd.h>
 
 #include "kitsune_internal.h"
 #include "stackvars_internal.h"
@@ -23,7 +24,13 @@
 #include "addresscheck_internal.h"
 #include "transform_internal.h"
 #include "bench_internal.h"
+#include "trace_internal.h"
 #include "alloctrack_internal.h"
+#include "pageclass_internal.h"
+#include "precopy_internal.h"
+#include "typedheap_internal.h"
+#include "interpose_internal.h"
+#include "allocsites_internal.h"
 
 #ifdef ENABLE_THREADING
 #include "ktthreads_internal.h"
@@ -89,6 +96,50 @@ char **next_version_code = NULL;
  */
 int kitsune_has_updated_p = 0;
 
+/**
+ * An update stays a transaction, which kitsune_rollback can undo, until the new
+ * version's main thread reaches the update point it is resuming from: the old
+ * version's library, stack variables and heap objects are all kept until then.
+ * This flag is set once that point has been passed.
+ */
+static int update_committed = 0;
+
+/* When this version entered main(), for the timeline (see trace.c). */
+static uint64_t restart_ns = 0;
+
+/**
+ * Value longjmp'd to the driver to have it drop the new version and re-enter
+ * the old one (driver.c has its own copy).
+ */
+#define KITSUNE_JMP_ROLLBACK 2
+
+/*
+ * The driver's phase notification hook (kitsune_driver_event), if it exports
+ * one; it streams the phases to whoever requested the update.  Returns true
+ * when the driver wants another update right away (a multi-version hop).
+ */
+static int (*driver_event)(const char *) = NULL;
+
+int kitsune_phase(const char *phase)
+{
+  /* The driver has already heard that the update was rolled back. */
+  if (kitsune_is_rolling_back())
+    return 0;
+  return driver_event ? driver_event(phase) : 0;
+}
+
+/*
+ * True if the driver asked for a dry run: the update is then taken in a
+ * forked child, which reports its phases and exits at its update point,
+ * while this process carries on.
+ */
+static int (*driver_dry_run)(void) = NULL;
+
+int kitsune_dry_run_requested(void)
+{
+  return driver_dry_run ? driver_dry_run() : 0;
+}
+
 /*
  * Entry Point
  * ===========
@@ -117,9 +168,24 @@ int kitsune_init_inplace(jmp_buf *env, void *prev_handle, void *cur_handle,
 
   bench_init(bench_filename);
 
+  /* The driver may want to hear about update phases (see kitsune_phase). */
+  void *driver = dlopen(NULL, RTLD_LAZY);
+  driver_event = driver ? dlsym(driver, "kitsune_driver_event") : NULL;
+  driver_dry_run = driver ? dlsym(driver, "kitsune_driver_dry_run") : NULL;
+
+  /*
+   * Initialize the log first so that quiescence and migration are logged.
+   */
+  if(!kitsune_logging_init(argv[0])) {
+    printf("Couldn't initialize logging!\n");
+    abort();
+  }
+  trace_init();
+
 #ifdef ENABLE_THREADING
   ktthread_init();
 #endif
+  bench_phase_start(BENCH_MIGRATE);
 
   /*
    * If the handle to the previous version was NULL, we infer that we are the
@@ -129,12 +195,20 @@ int kitsune_init_inplace(jmp_buf *env, void *prev_handle, void *cur_handle,
 
     kitsune_has_updated_p = 1;
 
+    /* Re-entered after a rollback: the request we left for is withdrawn. */
+    if (kitsune_is_rolling_back()) {
+      kitsune_log_info(KT_LOG_UPDATE, "Resuming after a failed update.");
+      kitsune_clear_request();
+      bench_cancel();
+    }
+
+    uint64_t t = trace_now();
 #ifdef ENABLE_THREADING
     /*
      * Wait for all child threads to reach update points (or terminate)
      */
     ktthread_main_wait();
-    bench_quiesce_finish();
+    t = trace_step("wait for threads", t);
 #endif
     
     /* 
@@ -142,37 +216,39 @@ int kitsune_init_inplace(jmp_buf *env, void *prev_handle, void *cur_handle,
      * the stackvars API/compiler.
      */
     stackvars_flip();
+    t = trace_step("stackvars_flip", t);
 
     addresscheck_init();
 
     transform_init();
+
+    /* Keep whatever a pre-copy transformed that has not changed since. */
+    precopy_validate(prev_handle);
+    t = trace_step("precopy_validate", t);
     
     /*
      * Get the pointer to the saved static variables.
      */
     registervars_migrate();
+    trace_step("registervars_migrate", t);
   }
   
-  /*
-   * Initialize the log.
-   */
-  if(!kitsune_logging_init(argv[0])) {
-    printf("Couldn't initialize logging!\n");
-    abort();
-  }
-
   /* initialize the memory allocation tracker tree*/
+  interpose_init();
+  allocsites_init();
+  pageclass_init();
   alloctrack_init();
+  typedheap_init();
 
   /*
    * We may wish to perform some initialization (e.g., altering the set of
    * threads or the argc/argv arguments to the program) before entering main().
    * Here, we call such a transformer if it exists.
    */
-  if (kitsune_is_updating()) {
+  if (kitsune_is_updating() && !kitsune_is_rolling_back()) {
     state_xform_fn_t ps_fn = kitsune_get_cur_val("_kitsune_prestart_xform");
     if (ps_fn) {
-      kitsune_log("Calling prestart transformation function.");
+      kitsune_log_debug(KT_LOG_UPDATE, "Calling prestart transformation function.");
       ps_fn();
     }
   }
@@ -181,8 +257,9 @@ int kitsune_init_inplace(jmp_buf *env, void *prev_handle, void *cur_handle,
    * After saving the information passed from the driver, we invoke the main
    * function of current version shared library.
    */
-  bench_restart_start();
-  kitsune_log("Entering target program: %s\n", argv[0]);
+  bench_phase_start(BENCH_RESTART);
+  restart_ns = trace_now();
+  kitsune_log_info(KT_LOG_UPDATE, "Entering target program: %s\n", argv[0]);
   return main(argc, argv);
 }
 /** @} 
@@ -228,11 +305,19 @@ void kitsune_update(const char *pt_name)
 #ifdef ENABLE_THREADING
     if (ktthread_is_main()) {
 #endif
+      kitsune_phase("resumed");
+      bench_phase_start(BENCH_TEARDOWN);
+      trace_span("to update point", NULL, restart_ns, trace_now());
       state_xform_fn_t mu_fn = kitsune_get_cur_val("_kitsune_mainupdate_xform");
-      if (mu_fn) {
-        kitsune_log("Calling main-update transformation function.");
+      if (mu_fn && !kitsune_is_rolling_back()) {
+        kitsune_log_debug(KT_LOG_UPDATE, "Calling main-update transformation function.");
         mu_fn();
       }
+
+      /* Past this point the update can no longer be rolled back. */
+      update_committed = 1;
+      transform_commit();
+      typedheap_commit();
 #ifdef ENABLE_THREADING
     }
 #endif
@@ -250,8 +335,7 @@ void kitsune_update(const char *pt_name)
        * Free any memory used to store the old versions stack variables (those
        * managed through the stackvars API).
        */
-      kitsune_log("before freeing....");
-      bench_log_resource_usage();
+      kitsune_log_debug(KT_LOG_UPDATE, "before freeing....");
       stackvars_free();
       registervars_free();
       addresscheck_free();
@@ -259,38 +343,89 @@ void kitsune_update(const char *pt_name)
       /*
        * Since we're done accessing values from the previous version, we now close
        * our handle to its shared library which makes its state inaccessible and
-       * unloads its code.
+       * unloads its code (unless we are that version, after a rollback).
        */
-      if (dlclose(prev_ver_handle)) {
-        kitsune_log("dlclose: error occurred: (%s)\n", dlerror());
+      uint64_t t = trace_now();
+      if (!kitsune_is_rolling_back() && dlclose(prev_ver_handle)) {
+        kitsune_log_error(KT_LOG_UPDATE, "dlclose: error occurred: (%s)\n", dlerror());
         exit(1);
       }
+      trace_span("dlclose", NULL, t, trace_now());
 
       prev_ver_handle = NULL;
       transform_free();
 
       bench_finish();
-      kitsune_log("teardown complete....");
-      bench_log_resource_usage();
+      kitsune_log_debug(KT_LOG_UPDATE, "teardown complete....");
+      trace_flush();
+
+      /*
+       * If the driver has more versions queued, request the next update now:
+       * it is then taken at this very update point, by every thread, before
+       * the program resumes normal execution in this version.
+       */
+      int next_hop = kitsune_phase("done");
+      if (next_hop)
+        kitsune_log_info(KT_LOG_UPDATE, "Continuing to the next version.");
 
 #ifdef ENABLE_THREADING
       /* Signal threads to continue running */
-      ktthread_main_finish_update();
+      ktthread_main_finish_update(next_hop);
     } else {
       stackvars_free();
       ktthread_finish_update();
     }
+#else
+      if (next_hop)
+        kitsune_signal_update();
 #endif
   }
   
+#ifdef ENABLE_THREADING
+  ktthread_note_update_pt(pt_name);
+#endif
+
   /*
    * Check whether an update is available.
    */
   if (update_requested) {
-    kitsune_log("Updating(%s)...\n", pt_name);
+    uint64_t quiesce_start = trace_now();
+    kitsune_log_info(KT_LOG_UPDATE, "Updating(%s)...\n", pt_name);
 
-    bench_log_resource_usage();
     bench_start();
+#ifdef ENABLE_THREADING
+    if (ktthread_is_main())
+#endif
+      kitsune_phase("quiescing");
+
+#ifdef ENABLE_THREADING
+    /*
+     * Wait here until every thread has reached an update point.  If they do
+     * not all get there before the quiescence deadline the update is
+     * abandoned and we simply carry on, as we do when the update is a dry run
+     * taken by a forked child.
+     */
+    if (!ktthread_quiesce(pt_name)) {
+      bench_cancel();
+      return;
+    }
+#else
+    /*
+     * For a dry run the update goes ahead in a forked child (see
+     * kitsune_dry_run_requested) and this process simply carries on.
+     */
+    if (kitsune_dry_run_requested()) {
+      pid_t child = fork();
+      if (child != 0) {
+        if (child < 0)
+          kitsune_phase("aborted");
+        kitsune_log_info(KT_LOG_UPDATE, "Dry run in process %d, resuming.", child);
+        kitsune_clear_request();
+        bench_cancel();
+        return;
+      }
+    }
+#endif
 
     /*
      * Move current stack variables (managed through the stackvars API) from the
@@ -299,7 +434,6 @@ void kitsune_update(const char *pt_name)
     stackvars_move_to_heap();
     
 #ifdef ENABLE_THREADING
-    ktthread_rapidq();
     if (ktthread_is_main()) {
 #endif
       /*
@@ -307,10 +441,16 @@ void kitsune_update(const char *pt_name)
        * to the next version 
        */
       update_pt = pt_name;
+      kitsune_phase("quiesced");
+      trace_span("quiesce", pt_name, quiesce_start, trace_now());
       
       /* 
-       * And then longjmp back to the driver code.
+       * And then longjmp back to the driver code, with this version's log
+       * written out so that it comes before the next version's.
        */
+      kitsune_log_drain();
+      trace_leave();
+      bench_phase_start(BENCH_LOAD);
       assert(jmp_env != NULL);
       longjmp(*jmp_env, 1);
 #ifdef ENABLE_THREADING
@@ -338,6 +478,96 @@ int kitsune_is_updating(void)
  * Closes doxygen group public.
  */
 
+/**
+ * \ingroup internal
+ * True while a version that was updated from is starting up again after the
+ * update to its successor was rolled back: it is then its own previous
+ * version, so migration copies its state onto itself and transformers (which
+ * expect the version before it) are skipped.
+ */
+int kitsune_is_rolling_back(void)
+{
+  return prev_ver_handle != NULL && prev_ver_handle == cur_ver_handle;
+}
+
+/**
+ * \ingroup internal
+ * True once the update this version is starting up from can no longer be
+ * rolled back (see update_committed).
+ */
+int kitsune_update_committed(void)
+{
+  return update_committed;
+}
+
+/**
+ * \ingroup public
+ * kitsune_rollback abandons the update that the current version is starting
+ * up from: the new state built so far is freed and the driver re-enters the
+ * previous version, which resumes from the update point it left.  It is
+ * called by failing kitsune_asserts and may be called by transformers.  It
+ * returns (so that the caller can give up some other way) if there is no
+ * update to roll back: none is in progress, it has been committed, or a
+ * transformer has already modified old state in place.
+ */
+void kitsune_rollback(void)
+{
+  precopy_abandon();
+  if (!kitsune_is_updating() || update_committed || kitsune_is_rolling_back())
+    return;
+#ifdef ENABLE_THREADING
+  if (!ktthread_is_main())
+    return;
+#endif
+  if (!transform_rollback()) {
+    kitsune_log_error(KT_LOG_UPDATE, "Update failed after old state was modified; cannot roll back.");
+    return;
+  }
+  kitsune_log_warn(KT_LOG_UPDATE, "Update failed; rolling back to the previous version.");
+  registervars_discard();
+#ifdef ENABLE_THREADING
+  ktthread_rollback();
+#endif
+  kitsune_phase("rolledback");
+  trace_instant("rollback");
+  trace_leave();
+  assert(jmp_env != NULL);
+  longjmp(*jmp_env, KITSUNE_JMP_ROLLBACK);
+}
+
+/**
+ * \ingroup internal
+ * Called by the driver, on a thread of its own, once this version has been
+ * preloaded: migrates prev_handle's automigrated state ahead of the update
+ * (see precopy.c) while prev_handle keeps running.  Returns the number of
+ * objects copied, or -1 if the pre-copy was abandoned.
+ */
+int kitsune_precopy(void *prev_handle, void *cur_handle)
+{
+  int copied;
+
+  prev_ver_handle = prev_handle;
+  cur_ver_handle = cur_handle;
+  kitsune_logging_init("precopy");
+  registervars_migrate();
+  copied = precopy_run(prev_handle);
+  prev_ver_handle = NULL;
+  return copied;
+}
+
+/**
+ * \ingroup internal
+ * Called by the driver when another version is pre-copied instead of this
+ * one: frees what the pre-copy made, some of it through prev_handle (the
+ * running version; see precopy.c).
+ */
+void kitsune_precopy_discard(void *prev_handle)
+{
+  prev_ver_handle = prev_handle;
+  precopy_discard();
+  prev_ver_handle = NULL;
+}
+
 /**
  * \ingroup internal
  * Kitsune-internal function. See documentation for is_loading.
@@ -381,7 +611,7 @@ void *kitsune_get_val(const char *var_name)
  */
 void *kitsune_get_cur_val(const char *var_name)
 {
-  kitsune_log("GETTING %s\n", var_name);
+  kitsune_log_trace(KT_LOG_UPDATE, "GETTING %s\n", var_name);
   assert(cur_ver_handle != NULL);
   void *var_ptr = dlsym(cur_ver_handle, var_name);
   return var_ptr;
@@ -408,7 +638,7 @@ xform_fn_t kitsune_get_xform(const char *name, const char *func, const char *fil
 #define FUNC_PREFIX_S STRINGIFY(FUNC_PREFIX)
   
   void *result = NULL;
-  if (kitsune_is_updating()) {
+  if (kitsune_is_updating() && !kitsune_is_rolling_back()) {
     
     int len = strlen(XFORM_NAME_BASE_S);
     if (namespace)
@@ -625,7 +855,8 @@ int kitsune_migrate_var(const char *var_name, const char *funcname,
       if (!old_var) {
         return 0;
       }
-      memcpy(var_addr, old_var, var_size);
+      if (old_var != var_addr)
+        memcpy(var_addr, old_var, var_size);
     }
     return 1;
   }
@@ -650,11 +881,13 @@ void kitsune_automigrate_key(const char *key, void* var_addr, size_t var_size, x
     if (!mapped_key) mapped_key = key;
     void *old_var = kitsune_lookup_key_old(mapped_key);
     if (!old_var) {
-      kitsune_log("kitsune_automigrate_key: could not find old-version address for mapped key (%s -> %s)\n",
-                 mapped_key, key);
+      kitsune_log_warn(KT_LOG_UPDATE,
+                       "kitsune_automigrate_key: could not find old-version address for mapped key (%s -> %s)\n",
+                      mapped_key, key);
       return;
     }
-    memcpy(var_addr, old_var, var_size);
+    if (old_var != var_addr)
+      memcpy(var_addr, old_var, var_size);
   }
 }
 
@@ -700,13 +933,30 @@ int kitsune_is_updating_from(const char *pt)
  */
 void kitsune_signal_update(void)
 {
+#ifdef ENABLE_THREADING
+  if (ktthread_absorb_kick())
+    return;
+#endif
   update_requested = 1;
+  trace_instant("update requested");
+#ifdef ENABLE_THREADING
+  ktthread_notify_coordinator();
+#endif
 }
 void kitsune_clear_request(void)
 {
   update_requested = 0;
 }
 
+/**
+ * \ingroup internal
+ * True if an update has been requested but not yet taken.
+ */
+int kitsune_update_requested(void)
+{
+  return update_requested;
+}
+
 /** 
  * \ingroup public
  * kitsune_set_next_version allows the executing version to set which files
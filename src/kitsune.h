@@ -29,6 +29,9 @@ int kitsune_is_updating_from(const char *pt);
 void kitsune_signal_update(void);
 void kitsune_clear_request(void);
 void kitsune_set_next_version(char *code);
+void kitsune_rollback(void);
+void kitsune_alloc_sites(int enable);
+char *kitsune_heap_census(void);
 
 char *kitsune_get_symbol_key(const char *name, const char *funcname, 
                             const char *filename, const char *namespace);
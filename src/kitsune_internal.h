@@ -13,9 +13,11 @@
       kitsune_log(__VA_ARGS__);                               \
       kitsune_log("%s:%d: %s: Assertion %s failed; aborting.",          \
                   __FILE__, __LINE__, __func__, #expr);                 \
+      kitsune_log_drain();                                              \
       fprintf(stderr, __VA_ARGS__);                           \
       fprintf(stderr,"%s:%d %s: Assertion %s failed; aborting.\n",      \
               __FILE__, __LINE__, __func__, #expr);                     \
+      kitsune_rollback();                                               \
       abort();                                                          \
     }} while(0)
 
@@ -37,3 +39,8 @@
 void kitsune_automigrate_key(const char *key, void* var_addr, size_t var_size, xform_fn_t xf);
 
 int kitsune_is_loading(void);
+int kitsune_update_requested(void);
+int  kitsune_phase(const char *phase);
+int  kitsune_dry_run_requested(void);
+int  kitsune_is_rolling_back(void);
+int  kitsune_update_committed(void);
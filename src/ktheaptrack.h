@@ -1,23 +1,34 @@
 #ifndef EKIDEN_HEAPTRACK_H_
 #define EKIDEN_HEAPTRACK_H_
 
+#include <stddef.h>
 #include "transform.h"
 
 /**
- * Types for address list access
+ * Types for address list access.  The addresses are kept in chunks (see
+ * heaptrack.c); an iterator points at one of them.
  */
 struct kitsune_heaplist_node
 {
 	void E_T(@t) * addr;
-	struct kitsune_heaplist_node E_G(@t) * next;
 } E_GENERIC(@t);
 
 typedef struct kitsune_heaplist_node E_G(@t) kitsune_heaplist_node E_GENERIC(@t);
 
+struct kitsune_heaplist_chunk;
+struct kitsune_heaplist_index;
+
+/**
+ * The chunks and index are the runtime's own and opaque to the type
+ * comparison.  xfgen migrates a list whose @t changed through XF_HEAPLIST
+ * instead, which rebuilds it from the transformed addresses.
+ */
 struct kitsune_heaplist
 {
-	kitsune_heaplist_node E_G(@t) * begin;
-	kitsune_heaplist_node E_G(@t) * last;
+	struct kitsune_heaplist_chunk * E_OPAQUE begin;
+	struct kitsune_heaplist_chunk * E_OPAQUE last;
+	size_t count;
+	struct kitsune_heaplist_index * E_OPAQUE index;
 } E_GENERIC(@t);
 
 typedef struct kitsune_heaplist E_G(@t) kitsune_heaplist E_GENERIC(@t);
@@ -25,8 +36,10 @@ typedef struct kitsune_heaplist E_G(@t) kitsune_heaplist E_GENERIC(@t);
 typedef kitsune_heaplist_node kitsune_heaplist_iterator;
 
 void kitsune_heaplist_init(kitsune_heaplist *);
+void kitsune_heaplist_free(kitsune_heaplist *);
 void kitsune_heaplist_add(kitsune_heaplist *, void *);
 int kitsune_heaplist_del(kitsune_heaplist *, void *);
+void kitsune_heaplist_transform(kitsune_heaplist *, closure *);
 
 /**
  * Functions for walking the list of addresses
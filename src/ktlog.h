@@ -2,6 +2,13 @@
 # define   	LOG_H_
 
 int kitsune_logging_init(const char *);
+/* Messages are written out later, on another thread, so fmt is kept rather
+   than copied: it must be a string literal (or otherwise outlive the next
+   kitsune_log_drain).  Strings are copied, up to their precision or 512
+   bytes; wide characters and strings are not supported. */
 void kitsune_log(const char *fmt, ...);
+void kitsune_log_drain(void);
+int kitsune_set_log_level(const char *spec);
+char *kitsune_get_log_levels(void);
 
 #endif 	    /* !LOG_H_ */
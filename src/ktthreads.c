@@ -1,9 +1,20 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
 #include "kitsune_internal.h"
 #include "ktthreads.h"
 #include "stackvars_internal.h"
+#include "trace_internal.h"
 
 typedef struct threadinfo {
   ktthread_info info;
@@ -12,9 +23,19 @@ typedef struct threadinfo {
   /* rapid qui. stuff */
   pthread_mutex_t thread_mutex;
   pthread_cond_t *cond_waiting;
+  int io_waiting;           /* blocked in one of the ktthreads_ I/O wrappers */
+  int wake_fd;              /* eventfd the I/O wrappers add to the wait set */
   void (*update_callback)(void*); 
   void * update_callback_args;
   int reached_update;
+  int kicked;               /* a SIGUSR2 kick is on its way to this thread */
+  const char *last_update_pt; /* most recent update point it passed */
+  const char *park_pt;      /* update point it is parked at */
+  uint64_t quiesce_ns;      /* time from the first thread reaching an update
+                               point until this one reached its own */
+  uint64_t launch_ns;       /* when the thread was relaunched after an update */
+  uint64_t relaunch_ns;     /* time from relaunch until it reached its update
+                               point again */
 
   /* Thread-local Kitsune data */
   void *stackvars_top;
@@ -29,49 +50,109 @@ void ktthreads_execute_update_callback(threadinfo * t);
 /* Not transferred during an update */
 pthread_key_t threadinfo_key;
 static int ktthreads_initialized = 0;
-static int mainwake_init = 0;
-pthread_cond_t mainwake_cond = PTHREAD_COND_INITIALIZER; 
+/* Monotonic time at which the first thread of this version noticed the
+   update request.  The thread that installs it also kicks the others. */
+static uint64_t quiesce_start_ns = 0;
 pthread_cond_t * main_cond_waiting = NULL; //used in place of threadinfo->cond_waiting.
+int main_io_waiting = 0; //used in place of threadinfo->io_waiting.
+static const char *main_last_update_pt = NULL;
+static __thread threadinfo *self_info = NULL;
+
+/* Update attempts.  Threads that notice a request park at their update point
+   until the attempt is decided.  The low half of park_state counts the
+   parked threads and the high half numbers the attempt; deciding an attempt
+   moves park_state on to the next number (so late arrivals cannot join it),
+   records the outcome and then publishes it through quiesce_gen, which the
+   parked threads sleep on. */
+#define QUIESCE_ABORT 0
+#define QUIESCE_COMMIT 1
+static volatile uint64_t park_state = 0;
+static volatile unsigned int quiesce_gen = 0;
+static volatile int quiesce_outcome = QUIESCE_ABORT;
+static volatile int main_arrived = 0;
 
 /* Transferred during an update */
 pthread_t main_tid;
+int main_wake_fd; //used in place of threadinfo->wake_fd.
 pthread_mutexattr_t *ktthreads_mutex_attr; 
 pthread_mutex_t *ktthreads_mutex;
 threadinfo *thread_list;
-pthread_cond_t *threads_ready_cond;
+int *quiesce_seq;
 pthread_cond_t *threads_proceed_cond;
 int *main_is_waiting;
 int *updated_count;
 int *threads_count;
+int quiesce_timeout_ms; /* 0: wait for quiescence indefinitely */
 
 /* Data for new threads added during transformation */
 static threadinfo *added_thread_list = NULL;
 
 static void threadinfo_dtor(void *);
+static void coordinator_start(void);
+static void coordinator_stop(void);
+static void coordinator_atfork_child(void);
+static int quiesce_abort(unsigned int gen);
+static int deadline_passed(uint64_t now);
+
+/* How often the main thread re-kicks stragglers while waiting for quiescence,
+   in case a kick raced with a thread going to sleep. */
+#define KTTHREAD_REKICK_MS 10
+
+static uint64_t monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Quiescence barrier.  Threads arriving at (or dying before) an update point
+ * bump the shared counters atomically and then advance quiesce_seq; the main
+ * thread sleeps on quiesce_seq with a futex instead of a mutex/condvar pair,
+ * so arrivals never serialize on ktthreads_mutex.
+ */
+static void quiesce_notify(void)
+{
+  __sync_add_and_fetch(quiesce_seq, 1);
+  if (*(volatile int *)main_is_waiting)
+    syscall(SYS_futex, quiesce_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static int quiesced(void)
+{
+  return *(volatile int *)threads_count == *(volatile int *)updated_count;
+}
 
 void ktthread_init(void)
 {
+  /* A version re-entered after a rollback is initialized a second time. */
+  int reentered = ktthreads_initialized;
   ktthreads_initialized = 1;
   int upd = kitsune_is_updating();
 
   INIT_OR_MIGRATE_VAL(main_tid, pthread_t, main_tid=pthread_self(), upd);
+  INIT_OR_MIGRATE_VAL(main_wake_fd, int, main_wake_fd=-1, upd);
   INIT_OR_MIGRATE_HEAP(ktthreads_mutex_attr, pthread_mutexattr_t,       
                        { pthread_mutexattr_init(ktthreads_mutex_attr);
                          pthread_mutexattr_settype(ktthreads_mutex_attr, PTHREAD_MUTEX_RECURSIVE); },
                        upd);
   INIT_OR_MIGRATE_HEAP(ktthreads_mutex, pthread_mutex_t, pthread_mutex_init(ktthreads_mutex, ktthreads_mutex_attr), upd);
   INIT_OR_MIGRATE_VAL(thread_list, threadinfo*, thread_list=NULL, upd);
-  INIT_OR_MIGRATE_HEAP(threads_ready_cond, pthread_cond_t, pthread_cond_init(threads_ready_cond, NULL), upd);
+  INIT_OR_MIGRATE_HEAP(quiesce_seq, int, *quiesce_seq=0, upd);
   INIT_OR_MIGRATE_HEAP(threads_proceed_cond, pthread_cond_t, pthread_cond_init(threads_proceed_cond, NULL), upd);
   INIT_OR_MIGRATE_HEAP(main_is_waiting, int, *main_is_waiting=0, upd);
   INIT_OR_MIGRATE_HEAP(updated_count, int, *updated_count=0, upd);
   INIT_OR_MIGRATE_HEAP(threads_count, int, *threads_count=0, upd);
+  INIT_OR_MIGRATE_VAL(quiesce_timeout_ms, int, quiesce_timeout_ms=0, upd);
   
   /* we initialize a new key rather than inheriting the key from the previous
      version because the destructor callback is invalid after the old version
      library is unloaded. */
-  pthread_key_create(&threadinfo_key, threadinfo_dtor);
-
+  if (!reentered) {
+    pthread_key_create(&threadinfo_key, threadinfo_dtor);
+    pthread_atfork(NULL, NULL, coordinator_atfork_child);
+  }
+  coordinator_start();
 
 }
 
@@ -91,6 +172,8 @@ static void free_threadinfo(threadinfo *ti, threadinfo **list)
   if (ti->prev) ti->prev->next = ti->next;
   if (ti->next) ti->next->prev = ti->prev;
   if (*list == ti) *list = ti->next;
+  if (ti->wake_fd >= 0)
+    close(ti->wake_fd);
   free(ti);
   pthread_mutex_unlock(ktthreads_mutex);
 }
@@ -99,20 +182,21 @@ static void threadinfo_dtor(void *data)
 {
   struct threadinfo *tinfo = data;
 
-  pthread_mutex_lock(ktthreads_mutex);
   if (!tinfo->info.update_pt) {
     /* If the thread died normally (i.e., not as a result of reaching an update
        point after an update has been requested, we remove it. */
-    kitsune_log("Thread died.");
+    kitsune_log_debug(KT_LOG_THREADS, "Thread died.");
     free_threadinfo(tinfo, &thread_list);
-    (*threads_count)--;
+    __sync_sub_and_fetch(threads_count, 1);
   } else {
-    kitsune_log("Thread reached update point: %s (%d/%d), main: %s", tinfo->info.update_pt, *updated_count, *threads_count, *main_is_waiting ? "waiting" : "not yet waiting");
-    (*updated_count)++;
+    int updated = __sync_add_and_fetch(updated_count, 1);
+    kitsune_log_debug(KT_LOG_THREADS,
+                      "Thread reached update point: %s (%d/%d) after %.3f ms, main: %s",
+                      tinfo->info.update_pt, updated, *threads_count,
+                      tinfo->quiesce_ns / 1000000.0,
+                      *main_is_waiting ? "waiting" : "not yet waiting");
   }
-  if (*main_is_waiting && *threads_count == *updated_count)
-    pthread_cond_signal(threads_ready_cond);
-  pthread_mutex_unlock(ktthreads_mutex);
+  quiesce_notify();
 }
 
 static void *thread_wrap(void *data)
@@ -121,6 +205,7 @@ static void *thread_wrap(void *data)
   assert(tinfo);
   int ret = pthread_setspecific(threadinfo_key, data);
   assert(!ret); /* Success. */
+  self_info = tinfo;
   if (kitsune_is_updating()) {
     stackvars_flip();
   }
@@ -163,6 +248,7 @@ int kitsune_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
   tinfo->removed = 0;
   tinfo->reached_update = 0;
   tinfo->cond_waiting = NULL;
+  tinfo->wake_fd = -1;
   tinfo->update_callback = NULL;
   tinfo->update_callback_args = NULL;
   pthread_mutex_init(&tinfo->thread_mutex, ktthreads_mutex_attr);
@@ -176,9 +262,11 @@ int kitsune_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
   int result = pthread_create(&tinfo->thread, &tinfo->info.attr, thread_wrap, tinfo);
 
   if(result == 0){ //don't increment unless result is success!!!
-    pthread_mutex_lock(ktthreads_mutex);
-    (*threads_count)++; 
-    pthread_mutex_unlock(ktthreads_mutex);
+    __sync_add_and_fetch(threads_count, 1);
+  } else {
+    /* nothing may signal the thread that was never created */
+    free_threadinfo(tinfo, &thread_list);
+    return result;
   }
 
   /* return the correct pthread_t to the caller.  TODO: unfortunately, we may
@@ -201,29 +289,87 @@ void **ktthread_get_top_old(void)
 int ktthread_is_main(void) 
 { return main_tid == pthread_self(); }
 
+static void kick_threads(void);
+static void wake_io(int fd);
+
+/* Block until every child thread has reached an update point or died. */
+static void wait_for_threads(void)
+{
+  *main_is_waiting = 1;
+  __sync_synchronize();
+  if (!quiesced())
+    kitsune_log_debug(KT_LOG_THREADS, "thread[main]: waiting for threads to reach kitsune_update.");
+  for (;;) {
+    int seq = *(volatile int *)quiesce_seq;
+    if (quiesced())
+      break;
+    syscall(SYS_futex, quiesce_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+  }
+  *main_is_waiting = 0;
+  kitsune_log_debug(KT_LOG_THREADS, "thread[main]: done waiting for threads.");
+}
+
 void ktthread_main_wait(void)
 {
   assert(ktthread_is_main());
-  pthread_mutex_lock(ktthreads_mutex);
-  if (*threads_count != *updated_count)  {
-    *main_is_waiting = 1;
-    kitsune_log("thread[main]: waiting for threads to reach kitsune_update.");
-    pthread_cond_wait(threads_ready_cond, ktthreads_mutex);
-    kitsune_log("thread[main]: done waiting for threads.");
+  wait_for_threads();
+
+  threadinfo *cur;
+  for (cur = thread_list; cur; cur = cur->next)
+    kitsune_log_debug(KT_LOG_THREADS,
+                      "thread[%s]: quiesced after %.3f ms", cur->info.update_pt,
+                      cur->quiesce_ns / 1000000.0);
+  *updated_count = 0;
+}
+
+/* Thread creation is split across this many helper threads once there are
+   at least KTTHREAD_LAUNCH_BATCH threads to relaunch. */
+#define KTTHREAD_LAUNCHERS 4
+#define KTTHREAD_LAUNCH_BATCH 64
+
+typedef struct launch_batch {
+  threadinfo **threads;
+  int count;
+} launch_batch;
+
+/* Relaunch *tp.  If the thread cannot be created its entry is dropped from
+   the thread list, so that nothing signals its indeterminate pthread_t, and
+   *tp is cleared. */
+static void launch_thread(threadinfo **tp)
+{
+  threadinfo *t = *tp;
+  t->launch_ns = monotonic_ns();
+  int result = pthread_create(&t->thread, &t->info.attr, thread_wrap, t);
+  if (result) {
+    kitsune_log_error(KT_LOG_THREADS, "thread[%s]: relaunch failed (%d).", t->info.update_pt, result);
+    free_threadinfo(t, &thread_list);
+    *tp = NULL;
+    __sync_sub_and_fetch(threads_count, 1);
+    quiesce_notify();
   }
-  (*updated_count) = 0;
-  pthread_mutex_unlock(ktthreads_mutex);
+}
+
+static void *launcher_thread(void *data)
+{
+  launch_batch *b = data;
+  int i;
+  for (i = 0; i < b->count; i++)
+    launch_thread(&b->threads[i]);
+  return NULL;
 }
 
 void ktthread_launch_wait(void)
 {
   assert(ktthread_is_main());
+  uint64_t start = monotonic_ns();
   pthread_mutex_lock(ktthreads_mutex);
-  kitsune_log("thread[main]: reached update point, launching threads.");
-  (*updated_count) = 0;
-  (*threads_count) = 0;
+  kitsune_log_info(KT_LOG_THREADS, "thread[main]: reached update point, launching threads.");
+
+  /* Drop removed threads, splice in added ones and translate every start
+     function before any thread is created, so that creation itself does not
+     need the thread-management lock. */
   threadinfo *cur = thread_list;
-  /* launch existing threads */
+  int count = 0;
   while (cur) {
     if (cur->removed) {
       threadinfo *tmp = cur->next;
@@ -235,92 +381,492 @@ void ktthread_launch_wait(void)
        transformation */
     void *tmp = cur->info.start_fun;
     transform_fptr(&tmp, &cur->info.start_fun, 0, NULL);
-    (*threads_count)++;
-    pthread_create(&cur->thread, &cur->info.attr, thread_wrap, cur);
+    count++;
     cur = cur->next;
   }
-
-  /* launch added threads */
   cur = added_thread_list;
   while (cur) {
     threadinfo *tmp = cur->next;
     cur->prev = NULL;
     cur->next = thread_list;
+    if (thread_list)
+      thread_list->prev = cur;
     thread_list = cur;
-    (*threads_count)++;
-    pthread_create(&cur->thread, &cur->info.attr, thread_wrap, cur);
+    count++;
     cur = tmp;
   }
+  added_thread_list = NULL;
 
+  threadinfo **launch = malloc(sizeof(threadinfo *) * (count ? count : 1));
+  int i = 0;
+  for (cur = thread_list; cur; cur = cur->next)
+    launch[i++] = cur;
   pthread_mutex_unlock(ktthreads_mutex);
-  ktthread_main_wait();
+
+  /* The barrier must see the full count before the first thread arrives. */
+  *updated_count = 0;
+  *threads_count = count;
+  __sync_synchronize();
+
+  if (count < KTTHREAD_LAUNCH_BATCH) {
+    for (i = 0; i < count; i++)
+      launch_thread(&launch[i]);
+  } else {
+    pthread_t launchers[KTTHREAD_LAUNCHERS];
+    int started[KTTHREAD_LAUNCHERS];
+    launch_batch batches[KTTHREAD_LAUNCHERS];
+    int per = (count + KTTHREAD_LAUNCHERS - 1) / KTTHREAD_LAUNCHERS;
+    for (i = 0; i < KTTHREAD_LAUNCHERS; i++) {
+      batches[i].threads = launch + i * per;
+      batches[i].count = count - i * per < per ? count - i * per : per;
+      started[i] = !pthread_create(&launchers[i], NULL, launcher_thread, &batches[i]);
+      if (!started[i]) /* fall back to creating this batch ourselves */
+        launcher_thread(&batches[i]);
+    }
+    for (i = 0; i < KTTHREAD_LAUNCHERS; i++)
+      if (started[i])
+        pthread_join(launchers[i], NULL);
+  }
+  kitsune_log_info(KT_LOG_THREADS,
+                   "thread[main]: launched %d threads in %.3f ms.", count,
+                   (monotonic_ns() - start) / 1000000.0);
+  trace_span("relaunch threads", NULL, start, monotonic_ns());
+
+  wait_for_threads();
+  for (i = 0; i < count; i++)
+    if (launch[i])
+      kitsune_log_debug(KT_LOG_THREADS,
+                        "thread[%d]: reached update point %.3f ms after relaunch", 
+                        i, launch[i]->relaunch_ns / 1000000.0);
+  free(launch);
+  *updated_count = 0;
 }
 
 
-/* this is where the threads kick the other threads*/
-void ktthread_rapidq(void){
+/* Kick every child thread that has not yet reached an update point: run its
+   update callback, then wake it from the condition variable it is blocked on
+   or interrupt it with SIGUSR2.  The walk holds the thread-management lock,
+   so that a thread exiting meanwhile cannot free its entry under us. */
+static void kick_threads(void)
+{
+  /* Give the other threads a kick in the pants! */
+  ktthread_lock();
+  if (main_cond_waiting)
+    pthread_cond_signal(main_cond_waiting);
+  if (main_io_waiting)
+    wake_io(main_wake_fd);
 
-   if(!ktthread_is_main()){
-     ktthread_singlethread_lock(cur_threadinfo());
-     cur_threadinfo()->reached_update = 1;
-     ktthread_singlethread_unlock(cur_threadinfo());
-   }
- 
-   kitsune_log("waiting for other threads (%d/%d)", *updated_count, *threads_count);
-   /* Give the other threads a kick in the pants! */
-   if (mainwake_init)
-     pthread_cond_signal(&mainwake_cond);
-   if(*threads_count != *updated_count){
-     /* this list only contains the helper threads, not the main thread */
-     threadinfo *cur = thread_list;
-     while (cur) {
-       ktthread_singlethread_lock(cur);
-       ktthreads_execute_update_callback(cur);
-       int thread_reached_update = cur->reached_update;
-       ktthread_singlethread_unlock(cur);
-
-       if (!thread_reached_update) {
-         if (cur->cond_waiting) 
-           pthread_cond_signal(cur->cond_waiting);
-         else
-           pthread_kill(cur->thread, SIGUSR2);
-       }
-       cur = cur->next;
-     }
-   }
-
-   if(!ktthread_is_main()){
-     ktthread_singlethread_lock(cur_threadinfo());
-     cur_threadinfo()->reached_update = 0;
-     ktthread_singlethread_unlock(cur_threadinfo());
-   }
+  /* this list only contains the helper threads, not the main thread */
+  threadinfo *cur = thread_list;
+  while (cur) {
+    ktthread_singlethread_lock(cur);
+    int thread_reached_update = cur->reached_update || cur->info.update_pt;
+    if (!thread_reached_update)
+      ktthreads_execute_update_callback(cur);
+    pthread_cond_t *cond_waiting = cur->cond_waiting;
+    int io_waiting = cur->io_waiting;
+    ktthread_singlethread_unlock(cur);
+
+    if (!thread_reached_update) {
+      if (io_waiting)
+        wake_io(cur->wake_fd);
+      else if (cond_waiting) 
+        pthread_cond_signal(cond_waiting);
+      else {
+        cur->kicked = 1;
+        pthread_kill(cur->thread, SIGUSR2);
+      }
+    }
+    cur = cur->next;
+  }
+  ktthread_unlock();
+}
+
+/*
+ * Update coordinator.  One long-lived thread per version owns update
+ * initiation: the update signal (via kitsune_signal_update) pokes its
+ * eventfd, and it then wakes the main thread and kicks every child thread
+ * blocked in a registered condvar or I/O wrapper.  Until the main thread
+ * takes the update it keeps re-kicking stragglers every KTTHREAD_REKICK_MS,
+ * acting as a watchdog for kicks that were missed, and it abandons the
+ * attempt if the main thread itself misses the quiescence deadline.
+ */
+static pthread_t coordinator;
+static volatile int coordinator_running = 0;
+static volatile int coordinator_stopping = 0;
+static int coordinator_fd = -1;
+
+static void *coordinator_thread(void *_ignored)
+{
+  struct pollfd p;
+  uint64_t val;
+
+  p.fd = coordinator_fd;
+  p.events = POLLIN;
+  while (!coordinator_stopping) {
+    /* A request only counts once the previous update has finished. */
+    int pending = kitsune_update_requested() && !kitsune_is_updating();
+    p.revents = 0;
+    if (poll(&p, 1, pending ? KTTHREAD_REKICK_MS : -1) > 0)
+      while (read(coordinator_fd, &val, sizeof(val)) == sizeof(val));
+    /* Read the attempt number before the request, so that it names the
+       attempt the request belongs to (see quiesce_abort). */
+    uint64_t st = park_state, now = monotonic_ns();
+    if (coordinator_stopping || !kitsune_update_requested() || 
+        kitsune_is_updating())
+      continue;
+
+    /* The deadline runs from whichever comes first: the coordinator seeing
+       the request or a thread parking for it. */
+    __sync_bool_compare_and_swap(&quiesce_start_ns, 0, now);
+    if (!main_arrived && deadline_passed(now))
+      quiesce_abort(st >> 32);
+    else
+      kick_threads();
+  }
+  return NULL;
+}
+
+static void coordinator_start(void)
+{
+  if (coordinator_running)
+    return;
+  if (coordinator_fd < 0)
+    coordinator_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  coordinator_stopping = 0;
+  if (pthread_create(&coordinator, NULL, coordinator_thread, NULL) == 0)
+    coordinator_running = 1;
+  else
+    kitsune_log_warn(KT_LOG_THREADS, "coordinator: could not be started; relying on kicks from threads.");
+}
+
+static void coordinator_stop(void)
+{
+  if (!coordinator_running)
+    return;
+  coordinator_stopping = 1;
+  wake_io(coordinator_fd);
+  pthread_join(coordinator, NULL);
+  coordinator_running = 0;
+}
+
+/* Threads do not survive fork(); the child starts its own coordinator. */
+static void coordinator_atfork_child(void)
+{
+  coordinator_running = 0;
+  coordinator_start();
+}
+
+/* Called from the update signal handler, so only async-signal-safe calls. */
+void ktthread_notify_coordinator(void)
+{
+  uint64_t one = 1;
+  if (coordinator_running && write(coordinator_fd, &one, sizeof(one)) < 0)
+    return; /* the counter is saturated, so the coordinator is awake anyway */
+}
+
+static void futex_wait_gen(unsigned int gen, const struct timespec *timeout)
+{
+  syscall(SYS_futex, &quiesce_gen, FUTEX_WAIT_PRIVATE, gen, timeout, NULL, 0);
+}
+
+/* Settle attempt gen with the given outcome, unless somebody else settled it
+   first; either way, return the outcome it was settled with. */
+static int quiesce_decide(unsigned int gen, int outcome)
+{
+  for (;;) {
+    uint64_t st = park_state;
+    if ((unsigned int)(st >> 32) != gen)
+      break;
+    if (__sync_bool_compare_and_swap(&park_state, st, (uint64_t)(gen + 1) << 32)) {
+      quiesce_start_ns = 0;
+      quiesce_outcome = outcome;
+      __sync_synchronize();
+      quiesce_gen = gen + 1;
+      syscall(SYS_futex, &quiesce_gen, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+      return outcome;
+    }
+  }
+  while (quiesce_gen == gen)
+    futex_wait_gen(gen, NULL);
+  return quiesce_outcome;
+}
+
+/* Log every thread that has not reached an update point, together with the
+   last update point it was seen passing. */
+static void report_stragglers(void)
+{
+  threadinfo *cur;
+  int count = 0;
+
+  if (!main_arrived) {
+    kitsune_log_warn(KT_LOG_THREADS,
+                     "thread[main]: did not quiesce; last update point: %s",
+                     main_last_update_pt ? main_last_update_pt : "(none)");
+    count++;
+  }
+  pthread_mutex_lock(ktthreads_mutex);
+  for (cur = thread_list; cur; cur = cur->next) {
+    if (cur->reached_update)
+      continue;
+    kitsune_log_warn(KT_LOG_THREADS,
+                     "thread[%lu]: did not quiesce; last update point: %s",
+                     (unsigned long)cur->thread,
+                     cur->last_update_pt ? cur->last_update_pt : "(none)");
+    count++;
+  }
+  pthread_mutex_unlock(ktthreads_mutex);
+  kitsune_log_warn(KT_LOG_THREADS,
+                   "update aborted: %d thread(s) missed the %d ms quiescence deadline.",
+                   count, quiesce_timeout_ms);
+}
+
+/* Abandon attempt gen: withdraw the request first, so that nobody can park in
+   the next attempt, then release everyone parked in this one. */
+static int quiesce_abort(unsigned int gen)
+{
+  report_stragglers();
+  kitsune_clear_request();
+  int outcome = quiesce_decide(gen, QUIESCE_ABORT);
+  if (outcome == QUIESCE_ABORT)
+    kitsune_phase("aborted");
+  return outcome;
+}
+
+static int deadline_passed(uint64_t now)
+{
+  uint64_t start = quiesce_start_ns;
+  return quiesce_timeout_ms && start && 
+    now - start >= (uint64_t)quiesce_timeout_ms * 1000000;
+}
+
+/* In a dry-run child only the main thread exists: the parked threads are
+   gone, but their stacks were copied along with the rest of memory.  Do for
+   each of them what it would have done before exiting for the update. */
+static void dry_run_adopt_threads(void)
+{
+  threadinfo *cur;
+  for (cur = thread_list; cur; cur = cur->next) {
+    stackvars_move_to_heap_from(&cur->stackvars_top);
+    cur->info.update_pt = cur->park_pt;
+  }
+  *updated_count = *threads_count;
+}
+
+/* A child thread noticed the request: park at the update point until the
+   main thread commits to the update or the attempt is abandoned. */
+static int quiesce_child(const char *pt_name)
+{
+  threadinfo *self = cur_threadinfo();
+  uint64_t st, arrived = trace_now();
+
+  ktthread_singlethread_lock(self);
+  self->reached_update = 1;
+  self->park_pt = pt_name;
+  ktthread_singlethread_unlock(self);
+  do {
+    st = park_state;
+    if (!kitsune_update_requested()) {
+      ktthread_singlethread_lock(self);
+      self->reached_update = 0;
+      ktthread_singlethread_unlock(self);
+      return QUIESCE_ABORT;
+    }
+  } while (!__sync_bool_compare_and_swap(&park_state, st, st + 1));
+
+  uint64_t now = monotonic_ns();
+  int first = __sync_bool_compare_and_swap(&quiesce_start_ns, 0, now);
+  self->quiesce_ns = now - quiesce_start_ns;
+  quiesce_notify();
+  trace_span("quiesce", pt_name, arrived, now);
+  kitsune_log_debug(KT_LOG_THREADS,
+                    "thread[%s]: parked (%d/%d)", pt_name, 
+                    (int)(uint32_t)(st + 1), *threads_count);
+  if (first)
+    kick_threads();
+
+  unsigned int gen = st >> 32;
+  while (quiesce_gen == gen)
+    futex_wait_gen(gen, NULL);
+  if (quiesce_outcome == QUIESCE_COMMIT)
+    return QUIESCE_COMMIT;
+
+  ktthread_singlethread_lock(self);
+  self->reached_update = 0;
+  ktthread_singlethread_unlock(self);
+  kitsune_log_info(KT_LOG_THREADS, "thread[%s]: update aborted, resuming.", pt_name);
+  return QUIESCE_ABORT;
+}
+
+/* The main thread noticed the request: wait, kicking stragglers, until every
+   child thread is parked, and commit; give up once the deadline passes. */
+static int quiesce_main(const char *pt_name)
+{
+  uint64_t st = park_state;
+  unsigned int gen = st >> 32;
+  int outcome = QUIESCE_ABORT;
+
+  main_arrived = 1;
+  if (!kitsune_update_requested()) {
+    main_arrived = 0;
+    return QUIESCE_ABORT;
+  }
+  if (__sync_bool_compare_and_swap(&quiesce_start_ns, 0, monotonic_ns()))
+    kick_threads();
+
+  *main_is_waiting = 1;
+  __sync_synchronize();
+  kitsune_log_debug(KT_LOG_THREADS,
+                    "thread[main]: waiting for threads to park (%d/%d)",
+                    (int)(uint32_t)park_state, *threads_count);
+  for (;;) {
+    int seq = *(volatile int *)quiesce_seq;
+    st = park_state;
+    if ((unsigned int)(st >> 32) != gen)
+      break; /* abandoned by the coordinator */
+    if ((int)(uint32_t)st >= *(volatile int *)threads_count) {
+      outcome = QUIESCE_COMMIT;
+      break;
+    }
+    uint64_t now = monotonic_ns();
+    if (deadline_passed(now))
+      break;
+
+    uint64_t wait = KTTHREAD_REKICK_MS * 1000000ull;
+    if (quiesce_timeout_ms) {
+      uint64_t left = quiesce_start_ns + quiesce_timeout_ms * 1000000ull - now;
+      if (left < wait)
+        wait = left;
+    }
+    struct timespec interval = { 0, wait };
+    if (syscall(SYS_futex, quiesce_seq, FUTEX_WAIT_PRIVATE, seq, &interval,
+                NULL, 0) && errno == ETIMEDOUT)
+      kick_threads();
+  }
+  *main_is_waiting = 0;
+
+  if (outcome == QUIESCE_COMMIT && kitsune_dry_run_requested()) {
+    /* The update goes ahead in a forked child; here the threads resume. */
+    pid_t child = fork();
+    if (child != 0) {
+      if (child < 0) {
+        kitsune_log_error(KT_LOG_THREADS, "thread[main]: could not fork for the dry run.");
+        kitsune_phase("aborted");
+      } else {
+        kitsune_log_info(KT_LOG_THREADS, "thread[main]: dry run in process %d, resuming.", child);
+      }
+      kitsune_clear_request();
+      quiesce_decide(gen, QUIESCE_ABORT);
+      main_arrived = 0;
+      return QUIESCE_ABORT;
+    }
+    dry_run_adopt_threads();
+  } else if (outcome == QUIESCE_COMMIT) {
+    outcome = quiesce_decide(gen, QUIESCE_COMMIT);
+  } else {
+    outcome = quiesce_abort(gen);
+  }
+  main_arrived = 0;
+
+  if (outcome == QUIESCE_COMMIT) {
+    kitsune_log_info(KT_LOG_THREADS, "thread[main]: all threads parked, taking update at %s.", pt_name);
+    /* The coordinator runs this version's code, so it must be gone before
+       the main thread leaves for the next version. */
+    coordinator_stop();
+  } else {
+    kitsune_log_info(KT_LOG_THREADS, "thread[main]: update aborted, resuming.");
+  }
+  return outcome;
+}
+
+/* Called by each thread that notices the update request, before it moves its
+   stack variables to the heap.  Returns false if the update was abandoned, in
+   which case the thread carries on from its update point. */
+int ktthread_quiesce(const char *pt_name)
+{
+  if (ktthread_is_main())
+    return quiesce_main(pt_name);
+  return quiesce_child(pt_name);
+}
+
+void ktthread_note_update_pt(const char *pt_name)
+{
+  if (self_info)
+    self_info->last_update_pt = pt_name;
+  else if (ktthread_is_main())
+    main_last_update_pt = pt_name;
+}
+
+/* Called from the update signal handler: true if the signal was one of our
+   own kicks rather than a new update request. */
+int ktthread_absorb_kick(void)
+{
+  return self_info && __sync_lock_test_and_set(&self_info->kicked, 0);
+}
+
+void ktthreads_set_quiesce_timeout(int timeout_ms)
+{
+  quiesce_timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
 }
 
 void ktthread_do_update(const char *pt_name)
 {
   assert(!ktthread_is_main());
   assert(!kitsune_is_updating());
-  cur_threadinfo()->info.update_pt = pt_name;
+  threadinfo *self = cur_threadinfo();
+  ktthread_singlethread_lock(self);
+  self->info.update_pt = pt_name;
+  ktthread_singlethread_unlock(self);
   pthread_exit(0);
 }
 
-void ktthread_main_finish_update(void) {
+void ktthread_main_finish_update(int next_hop) {
   assert(ktthread_is_main());
   pthread_mutex_lock(ktthreads_mutex);
   kitsune_clear_request(); //clear this, may get set from spurious signals from rapid_q.
+  /* Set before the threads are released, so that they park again at the
+     update point they just reached instead of resuming. */
+  if (next_hop)
+    kitsune_signal_update();
   pthread_cond_broadcast(threads_proceed_cond);  
   pthread_mutex_unlock(ktthreads_mutex);
 }
 
+/* The update to this version is being rolled back: stop the coordinator (its
+   code is about to be unloaded) and undo the changes transformers may have
+   made to the thread list, which the old version goes on using. */
+void ktthread_rollback(void) {
+  assert(ktthread_is_main());
+  coordinator_stop();
+  pthread_key_delete(threadinfo_key);
+
+  threadinfo *cur;
+  pthread_mutex_lock(ktthreads_mutex);
+  for (cur = thread_list; cur; cur = cur->next)
+    cur->removed = 0;
+  while (added_thread_list) {
+    cur = added_thread_list;
+    added_thread_list = cur->next;
+    free((char *)cur->info.update_pt);
+    free(cur);
+  }
+  /* The old threads are still gone, as ktthread_main_wait found them. */
+  *updated_count = *threads_count;
+  pthread_mutex_unlock(ktthreads_mutex);
+}
+
 void ktthread_finish_update(void) {
   assert(!ktthread_is_main());
   assert(kitsune_is_updating());
   pthread_mutex_lock(ktthreads_mutex);
-  kitsune_log("thread[%s]: reached update point.", cur_threadinfo()->info.update_pt);
+  kitsune_log_debug(KT_LOG_THREADS, "thread[%s]: reached update point.", cur_threadinfo()->info.update_pt);
   cur_threadinfo()->info.update_pt = NULL;
-  (*updated_count)++;
-  if (*main_is_waiting && *threads_count == *updated_count)
-    pthread_cond_signal(threads_ready_cond);
+  cur_threadinfo()->reached_update = 0;
+  cur_threadinfo()->relaunch_ns = monotonic_ns() - cur_threadinfo()->launch_ns;
+  trace_span("to update point", NULL, cur_threadinfo()->launch_ns,
+             cur_threadinfo()->launch_ns + cur_threadinfo()->relaunch_ns);
+  __sync_add_and_fetch(updated_count, 1);
+  quiesce_notify();
 
   /* Wait for the main thread to finish some cleanup */
   pthread_cond_wait(threads_proceed_cond, ktthreads_mutex);
@@ -365,7 +911,7 @@ void kitsune_thread_remove(void)
 
 void kitsune_thread_add(void *arg, kt_pthread_fn *start_fun, const char *update_pt, pthread_attr_t *attr)
 {
-  threadinfo *tinfo = malloc(sizeof(threadinfo));
+  threadinfo *tinfo = calloc(1, sizeof(threadinfo));
   tinfo->info.start_fun = start_fun;
   if (attr) {
     tinfo->info.attr = *attr;
@@ -374,6 +920,8 @@ void kitsune_thread_add(void *arg, kt_pthread_fn *start_fun, const char *update_
   tinfo->info.update_pt = strdup(update_pt);
 
   tinfo->removed = 0;
+  tinfo->wake_fd = -1;
+  pthread_mutex_init(&tinfo->thread_mutex, ktthreads_mutex_attr);
   tinfo->stackvars_top = NULL;
   tinfo->stackvars_top_old = NULL;
 
@@ -381,73 +929,39 @@ void kitsune_thread_add(void *arg, kt_pthread_fn *start_fun, const char *update_
   add_threadinfo(tinfo, &added_thread_list);
 }
 
-static void *mainwake_thread(void *_ignored) {
-  ktthread_lock();
-  //while (1) {
-    //static struct timespec time_to_wait = {0, 0};
-    //time_to_wait.tv_sec = time(NULL) + 5;
-    //pthread_cond_timedwait(&mainwake_cond, ktthreads_mutex, &time_to_wait);
-    if (kitsune_is_updating()) {
-      if (main_cond_waiting) {
-        kitsune_log("mainwake: attempting to wake main");
-        pthread_cond_signal(main_cond_waiting);
-      }
-      mainwake_init = 0;
-    //  break;
-    }
-  //}
-  ktthread_unlock();
-  return NULL;
-}
-
-static void init_mainwake_thread(void) {
-  mainwake_init = 1;
-  pthread_t tid;
-  pthread_create(&tid, NULL, mainwake_thread, NULL);
+/* Record the condition variable the calling thread is about to block on, so
+   that kick_threads can signal it.  Child threads publish it under their
+   own per-thread lock; only the main thread's slot lives in the shared
+   thread-management domain. */
+static void set_cond_waiting(pthread_cond_t *cond) {
+  if (ktthread_is_main()) {
+    ktthread_lock();
+    main_cond_waiting = cond;
+    ktthread_unlock();
+  } else {
+    threadinfo *t = cur_threadinfo();
+    ktthread_singlethread_lock(t);
+    t->cond_waiting = cond;
+    ktthread_singlethread_unlock(t);
+  }
 }
 
 int ktthreads_pthread_cond_wait(void *cond_a, void *mutex_a) {
-  if (!mainwake_init && ktthread_is_main()) {
-    init_mainwake_thread();
-  }
   pthread_cond_t *cond = cond_a;
   pthread_mutex_t *mutex = mutex_a;
-  ktthread_lock();
-  if(!ktthread_is_main())
-    cur_threadinfo()->cond_waiting = cond;
-  else
-    main_cond_waiting = cond;
-  ktthread_unlock();
+  set_cond_waiting(cond);
   int result = pthread_cond_wait(cond, mutex);
-  ktthread_lock();
-  if(!ktthread_is_main())
-    cur_threadinfo()->cond_waiting = NULL;
-  else
-    main_cond_waiting = NULL;
-  ktthread_unlock();
+  set_cond_waiting(NULL);
   return result;
 }
 
 int ktthreads_pthread_cond_timedwait(void *cond_a, void *mutex_a, const void *timeout_a) {
-  if (!mainwake_init && ktthread_is_main()) {
-    init_mainwake_thread();
-  }                       
   pthread_cond_t *cond = cond_a;
   pthread_mutex_t *mutex = mutex_a;
   const struct timespec *timeout = timeout_a;
-  ktthread_lock();
-  if(!ktthread_is_main())
-    cur_threadinfo()->cond_waiting = cond;
-  else
-    main_cond_waiting = cond;
-  ktthread_unlock();              
+  set_cond_waiting(cond);
   int result = pthread_cond_timedwait(cond, mutex, timeout);
-  ktthread_lock();
-  if(!ktthread_is_main())
-    cur_threadinfo()->cond_waiting = NULL;
-  else
-    main_cond_waiting = NULL;
-  ktthread_unlock();
+  set_cond_waiting(NULL);
   return result;                                
 }
 
@@ -474,3 +988,264 @@ void ktthreads_ms_sleep(int timeInMs) {
   pthread_mutex_unlock(&fakeMutex);                                           
 } 
 
+
+/*
+ * Update-aware I/O wrappers.  Each thread owns an eventfd that the wrappers
+ * wait on beside whatever descriptors the caller is waiting on; kick_threads
+ * writes to it instead of interrupting the thread with SIGUSR2, so an event
+ * loop wakes exactly once and without a stray EINTR elsewhere.
+ */
+static void wake_io(int fd)
+{
+  uint64_t one = 1;
+  if (fd >= 0 && write(fd, &one, sizeof(one)) < 0)
+    kitsune_log_warn(KT_LOG_THREADS, "wake_io: eventfd write failed (%d)", errno);
+}
+
+static int *cur_wake_fd(void)
+{
+  return ktthread_is_main() ? &main_wake_fd : &cur_threadinfo()->wake_fd;
+}
+
+/* Mark the calling thread as blocked in I/O (or not).  Returns true if an
+   update was already requested, in which case the caller should not block:
+   the kick may have been sent before io_waiting was visible. */
+static int set_io_waiting(int waiting)
+{
+  int *wake_fd = cur_wake_fd();
+  if (waiting && *wake_fd < 0)
+    *wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (ktthread_is_main()) {
+    ktthread_lock();
+    main_io_waiting = waiting;
+    ktthread_unlock();
+  } else {
+    threadinfo *t = cur_threadinfo();
+    ktthread_singlethread_lock(t);
+    t->io_waiting = waiting;
+    ktthread_singlethread_unlock(t);
+  }
+  return waiting && kitsune_update_requested();
+}
+
+/* Consume a pending wakeup; returns true if there was one. */
+static int drain_wake_fd(void)
+{
+  uint64_t val;
+  return read(*cur_wake_fd(), &val, sizeof(val)) == sizeof(val);
+}
+
+int ktthreads_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+  struct pollfd local[16];
+  struct pollfd *all = nfds < 16 ? local : malloc(sizeof(struct pollfd) * (nfds + 1));
+  nfds_t i;
+  int result;
+
+  /* Nothing is ready on any path that returns 0. */
+  for (i = 0; i < nfds; i++)
+    fds[i].revents = 0;
+  if (set_io_waiting(1)) {
+    set_io_waiting(0);
+    if (all != local)
+      free(all);
+    return 0;
+  }
+  memcpy(all, fds, sizeof(struct pollfd) * nfds);
+  all[nfds].fd = *cur_wake_fd();
+  all[nfds].events = POLLIN;
+  all[nfds].revents = 0;
+  result = poll(all, nfds + 1, timeout);
+  set_io_waiting(0);
+
+  if (result > 0) {
+    if (all[nfds].revents) {
+      drain_wake_fd();
+      result--;
+    }
+    for (i = 0; i < nfds; i++)
+      fds[i].revents = all[i].revents;
+  }
+  if (all != local)
+    free(all);
+  return result;
+}
+
+static uint64_t now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* The epoll set itself is left alone (it may be shared with threads that
+   wait on it directly, or through this wrapper with eventfds of their own):
+   the thread polls the set's descriptor, which is readable while events are
+   ready, beside its eventfd, and only then collects them. */
+int ktthreads_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+  struct pollfd p[2];
+  uint64_t deadline = timeout > 0 ? now_ms() + timeout : 0;
+  int result;
+
+  for (;;) {
+    p[0].fd = epfd;
+    p[0].events = POLLIN;
+    p[0].revents = 0;
+    result = ktthreads_poll(p, 1, timeout);
+    if (result <= 0)
+      return result;            /* error, timeout or an update request */
+
+    result = epoll_wait(epfd, events, maxevents, 0);
+    if (result != 0 || timeout == 0)
+      return result;
+    /* Another thread took the events first: wait out the rest of the
+       timeout, as epoll_wait would have. */
+    if (timeout > 0) {
+      uint64_t now = now_ms();
+      if (now >= deadline)
+        return 0;
+      timeout = deadline - now;
+    }
+  }
+}
+
+/* select, for a thread whose eventfd does not fit in an fd_set: the sets are
+   translated to and from a poll. */
+static int select_by_poll(int nfds, fd_set *readfds, fd_set *writefds,
+                          fd_set *exceptfds, struct timeval *timeout)
+{
+  struct pollfd *p = malloc(sizeof(struct pollfd) * (nfds > 0 ? nfds : 1));
+  int fd, n = 0, result;
+
+  for (fd = 0; fd < nfds; fd++) {
+    short events = 0;
+    if (readfds && FD_ISSET(fd, readfds))
+      events |= POLLIN;
+    if (writefds && FD_ISSET(fd, writefds))
+      events |= POLLOUT;
+    if (exceptfds && FD_ISSET(fd, exceptfds))
+      events |= POLLPRI;
+    if (events) {
+      p[n].fd = fd;
+      p[n].events = events;
+      n++;
+    }
+  }
+  result = ktthreads_poll(p, n, timeout ? timeout->tv_sec * 1000 +
+                          (timeout->tv_usec + 999) / 1000 : -1);
+  if (readfds)
+    FD_ZERO(readfds);
+  if (writefds)
+    FD_ZERO(writefds);
+  if (exceptfds)
+    FD_ZERO(exceptfds);
+  if (result > 0) {
+    int i;
+    result = 0;
+    for (i = 0; i < n; i++) {
+      short r = p[i].revents;
+      if (r & POLLNVAL) {
+        free(p);
+        errno = EBADF;
+        return -1;
+      }
+      if ((p[i].events & POLLIN) && (r & (POLLIN | POLLHUP | POLLERR))) {
+        FD_SET(p[i].fd, readfds);
+        result++;
+      }
+      if ((p[i].events & POLLOUT) && (r & (POLLOUT | POLLERR))) {
+        FD_SET(p[i].fd, writefds);
+        result++;
+      }
+      if ((p[i].events & POLLPRI) && (r & POLLPRI)) {
+        FD_SET(p[i].fd, exceptfds);
+        result++;
+      }
+    }
+  }
+  free(p);
+  return result;
+}
+
+int ktthreads_select(int nfds, fd_set *readfds, fd_set *writefds,
+                     fd_set *exceptfds, struct timeval *timeout)
+{
+  fd_set local;
+  int wake_fd, result;
+
+  if (set_io_waiting(1)) {
+    set_io_waiting(0);
+    if (readfds)
+      FD_ZERO(readfds);
+    if (writefds)
+      FD_ZERO(writefds);
+    if (exceptfds)
+      FD_ZERO(exceptfds);
+    return 0;
+  }
+  wake_fd = *cur_wake_fd();
+  if (wake_fd >= FD_SETSIZE) {
+    set_io_waiting(0);
+    return select_by_poll(nfds, readfds, writefds, exceptfds, timeout);
+  }
+  if (!readfds) {
+    FD_ZERO(&local);
+    readfds = &local;
+  }
+  FD_SET(wake_fd, readfds);
+  result = select(nfds > wake_fd ? nfds : wake_fd + 1, readfds, writefds,
+                  exceptfds, timeout);
+  set_io_waiting(0);
+
+  if (result > 0 && FD_ISSET(wake_fd, readfds)) {
+    drain_wake_fd();
+    result--;
+  }
+  FD_CLR(wake_fd, readfds);
+  return result;
+}
+
+/* Block until fd is readable or the thread is kicked.  Returns false (with
+   errno set to EINTR) when the wait was ended by an update request, or
+   (with poll's errno) when the wait failed. */
+static int wait_readable(int fd)
+{
+  struct pollfd p;
+  int flags = fcntl(fd, F_GETFL);
+
+  /* Non-blocking descriptors never sleep in the kernel. */
+  if (flags >= 0 && (flags & O_NONBLOCK))
+    return 1;
+
+  p.fd = fd;
+  p.events = POLLIN;
+  p.revents = 0;
+  for (;;) {
+    int result = ktthreads_poll(&p, 1, -1);
+    if (result > 0)
+      return 1;
+    /* another signal (its handler may well restart the read) */
+    if (result < 0 && errno != EINTR)
+      return 0;
+    if (kitsune_update_requested()) {
+      errno = EINTR;
+      return 0;
+    }
+  }
+}
+
+int ktthreads_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+  if (!wait_readable(sockfd))
+    return -1;
+  return accept(sockfd, addr, addrlen);
+}
+
+ssize_t ktthreads_read(int fd, void *buf, size_t count)
+{
+  if (!wait_readable(fd))
+    return -1;
+  return read(fd, buf, count);
+}
@@ -6,6 +6,10 @@
 #endif
 
 #include <pthread.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
 #include <kitsune.h>
 
 int kitsune_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
@@ -26,6 +30,21 @@ void kitsune_thread_add(void *arg, kt_pthread_fn *start_fun, const char *update_
 int ktthreads_pthread_cond_timedwait(void *cond_a, void *mutex_a, const void *timeout_a);
 int ktthreads_pthread_cond_wait(void *cond_a, void *mutex_a);
 void ktthreads_ms_sleep(int timeInMs); 
+
+/* Drop-in replacements for blocking calls that return early (no events for
+   the multiplexers, -1/EINTR for accept and read) when an update is
+   requested, so that the caller can reach its next update point. */
+int ktthreads_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int ktthreads_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int ktthreads_select(int nfds, fd_set *readfds, fd_set *writefds,
+                     fd_set *exceptfds, struct timeval *timeout);
+int ktthreads_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+ssize_t ktthreads_read(int fd, void *buf, size_t count);
 void ktthreads_update_callback(void (*callback)(void*), void *cb_args);
 
+/* Give up on an update (and resume every thread) if the threads have not all
+   reached an update point this many milliseconds after the first one did;
+   0, the default, waits indefinitely. */
+void ktthreads_set_quiesce_timeout(int timeout_ms);
+
 #endif /* KT_THREADS */
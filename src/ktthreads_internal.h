@@ -8,7 +8,8 @@ void ktthread_main_wait(void);
 void ktthread_do_update(const char *pt_name);
 void ktthread_launch_wait(void);
 void ktthread_finish_update(void);
-void ktthread_main_finish_update(void);
+void ktthread_main_finish_update(int next_hop);
+void ktthread_rollback(void);
 
 int  ktthread_has_reached_update(const char *pt_name);
 
@@ -17,6 +18,9 @@ void **ktthread_get_top_old(void);
 
 void ktthread_lock(void);
 void ktthread_unlock(void);
-void ktthread_rapidq(void);
+int  ktthread_quiesce(const char *pt_name);
+void ktthread_note_update_pt(const char *pt_name);
+int  ktthread_absorb_kick(void);
+void ktthread_notify_coordinator(void);
 
 #endif /* EK_THREADS_INTERNAL */
@@ -1,7 +1,14 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <wchar.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -11,7 +18,6 @@
 #include <libgen.h>
 
 #include "kitsune_internal.h"
-#include "ktthreads_internal.h"
 #include "log_internal.h"
 
 /**
@@ -34,6 +40,25 @@ FILE * kitsune_log_file = NULL;
  */ 
 static char * kitsune_log_path = "/tmp/kitsune";
 
+/**
+ * The runtime level of each category (see log_internal.h): messages less
+ * severe than it are not logged.  Set from KITSUNE_LOG_LEVEL at startup, or
+ * by kitsune_set_log_level, and carried across updates.
+ */
+int kitsune_log_levels[KT_LOG_CATEGORIES] = {
+  KT_LOG_INFO, KT_LOG_INFO, KT_LOG_INFO, KT_LOG_INFO
+};
+
+static const char *category_names[KT_LOG_CATEGORIES] = {
+  "update", "transform", "threads", "alloc"
+};
+static const char *level_names[] = {
+  "error", "warn", "info", "debug", "trace"
+};
+#define NLEVELS (sizeof(level_names) / sizeof(level_names[0]))
+
+static void log_async_init(void);
+
 /**
  * Open the log file, or if we're updating, copy the file handle from the
  * old-version address space.
@@ -45,6 +70,9 @@ int kitsune_logging_init(const char *appname_raw) {
   if (kitsune_is_updating()) {
     kitsune_app_name = *(char **)kitsune_get_val("kitsune_app_name");
     kitsune_log_file = *(FILE **)kitsune_get_val("kitsune_log_file");
+    memcpy(kitsune_log_levels, kitsune_get_val("kitsune_log_levels"),
+           sizeof(kitsune_log_levels));
+    log_async_init();
     kitsune_log("Updating logging: kitsune_log_file %p and kitsune_app_name %p\n",
                kitsune_log_file, kitsune_app_name);
     return 1;
@@ -85,32 +113,632 @@ int kitsune_logging_init(const char *appname_raw) {
      afterwards. */
   free(kitsune_log_fname);
   free(local_appname);
+  log_async_init();
   kitsune_log("Opening new kitsune log.");
+  if (getenv("KITSUNE_LOG_LEVEL") &&
+      !kitsune_set_log_level(getenv("KITSUNE_LOG_LEVEL")))
+    kitsune_log("KITSUNE_LOG_LEVEL: bad level \"%s\"; ignored.",
+                getenv("KITSUNE_LOG_LEVEL"));
   return 1;
 }
 
-/** 
- * Write a message fmt to the log file.
+static int level_named(const char *name, size_t len)
+{
+  size_t i;
+  for (i = 0; i < NLEVELS; i++)
+    if (strlen(level_names[i]) == len && strncmp(name, level_names[i], len) == 0)
+      return i;
+  return -1;
+}
+
+/**
+ * Set the runtime log levels from spec: a comma-separated list of levels
+ * (error, warn, info, debug or trace), each either for every category or,
+ * as CATEGORY=LEVEL, for one of update, transform, threads and alloc; later
+ * entries win.  A level below the build's KT_LOG_MIN_LEVEL only lets through
+ * what was compiled in.  Returns 0, changing nothing, if spec is malformed.
  */
-void kitsune_log(const char *fmt, ...) {
-  va_list args;
+int kitsune_set_log_level(const char *spec)
+{
+  int levels[KT_LOG_CATEGORIES];
+  const char *p = spec, *end, *eq;
+  int level, cat;
+
+  memcpy(levels, kitsune_log_levels, sizeof(levels));
+  while (*p) {
+    end = p + strcspn(p, ",");
+    eq = memchr(p, '=', end - p);
+    level = eq ? level_named(eq + 1, end - eq - 1) : level_named(p, end - p);
+    if (level < 0)
+      return 0;
+    if (!eq) {
+      for (cat = 0; cat < KT_LOG_CATEGORIES; cat++)
+        levels[cat] = level;
+    } else {
+      for (cat = 0; cat < KT_LOG_CATEGORIES; cat++)
+        if (strlen(category_names[cat]) == (size_t)(eq - p) &&
+            strncmp(p, category_names[cat], eq - p) == 0)
+          break;
+      if (cat == KT_LOG_CATEGORIES)
+        return 0;
+      levels[cat] = level;
+    }
+    p = *end ? end + 1 : end;
+  }
+  for (cat = 0; cat < KT_LOG_CATEGORIES; cat++)
+    __atomic_store_n(&kitsune_log_levels[cat], levels[cat], __ATOMIC_RELAXED);
+  kitsune_log("Log levels set to \"%s\".", spec);
+  return 1;
+}
+
+/**
+ * The runtime level of each category and the level compiled in, one
+ * "CATEGORY LEVEL" line each (the last for "compiled"), in a string the
+ * caller frees.
+ */
+char *kitsune_get_log_levels(void)
+{
+  char *text = malloc(KT_LOG_CATEGORIES * 32 + 32), *p = text;
+  int cat;
+  if (!text)
+    return NULL;
+  for (cat = 0; cat < KT_LOG_CATEGORIES; cat++)
+    p += sprintf(p, "%s %s\n", category_names[cat],
+                 level_names[kitsune_log_levels[cat]]);
+  sprintf(p, "compiled %s\n", level_names[KT_LOG_MIN_LEVEL]);
+  return text;
+}
+
+/*
+ * Messages are not formatted when they are logged.  Each thread appends its
+ * format string and raw arguments (with copies of any strings) to a ring of
+ * its own, without taking a lock, and a background thread formats and writes
+ * whatever the rings hold every LOG_FLUSH_MS.  A thread whose ring is full
+ * drains it itself.  The records point into the code of the version that
+ * logged them, so a version drains its rings before its library is unloaded
+ * (see log_atexit), and before forking, so that a child does not write its
+ * parent's messages again.
+ */
+
+#define LOG_RING_BYTES (64 * 1024)
+#define LOG_MAX_STRING 512
+#define LOG_FLUSH_MS 20
+
+typedef struct log_ring {
+  struct log_ring *next;        /* all rings, for the flusher */
+  int owned;                    /* by a live thread */
+  size_t head;                  /* bytes ever written: the thread's */
+  size_t tail;                  /* bytes ever read: the flusher's */
+  uint64_t buf[LOG_RING_BYTES / sizeof(uint64_t)];
+} log_ring;
+
+/* A record: header, then a word per argument (a string is its length and
+   then its bytes), in the order the format uses them. */
+typedef struct {
+  uint16_t words;               /* the whole record; 0 pads to the ring's end */
+  uint8_t category;             /* KT_LOG_CATEGORIES if none */
+  uint8_t level;
+  int32_t saved_errno;          /* for %m */
+  const char *fmt;
+} log_record;
+
+#define HEADER_WORDS (sizeof(log_record) / sizeof(uint64_t))
+#define RING_WORDS (LOG_RING_BYTES / sizeof(uint64_t))
+
+static log_ring *log_rings = NULL;
+static __thread log_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static int ring_key_made = 0;
+
+/* Taken by whoever drains: the flusher, a thread whose ring is full, and
+   log_drain. */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t flusher;
+static int flusher_running = 0;
+static int flusher_stop = 0;
+
+static void ring_release(void *ring)
+{
+  __atomic_store_n(&((log_ring *)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void ring_key_create(void)
+{
+  ring_key_made = !pthread_key_create(&ring_key, ring_release);
+}
+
+/* This thread's ring: one left by a thread that has exited, or a new one. */
+static log_ring *ring_get(void)
+{
+  log_ring *r = my_ring;
+  if (r)
+    return r;
+  for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    int idle = 0;
+    if (__atomic_compare_exchange_n(&r->owned, &idle, 1, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_RELAXED))
+      break;
+  }
+  if (!r) {
+    r = calloc(1, sizeof(log_ring));
+    if (!r)
+      return NULL;
+    r->owned = 1;
+    r->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&log_rings, &r->next, r, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  pthread_once(&ring_key_once, ring_key_create);
+  pthread_setspecific(ring_key, r);
+  my_ring = r;
+  return r;
+}
+
+/* One conversion of a format string: fmt[0] is '%', and the conversion is
+   spec_len bytes long. */
+typedef struct {
+  size_t len;
+  int stars;                    /* '*' widths and precisions, each an int */
+  int precision;                /* -1 if none, PRECISION_STAR if '*' */
+  char length;                  /* 'H' hh, 'h', 'l', 'q' ll, 'L', 'j', 'z', 't' */
+  char conv;
+} log_spec;
+
+#define PRECISION_STAR -2
+
+static const char *spec_parse(const char *fmt, log_spec *spec)
+{
+  const char *p = fmt + 1;
+  spec->stars = 0;
+  spec->precision = -1;
+  spec->length = 0;
+  while (*p && strchr("-+ #0'", *p))
+    p++;
+  for (; *p == '*' || (*p >= '0' && *p <= '9'); p++)
+    spec->stars += *p == '*';
+  if (*p == '.') {
+    p++;
+    if (*p == '*') {
+      spec->stars++;
+      spec->precision = PRECISION_STAR;
+      p++;
+    } else {
+      for (spec->precision = 0; *p >= '0' && *p <= '9'; p++)
+        spec->precision = spec->precision * 10 + (*p - '0');
+    }
+  }
+  if (*p == 'h' || *p == 'l') {
+    spec->length = *p++;
+    if (*p == spec->length) {
+      spec->length = spec->length == 'h' ? 'H' : 'q';
+      p++;
+    }
+  } else if (*p && strchr("Lqjzt", *p)) {
+    spec->length = *p++;
+  }
+  spec->conv = *p;
+  spec->len = (*p ? p + 1 : p) - fmt;
+  return fmt + spec->len;
+}
+
+static int is_int_conv(char c) { return c && strchr("diouxXc", c); }
+static int is_float_conv(char c) { return c && strchr("eEfFgGaA", c); }
+
+/* Wide characters and strings are not logged: record_write stops at them. */
+static int is_wide(const log_spec *spec)
+{
+  return spec->conv == 'S' || spec->conv == 'C' ||
+    (spec->length == 'l' && (spec->conv == 's' || spec->conv == 'c'));
+}
+
+#define SKIP_WIDE(spec, args)                                 \
+  ((spec).conv == 's' || (spec).conv == 'S' ?                 \
+   (void)va_arg(args, wchar_t *) : (void)va_arg(args, wint_t))
+
+/* The bytes of str to copy: no more than its precision (star, if it is
+   '*') asks for, which need not be NUL-terminated, nor LOG_MAX_STRING. */
+static size_t string_len(const char *str, const log_spec *spec, int star)
+{
+  size_t max = LOG_MAX_STRING;
+  int precision = spec->precision == PRECISION_STAR ? star : spec->precision;
+  if (precision >= 0 && (size_t)precision < max)
+    max = precision;
+  return str ? strnlen(str, max) : 6;
+}
+
+/* Append a word at word index i of the record being built (which may wrap
+   nowhere: the caller made room). */
+#define PUT(r, i, v) ((r)->buf[((r)->head / sizeof(uint64_t) + (i)) % RING_WORDS] = (v))
+#define GET(r, i) ((r)->buf[((r)->tail / sizeof(uint64_t) + (i)) % RING_WORDS])
+
+/* The words fmt's arguments will take, strings included. */
+static size_t record_words(const char *fmt, va_list args)
+{
+  size_t words = HEADER_WORDS;
+  log_spec spec;
+  int i, star = 0;
+  while ((fmt = strchr(fmt, '%'))) {
+    fmt = spec_parse(fmt, &spec);
+    for (i = 0; i < spec.stars; i++, words++)
+      star = va_arg(args, int);
+    if (is_wide(&spec)) {
+      words++;
+      SKIP_WIDE(spec, args);
+    } else if (spec.conv == 's') {
+      const char *str = va_arg(args, const char *);
+      size_t len = string_len(str, &spec, star);
+      words += 1 + (len + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    } else if (is_int_conv(spec.conv)) {
+      words++;
+      if (spec.length == 'l' || spec.length == 'q' || spec.length == 'j' ||
+          spec.length == 'z' || spec.length == 't')
+        (void)va_arg(args, long long);
+      else
+        (void)va_arg(args, int);
+    } else if (is_float_conv(spec.conv)) {
+      words++;
+      if (spec.length == 'L')
+        (void)va_arg(args, long double);
+      else
+        (void)va_arg(args, double);
+    } else if (spec.conv == 'p' || spec.conv == 'n') {
+      words++;
+      (void)va_arg(args, void *);
+    }
+  }
+  return words;
+}
+
+static void record_put(log_ring *r, int category, int level, int saved_errno,
+                       const char *fmt, va_list args, size_t words)
+{
+  log_record h = { words, category, level, saved_errno, fmt };
+  size_t i = HEADER_WORDS, k;
+  log_spec spec;
+  int star = 0;
+  uint64_t w;
+  double d;
+
+  memcpy(&r->buf[r->head / sizeof(uint64_t) % RING_WORDS], &h, sizeof(h));
+  while ((fmt = strchr(fmt, '%'))) {
+    fmt = spec_parse(fmt, &spec);
+    for (k = 0; k < (size_t)spec.stars; k++) {
+      star = va_arg(args, int);
+      PUT(r, i++, (uint64_t)(int64_t)star);
+    }
+    if (is_wide(&spec)) {
+      SKIP_WIDE(spec, args);
+      PUT(r, i++, 0);
+    } else if (spec.conv == 's') {
+      const char *str = va_arg(args, const char *);
+      size_t len = string_len(str, &spec, star);
+      if (!str)
+        str = "(null)";
+      PUT(r, i++, len);
+      for (k = 0; k < len; k += sizeof(uint64_t)) {
+        w = 0;
+        memcpy(&w, str + k, len - k < sizeof(uint64_t) ? len - k : sizeof(uint64_t));
+        PUT(r, i++, w);
+      }
+    } else if (is_int_conv(spec.conv)) {
+      if (spec.length == 'l' || spec.length == 'q' || spec.length == 'j' ||
+          spec.length == 'z' || spec.length == 't')
+        PUT(r, i++, (uint64_t)va_arg(args, long long));
+      else
+        PUT(r, i++, (uint64_t)(int64_t)va_arg(args, int));
+    } else if (is_float_conv(spec.conv)) {
+      d = spec.length == 'L' ? (double)va_arg(args, long double) : va_arg(args, double);
+      memcpy(&w, &d, sizeof(w));
+      PUT(r, i++, w);
+    } else if (spec.conv == 'p' || spec.conv == 'n') {
+      PUT(r, i++, (uint64_t)(uintptr_t)va_arg(args, void *));
+    }
+  }
+}
+
+static void log_prefix(int category, int level)
+{
+  fprintf(kitsune_log_file, "Kitsune %s:%d: ", kitsune_app_name, getpid());
+  if (category < KT_LOG_CATEGORIES)
+    fprintf(kitsune_log_file, "[%s %s] ", category_names[category],
+            level_names[level]);
+}
+
+/* Format and write the record at r's tail; called with the file locked. */
+static void record_write(log_ring *r, const log_record *h)
+{
+  const char *fmt = h->fmt, *next;
+  size_t i = HEADER_WORDS, k;
+  char spec_buf[32];
+  int stars[2];
+  log_spec spec;
+  uint64_t w;
+  double d;
+
+  log_prefix(h->category, h->level);
+  while ((next = strchr(fmt, '%'))) {
+    fwrite(fmt, 1, next - fmt, kitsune_log_file);
+    fmt = spec_parse(next, &spec);
+    for (k = 0; k < (size_t)spec.stars; k++) {
+      w = GET(r, i++);
+      if (k < 2)
+        stars[k] = (int)(int64_t)w;
+    }
+    if (spec.len >= sizeof(spec_buf) || spec.stars > 2 || is_wide(&spec)) {
+      fputs("<bad format>\n", kitsune_log_file);
+      return;
+    }
+    memcpy(spec_buf, next, spec.len);
+    spec_buf[spec.len] = '\0';
+    if (spec.length == 'L') {
+      /* logged as a double */
+      char *l = strchr(spec_buf, 'L');
+      memmove(l, l + 1, strlen(l));
+    }
+
+#define EMIT(value)                                                      \
+    (spec.stars == 0 ? fprintf(kitsune_log_file, spec_buf, value) :      \
+     spec.stars == 1 ? fprintf(kitsune_log_file, spec_buf, stars[0], value) : \
+     fprintf(kitsune_log_file, spec_buf, stars[0], stars[1], value))
+
+    switch (spec.conv) {
+    case '%':
+      fputc('%', kitsune_log_file);
+      break;
+    case 'm':
+      fputs(strerror(h->saved_errno), kitsune_log_file);
+      break;
+    case 's': {
+      char str[LOG_MAX_STRING + 1];
+      size_t len = GET(r, i++);
+      if (len > LOG_MAX_STRING)
+        len = LOG_MAX_STRING;
+      for (k = 0; k < len; k += sizeof(uint64_t)) {
+        w = GET(r, i++);
+        memcpy(str + k, &w, len - k < sizeof(uint64_t) ? len - k : sizeof(uint64_t));
+      }
+      str[len] = '\0';
+      EMIT(str);
+      break;
+    }
+    case 'p':
+      EMIT((void *)(uintptr_t)GET(r, i++));
+      break;
+    case 'n':
+      i++;
+      break;
+    default:
+      if (is_int_conv(spec.conv)) {
+        w = GET(r, i++);
+        switch (spec.length) {
+        case 'l': EMIT((long)w); break;
+        case 'q': EMIT((long long)w); break;
+        case 'j': EMIT((intmax_t)w); break;
+        case 'z': EMIT((size_t)w); break;
+        case 't': EMIT((ptrdiff_t)w); break;
+        default: EMIT((int)w); break;
+        }
+      } else if (is_float_conv(spec.conv)) {
+        w = GET(r, i++);
+        memcpy(&d, &w, sizeof(d));
+        EMIT(d);
+      } else {
+        fputs(spec_buf, kitsune_log_file);
+      }
+    }
+#undef EMIT
+  }
+  fputs(fmt, kitsune_log_file);
+  fputc('\n', kitsune_log_file);
+}
+
+/* Write out everything in r; called with drain_lock held.  Returns whether
+   there was anything. */
+static int ring_drain(log_ring *r)
+{
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  if (r->tail == head)
+    return 0;
+  flockfile(kitsune_log_file);
+  while (r->tail != head) {
+    uint64_t *at = &r->buf[r->tail / sizeof(uint64_t) % RING_WORDS];
+    log_record h;
+    size_t words;
+    memcpy(&h.words, at, sizeof(h.words));
+    if (h.words) {
+      memcpy(&h, at, sizeof(h));
+      record_write(r, &h);
+      words = h.words;
+    } else {
+      /* padding, perhaps a single word, to the end of the ring */
+      words = RING_WORDS - r->tail / sizeof(uint64_t) % RING_WORDS;
+    }
+    __atomic_store_n(&r->tail, r->tail + words * sizeof(uint64_t), __ATOMIC_RELEASE);
+  }
+  fflush(kitsune_log_file);
+  funlockfile(kitsune_log_file);
+  return 1;
+}
+
+static int drain_all(void)
+{
+  log_ring *r;
+  int any = 0;
+  for (r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next)
+    any |= ring_drain(r);
+  return any;
+}
+
+static void *flusher_main(void *unused)
+{
+  struct timespec until;
+  pthread_mutex_lock(&drain_lock);
+  for (;;) {
+    int stop = flusher_stop, any = drain_all();
+    if (stop)
+      break;
+    if (!any) {
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += LOG_FLUSH_MS * 1000000L;
+      if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      /* woken early only to stop */
+      pthread_cond_timedwait(&flusher_wake, &drain_lock, &until);
+    }
+  }
+  pthread_mutex_unlock(&drain_lock);
+  return NULL;
+}
+
+static void flusher_start(void)
+{
+  sigset_t all, old;
+  flusher_stop = 0;
+  /* signals are the program's business, not the flusher's */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  flusher_running = !pthread_create(&flusher, NULL, flusher_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * Write out every message logged so far, before returning.  Called before
+ * aborting.
+ */
+void kitsune_log_drain(void)
+{
+  if (kitsune_log_file == NULL)
+    return;
+  pthread_mutex_lock(&drain_lock);
+  drain_all();
+  pthread_mutex_unlock(&drain_lock);
+}
+
+/* Run at exit, and when this version's library is unloaded (atexit handlers
+   in a shared object run at dlclose): stop the flusher, whose code is about
+   to go, and write out what it has not. */
+static void log_atexit(void)
+{
+  if (flusher_running) {
+    pthread_mutex_lock(&drain_lock);
+    flusher_stop = 1;
+    pthread_cond_signal(&flusher_wake);
+    pthread_mutex_unlock(&drain_lock);
+    pthread_join(flusher, NULL);
+    flusher_running = 0;
+  }
+  kitsune_log_drain();
+  /* threads exiting later must not call into the unloaded ring_release */
+  if (ring_key_made)
+    pthread_key_delete(ring_key);
+}
+
+static void log_prefork(void)
+{
+  pthread_mutex_lock(&drain_lock);
+  if (kitsune_log_file)
+    drain_all();
+}
+
+static void log_postfork_parent(void)
+{
+  pthread_mutex_unlock(&drain_lock);
+}
+
+static void log_postfork_child(void)
+{
+  pthread_mutex_unlock(&drain_lock);
+  /* the flusher did not come along */
+  if (flusher_running)
+    flusher_start();
+}
+
+/* Start writing the rings out in the background (once per version). */
+static void log_async_init(void)
+{
+  static int started = 0;
+  if (started)
+    return;
+  started = 1;
+  atexit(log_atexit);
+  pthread_atfork(log_prefork, log_postfork_parent, log_postfork_child);
+  flusher_start();
+}
+
+/* Queue a message on this thread's ring. */
+static void log_va(int category, int level, const char *fmt, va_list args)
+{
+  int saved_errno = errno;
+  va_list count;
   if (kitsune_app_name == NULL || kitsune_log_file == NULL) {
     /* We probably got here from a test. Ignore logging. */
     return;
   }
-#ifdef ENABLE_THREADING
-  ktthread_lock();
-#endif
-  fprintf(kitsune_log_file, "Kitsune %s:%d: ", kitsune_app_name, getpid());
-  
+  log_ring *r = ring_get();
+  if (!r)
+    return;
+
+  va_copy(count, args);
+  size_t words = record_words(fmt, count);
+  va_end(count);
+  if (words > RING_WORDS / 2) {
+    /* too large to queue: write it now */
+    pthread_mutex_lock(&drain_lock);
+    ring_drain(r);
+    flockfile(kitsune_log_file);
+    log_prefix(category, level);
+    vfprintf(kitsune_log_file, fmt, args);
+    fputc('\n', kitsune_log_file);
+    fflush(kitsune_log_file);
+    funlockfile(kitsune_log_file);
+    pthread_mutex_unlock(&drain_lock);
+    return;
+  }
+
+  size_t at = r->head / sizeof(uint64_t) % RING_WORDS;
+  size_t pad = at + words > RING_WORDS ? RING_WORDS - at : 0;
+  if (r->head + (pad + words) * sizeof(uint64_t) -
+      __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > LOG_RING_BYTES) {
+    /* full: make room ourselves rather than wait for the flusher */
+    pthread_mutex_lock(&drain_lock);
+    ring_drain(r);
+    pthread_mutex_unlock(&drain_lock);
+  }
+  if (pad) {
+    uint16_t padding = 0;
+    memcpy(&r->buf[at], &padding, sizeof(padding));
+    __atomic_store_n(&r->head, r->head + pad * sizeof(uint64_t), __ATOMIC_RELEASE);
+  }
+  record_put(r, category, level, saved_errno, fmt, args, words);
+  __atomic_store_n(&r->head, r->head + words * sizeof(uint64_t), __ATOMIC_RELEASE);
+}
+
+/**
+ * Log a message: fmt as printf takes it, with the arguments it names.  It
+ * is formatted later, by a background thread.
+ */
+void kitsune_log(const char *fmt, ...) {
+  va_list args;
   va_start(args, fmt);
-  vfprintf(kitsune_log_file, fmt, args);
+  log_va(KT_LOG_CATEGORIES, KT_LOG_INFO, fmt, args);
+  va_end(args);
+}
+
+/**
+ * Log a message in category at level, tagged with both; called through the
+ * kitsune_log_LEVEL macros, which have checked the level already.
+ */
+void kitsune_log_at(kitsune_log_category category, int level,
+                    const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  log_va(category, level, fmt, args);
   va_end(args);
-  fprintf(kitsune_log_file, "\n");
-  fflush(kitsune_log_file);
-#ifdef ENABLE_THREADING
-  ktthread_unlock();
-#endif
 }
 
 /** @} */
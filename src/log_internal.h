@@ -1,7 +1,86 @@
-
 #ifndef   	LOG_INTERNAL_H
 #define   	LOG_INTERNAL_H
 
 int kitsune_logging_init(const char *);
+void kitsune_log_drain(void);
+
+/*
+ * Levels, most to least severe.  Calls below KT_LOG_MIN_LEVEL are compiled
+ * out, arguments and all ("make LOG_LEVEL=TRACE" keeps the per-object traces
+ * of the transform and migration code, which ordinary builds leave out); the
+ * rest are written if at or above their category's runtime level (see
+ * kitsune_set_log_level).
+ */
+#define KT_LOG_ERROR 0
+#define KT_LOG_WARN  1
+#define KT_LOG_INFO  2
+#define KT_LOG_DEBUG 3
+#define KT_LOG_TRACE 4
+
+#ifndef KT_LOG_MIN_LEVEL
+#define KT_LOG_MIN_LEVEL KT_LOG_DEBUG
+#endif
+
+typedef enum {
+  KT_LOG_UPDATE,                /* update points, versions, migration */
+  KT_LOG_TRANSFORM,             /* state transformation and precopy */
+  KT_LOG_THREADS,               /* quiescence and relaunch */
+  KT_LOG_ALLOC,                 /* allocation tracking */
+  KT_LOG_CATEGORIES
+} kitsune_log_category;
+
+/* The runtime level of each category, carried across updates. */
+extern int kitsune_log_levels[KT_LOG_CATEGORIES];
+
+/* fmt is kept until the message is written, as for kitsune_log. */
+void kitsune_log_at(kitsune_log_category category, int level,
+                    const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+
+#define KT_LOG_AT(category, level, ...) do {                            \
+    if (__builtin_expect((level) <= kitsune_log_levels[category], 0))   \
+      kitsune_log_at(category, level, __VA_ARGS__);                     \
+  } while (0)
+
+/* Compiled out: the call is still checked, but nothing is evaluated. */
+#define KT_LOG_NEVER(category, level, ...) do {                         \
+    if (0)                                                              \
+      kitsune_log_at(category, level, __VA_ARGS__);                     \
+  } while (0)
+
+#define kitsune_log_error(category, ...) \
+  KT_LOG_AT(category, KT_LOG_ERROR, __VA_ARGS__)
+
+#if KT_LOG_MIN_LEVEL >= KT_LOG_WARN
+#define kitsune_log_warn(category, ...) \
+  KT_LOG_AT(category, KT_LOG_WARN, __VA_ARGS__)
+#else
+#define kitsune_log_warn(category, ...) \
+  KT_LOG_NEVER(category, KT_LOG_WARN, __VA_ARGS__)
+#endif
+
+#if KT_LOG_MIN_LEVEL >= KT_LOG_INFO
+#define kitsune_log_info(category, ...) \
+  KT_LOG_AT(category, KT_LOG_INFO, __VA_ARGS__)
+#else
+#define kitsune_log_info(category, ...) \
+  KT_LOG_NEVER(category, KT_LOG_INFO, __VA_ARGS__)
+#endif
+
+#if KT_LOG_MIN_LEVEL >= KT_LOG_DEBUG
+#define kitsune_log_debug(category, ...) \
+  KT_LOG_AT(category, KT_LOG_DEBUG, __VA_ARGS__)
+#else
+#define kitsune_log_debug(category, ...) \
+  KT_LOG_NEVER(category, KT_LOG_DEBUG, __VA_ARGS__)
+#endif
+
+#if KT_LOG_MIN_LEVEL >= KT_LOG_TRACE
+#define kitsune_log_trace(category, ...) \
+  KT_LOG_AT(category, KT_LOG_TRACE, __VA_ARGS__)
+#else
+#define kitsune_log_trace(category, ...) \
+  KT_LOG_NEVER(category, KT_LOG_TRACE, __VA_ARGS__)
+#endif
 
-#endif 	    
+#endif
@@ -0,0 +1,158 @@
+/*
+ * A radix table holding a byte for each page of the address space, so that
+ * classifying an address during transformation takes three loads instead of
+ * a search.  The byte holds the page's vmarea_type, cached from vmareas the
+ * first time the page is asked about in an update, and whether kitsune_malloc
+ * has ever handed out memory on the page (in which case alloctrack is worth
+ * asking about it).
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "kitsune_internal.h"
+#include "vmareas_internal.h"
+#include "pageclass_internal.h"
+#include "radix_internal.h"
+
+#define PC_PAGE_SHIFT 12
+#define PC_LEVEL_BITS 12        /* three levels of page number: 48-bit addresses */
+#define PC_LEVEL_SIZE (1 << PC_LEVEL_BITS)
+#define PC_MAX_PAGE (1ull << (3 * PC_LEVEL_BITS))
+
+/* A page's byte: its type is only current if its generation is the table's,
+   so that forgetting every type at an update is a single increment. */
+enum {
+  PC_TYPE_MASK = 0x07,
+  PC_GEN_SHIFT = 3,
+  PC_GEN_MASK = 0x78,
+  PC_TRACKED = 0x80,
+};
+#define PC_GENERATIONS (PC_GEN_MASK >> PC_GEN_SHIFT)
+
+typedef struct { unsigned char pages[PC_LEVEL_SIZE]; } pc_leaf;
+typedef struct { pc_leaf *leaves[PC_LEVEL_SIZE]; } pc_mid;
+typedef struct {
+  unsigned char gen;
+  pc_mid *mids[PC_LEVEL_SIZE];
+} pc_root;
+
+/* Passed from version to version (see pageclass_init). */
+pc_root *page_classes = NULL;
+
+static pc_root *root(void)
+{
+  return radix_alloc_level((void **)&page_classes, sizeof(pc_root));
+}
+
+/* The leaf holding page's byte, or NULL if it does not exist and create is
+   false. */
+static pc_leaf *leaf_for(uintptr_t page, int create)
+{
+  pc_root *r = create ? root() : __atomic_load_n(&page_classes, __ATOMIC_ACQUIRE);
+  if (!r || page >= PC_MAX_PAGE)
+    return NULL;
+  void **mid_slot = (void **)&r->mids[page >> (2 * PC_LEVEL_BITS)];
+  pc_mid *mid = create ? radix_alloc_level(mid_slot, sizeof(pc_mid)) :
+    __atomic_load_n(mid_slot, __ATOMIC_ACQUIRE);
+  if (!mid)
+    return NULL;
+  void **leaf_slot = (void **)&mid->leaves[(page >> PC_LEVEL_BITS) & (PC_LEVEL_SIZE - 1)];
+  return create ? radix_alloc_level(leaf_slot, sizeof(pc_leaf)) :
+    __atomic_load_n(leaf_slot, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * The type of the memory at addr.  A page whose type is not cached yet is
+ * looked up in vmareas, and the type is cached for every page of its area
+ * that shares the page's leaf.  Unmapped pages are not cached, since they
+ * may be mapped later in the update.
+ */
+vmarea_type pageclass_type(void *addr)
+{
+  uintptr_t page = (uintptr_t)addr >> PC_PAGE_SHIFT;
+  pc_leaf *leaf = leaf_for(page, 1);
+  if (!leaf)
+    return vmareas_get_type(vmareas_lookup(addr));
+
+  unsigned char gen = page_classes->gen;
+  unsigned char *byte = &leaf->pages[page & (PC_LEVEL_SIZE - 1)];
+  unsigned char cur = __atomic_load_n(byte, __ATOMIC_RELAXED);
+  if (((cur & PC_GEN_MASK) >> PC_GEN_SHIFT) == gen)
+    return cur & PC_TYPE_MASK;
+
+  vmarea *area = vmareas_lookup(addr);
+  vmarea_type type = vmareas_get_type(area);
+  if (!area)
+    return type;
+
+  uintptr_t first = (uintptr_t)vmareas_get_start(area) >> PC_PAGE_SHIFT;
+  uintptr_t last = ((uintptr_t)vmareas_get_end(area) - 1) >> PC_PAGE_SHIFT;
+  uintptr_t leaf_first = page & ~(uintptr_t)(PC_LEVEL_SIZE - 1);
+  uintptr_t leaf_last = leaf_first + PC_LEVEL_SIZE - 1;
+  if (first < leaf_first)
+    first = leaf_first;
+  if (last > leaf_last)
+    last = leaf_last;
+  unsigned char bits = (gen << PC_GEN_SHIFT) | type;
+  for (; first <= last; first++) {
+    unsigned char *b = &leaf->pages[first - leaf_first];
+    unsigned char old = __atomic_load_n(b, __ATOMIC_RELAXED);
+    /* keep PC_TRACKED, which kitsune_malloc may be setting concurrently */
+    while (!__atomic_compare_exchange_n(b, &old, (old & PC_TRACKED) | bits, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+  return type;
+}
+
+/* False if no memory from kitsune_malloc was ever on addr's page.  The flag
+   is never cleared, so true only means alloctrack is worth asking. */
+int pageclass_tracked(void *addr)
+{
+  uintptr_t page = (uintptr_t)addr >> PC_PAGE_SHIFT;
+  pc_leaf *leaf = leaf_for(page, 0);
+  return leaf && (leaf->pages[page & (PC_LEVEL_SIZE - 1)] & PC_TRACKED);
+}
+
+void pageclass_mark_tracked(void *start, size_t size)
+{
+  uintptr_t page = (uintptr_t)start >> PC_PAGE_SHIFT;
+  uintptr_t last = ((uintptr_t)start + (size ? size - 1 : 0)) >> PC_PAGE_SHIFT;
+  for (; page <= last; page++) {
+    pc_leaf *leaf = leaf_for(page, 1);
+    if (leaf)
+      __atomic_or_fetch(&leaf->pages[page & (PC_LEVEL_SIZE - 1)], PC_TRACKED,
+                        __ATOMIC_RELAXED);
+  }
+}
+
+/* Called as each version starts, before anything is transformed: the table
+   is taken over from the previous version and the cached types, which were
+   for its address space, are forgotten. */
+void pageclass_init(void)
+{
+  if (kitsune_is_updating()) {
+    pc_root **prev = kitsune_get_val("page_classes");
+    if (prev)
+      page_classes = *prev;
+  }
+  pc_root *r = root();
+  if (++r->gen > PC_GENERATIONS) {
+    /* generations wrapped: clear the stale types for real */
+    int i, j;
+    for (i = 0; i < PC_LEVEL_SIZE; i++) {
+      if (!r->mids[i])
+        continue;
+      for (j = 0; j < PC_LEVEL_SIZE; j++) {
+        pc_leaf *leaf = r->mids[i]->leaves[j];
+        int k;
+        if (leaf)
+          for (k = 0; k < PC_LEVEL_SIZE; k++)
+            leaf->pages[k] &= PC_TRACKED;
+      }
+    }
+    r->gen = 1;
+  }
+}
@@ -0,0 +1,14 @@
+#ifndef PAGECLASS_INTERNAL_H
+#define PAGECLASS_INTERNAL_H
+
+#include <stddef.h>
+
+#include "vmareas_internal.h"
+
+void pageclass_init(void);
+
+vmarea_type pageclass_type(void *addr);
+int pageclass_tracked(void *addr);
+void pageclass_mark_tracked(void *start, size_t size);
+
+#endif
@@ -0,0 +1,384 @@
+/*
+ * Pre-copy state transfer
+ * =======================
+ *
+ * As in the pre-copy phase of a live VM migration, most of the state can be
+ * transformed before the update pause.  Once the next version is preloaded,
+ * the driver can have it run its automigration on a thread of its own while
+ * the current version keeps running (kitsune_precopy).  Each heap object that
+ * transform_ptr copies along the way is recorded here, along with the objects
+ * its transformer reached.  Writes to the originals are then tracked with the
+ * kernel's soft-dirty page bits (/proc/self/clear_refs, /proc/self/pagemap);
+ * where the kernel lacks them, each object is compared with a snapshot.
+ *
+ * At the update, precopy_validate drops every copy whose original was written
+ * since, and every copy that points (transitively) at a dropped one.  The rest
+ * stay in transform's pointer mappings, so the new version's migration reuses
+ * them and only transforms the dropped objects during the pause.
+ *
+ * Copies of objects from typed arenas are made in arenas of their own (see
+ * typedheap_precopy_malloc), so that they are still swept as typed objects
+ * once the next version runs.  Until it starts, that version's allocator is
+ * not set up, so the running version's allocates and frees them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "uthash.h"
+
+#include "kitsune_internal.h"
+#include "precopy_internal.h"
+#include "registervars_internal.h"
+#include "transform_internal.h"
+#include "alloctrack_internal.h"
+
+typedef struct precopy_entry {
+  void *old;
+  void *new;
+  size_t size;
+  int owned;                /* PRECOPY_HEAP or _TYPED for a copy of our own */
+  int invalid;
+  int claimed;              /* reached by the update's own migration */
+  void *snapshot;           /* old's contents, without soft-dirty bits */
+  struct precopy_entry **children;
+  int nchildren, children_cap;
+  struct precopy_entry **parents;
+  int nparents, parents_cap;
+  UT_hash_handle hh;
+} precopy_entry;
+
+static precopy_entry *entries = NULL;
+static void *precopied_from = NULL;
+static int soft_dirty = 0;
+static volatile int cancelled = 0;
+static void *(*typed_malloc)(void *obj, size_t size) = NULL;
+
+/* Only set on the thread running the pre-copy, which is also the only one
+   to use cur_parent: the entry whose transformer is running. */
+static __thread jmp_buf *precopy_env = NULL;
+static precopy_entry *cur_parent = NULL;
+
+#define PAGEMAP_SOFT_DIRTY (1ull << 55)
+
+static void push(precopy_entry ***list, int *count, int *cap, precopy_entry *e)
+{
+  if (*count == *cap) {
+    *cap = *cap ? *cap * 2 : 4;
+    *list = realloc(*list, sizeof(precopy_entry *) * *cap);
+  }
+  (*list)[(*count)++] = e;
+}
+
+static void link_entries(precopy_entry *parent, precopy_entry *child)
+{
+  if (!parent)
+    return;
+  push(&parent->children, &parent->nchildren, &parent->children_cap, child);
+  push(&child->parents, &child->nparents, &child->parents_cap, parent);
+}
+
+static int pages_dirty(int pagemap, void *addr, size_t size)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t first = (uintptr_t)addr / page;
+  uintptr_t last = ((uintptr_t)addr + (size ? size - 1 : 0)) / page;
+  uint64_t flags;
+
+  for (; first <= last; first++) {
+    if (pread(pagemap, &flags, sizeof(flags), first * sizeof(flags)) != sizeof(flags))
+      return 1;
+    if (flags & PAGEMAP_SOFT_DIRTY)
+      return 1;
+  }
+  return 0;
+}
+
+/* Clear every soft-dirty bit, then check that a write sets one again. */
+static int soft_dirty_start(void)
+{
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd < 0)
+    return 0;
+  int cleared = write(fd, "4", 1) == 1;
+  close(fd);
+  int pagemap = open("/proc/self/pagemap", O_RDONLY);
+  if (!cleared || pagemap < 0) {
+    if (pagemap >= 0)
+      close(pagemap);
+    return 0;
+  }
+  volatile char *probe = malloc(1);
+  *probe = 1;
+  int works = pages_dirty(pagemap, (void *)probe, 1);
+  free((void *)probe);
+  close(pagemap);
+  return works;
+}
+
+static void drop(precopy_entry *e)
+{
+  HASH_DEL(entries, e);
+  free(e->snapshot);
+  free(e->children);
+  free(e->parents);
+  free(e);
+}
+
+/* transform_ptr's copy of old, of size bytes. */
+void *precopy_alloc(void *old, size_t size, int *owned)
+{
+  void *new = typed_malloc ? typed_malloc(old, size) : NULL;
+  *owned = new ? PRECOPY_TYPED : PRECOPY_HEAP;
+  return new ? new : malloc(size);
+}
+
+/* Free a copy from precopy_alloc.  While the previous version is still
+   around (kitsune_is_updating), this version has not started, and a typed
+   copy goes back through the previous version's allocator. */
+void precopy_free_copy(void *new, int owned)
+{
+  if (owned == PRECOPY_TYPED) {
+    void (*typed_free)(void *) = kitsune_free;
+    if (kitsune_is_updating())
+      typed_free = (void (*)(void *))kitsune_get_val("kitsune_free");
+    typed_free(new);
+  } else if (owned == PRECOPY_HEAP) {
+    free(new);
+  }
+}
+
+/* Forget the pre-copy, freeing its copies. */
+static void discard(void)
+{
+  precopy_entry *e, *tmp;
+  HASH_ITER(hh, entries, e, tmp) {
+    transform_remove_mapping(e->old);
+    precopy_free_copy(e->new, e->owned);
+    drop(e);
+  }
+}
+
+/*
+ * Called on the driver's thread, after the previous version has been
+ * migrated from.  Returns how many objects were copied, or -1 if the
+ * pre-copy had to be abandoned.
+ */
+int precopy_run(void *prev_handle)
+{
+  jmp_buf env;
+  struct timespec start, end;
+  int abandoned = 0;
+
+  discard();
+  cancelled = 0;
+  soft_dirty = soft_dirty_start();
+  precopied_from = prev_handle;
+  typed_malloc = (void *(*)(void *, size_t))kitsune_get_val("typedheap_precopy_malloc");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  precopy_env = &env;
+  if (setjmp(env) == 0) {
+    registervars_automigrate(&cancelled);
+  } else {
+    abandoned = 1;
+    discard();
+  }
+  precopy_env = NULL;
+  cur_parent = NULL;
+  typed_malloc = NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (abandoned) {
+    kitsune_log_info(KT_LOG_TRANSFORM, "precopy: abandoned.");
+    return -1;
+  }
+  precopy_entry *e, *tmp;
+  size_t bytes = 0;
+  HASH_ITER(hh, entries, e, tmp)
+    bytes += e->size;
+  kitsune_log_info(KT_LOG_TRANSFORM,
+                   "precopy: copied %u objects (%lu bytes) in %.3f ms%s, tracking "
+                   "writes with %s.", HASH_COUNT(entries), (unsigned long)bytes,
+                   (end.tv_sec - start.tv_sec) * 1000.0 +
+                   (end.tv_nsec - start.tv_nsec) / 1000000.0,
+                   cancelled ? " (cut short by the update)" : "",
+                   soft_dirty ? "soft-dirty bits" : "snapshots");
+  return HASH_COUNT(entries);
+}
+
+/* Asked by the driver when the update arrives before the pre-copy is done. */
+void kitsune_precopy_cancel(void)
+{
+  cancelled = 1;
+}
+
+/* Another version is being pre-copied instead (see kitsune_precopy_discard). */
+void precopy_discard(void)
+{
+  discard();
+}
+
+int precopy_active(void)
+{
+  return precopy_env != NULL;
+}
+
+/* Something the pre-copy cannot undo (transforming an old object in place, or
+   a failing kitsune_assert): give up on it. */
+void precopy_abandon(void)
+{
+  if (precopy_env)
+    longjmp(*precopy_env, 1);
+}
+
+/* transform_ptr is about to transform old into new: record it.  Returns the
+   enclosing entry, for precopy_leave. */
+void *precopy_enter(void *old, void *new, size_t size, int owned)
+{
+  precopy_entry *e = calloc(1, sizeof(precopy_entry));
+  e->old = old;
+  e->new = new;
+  e->size = size;
+  e->owned = owned;
+  if (!soft_dirty) {
+    e->snapshot = malloc(size);
+    memcpy(e->snapshot, old, size);
+  }
+  HASH_ADD_PTR(entries, old, e);
+  link_entries(cur_parent, e);
+
+  precopy_entry *outer = cur_parent;
+  cur_parent = e;
+  return outer;
+}
+
+void precopy_leave(void *outer)
+{
+  precopy_entry *e = cur_parent;
+  /* Written while it was being transformed: the copy may be torn. */
+  if (e->snapshot && memcmp(e->snapshot, e->old, e->size) != 0)
+    e->invalid = 1;
+  cur_parent = outer;
+}
+
+static void claim(precopy_entry *e)
+{
+  precopy_entry **stack = NULL;
+  int depth = 0, cap = 0, i;
+
+  if (e->claimed)
+    return;
+  e->claimed = 1;
+  push(&stack, &depth, &cap, e);
+  while (depth) {
+    e = stack[--depth];
+    for (i = 0; i < e->nchildren; i++) {
+      if (!e->children[i]->claimed) {
+        e->children[i]->claimed = 1;
+        push(&stack, &depth, &cap, e->children[i]);
+      }
+    }
+  }
+  free(stack);
+}
+
+/* transform_ptr found an existing mapping for old.  During the pre-copy the
+   transformer running depends on it; during the update it means the copy is
+   in use, and so is everything it points at. */
+void precopy_hit(void *old)
+{
+  precopy_entry *e;
+  if (!entries)
+    return;
+  HASH_FIND_PTR(entries, &old, e);
+  if (!e)
+    return;
+  if (precopy_env)
+    link_entries(cur_parent, e);
+  else
+    claim(e);
+}
+
+/* Called as the update starts, before any state is migrated. */
+void precopy_validate(void *prev_handle)
+{
+  struct timespec start, end;
+  precopy_entry *e, *tmp, **work = NULL;
+  int nwork = 0, work_cap = 0, i;
+  unsigned int total = HASH_COUNT(entries), dropped = 0;
+
+  if (!entries)
+    return;
+  if (prev_handle != precopied_from) {
+    kitsune_log_info(KT_LOG_TRANSFORM, "precopy: taken from another version; discarding it.");
+    discard();
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int pagemap = soft_dirty ? open("/proc/self/pagemap", O_RDONLY) : -1;
+  HASH_ITER(hh, entries, e, tmp) {
+    if (!e->invalid) {
+      if (soft_dirty)
+        e->invalid = pagemap < 0 || pages_dirty(pagemap, e->old, e->size);
+      else
+        e->invalid = memcmp(e->snapshot, e->old, e->size) != 0;
+    }
+    if (e->invalid)
+      push(&work, &nwork, &work_cap, e);
+  }
+  if (pagemap >= 0)
+    close(pagemap);
+
+  /* A copy that points at a dropped one is dropped too. */
+  while (nwork) {
+    e = work[--nwork];
+    for (i = 0; i < e->nparents; i++) {
+      if (!e->parents[i]->invalid) {
+        e->parents[i]->invalid = 1;
+        push(&work, &nwork, &work_cap, e->parents[i]);
+      }
+    }
+  }
+  free(work);
+
+  HASH_ITER(hh, entries, e, tmp) {
+    if (!e->invalid)
+      continue;
+    transform_remove_mapping(e->old);
+    precopy_free_copy(e->new, e->owned);
+    drop(e);
+    dropped++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  kitsune_log_info(KT_LOG_TRANSFORM,
+                   "precopy: reusing %u of %u copies; checking them took %.3f ms.",
+                   total - dropped, total, (end.tv_sec - start.tv_sec) * 1000.0 +
+                   (end.tv_nsec - start.tv_nsec) / 1000000.0);
+}
+
+/* Called by transform_free once every thread has migrated its state: the
+   originals of the copies that were used go, as do the unused copies. */
+void precopy_finish(void (*free_old)(void *))
+{
+  precopy_entry *e, *tmp;
+  HASH_ITER(hh, entries, e, tmp) {
+    if (e->claimed && e->owned)
+      free_old(e->old);
+    else
+      precopy_free_copy(e->new, e->owned);
+    drop(e);
+  }
+}
+
+/* The update is being rolled back: the originals stay with the old version. */
+void precopy_rollback(void)
+{
+  discard();
+}
@@ -0,0 +1,24 @@
+#ifndef PRECOPY_INTERNAL_H_
+#define PRECOPY_INTERNAL_H_
+
+#include <stddef.h>
+
+/* Where a copy came from (precopy_enter's owned). */
+enum { PRECOPY_GLOBAL, PRECOPY_HEAP, PRECOPY_TYPED };
+
+int  precopy_run(void *prev_handle);
+int  precopy_active(void);
+void precopy_abandon(void);
+void precopy_discard(void);
+
+void *precopy_alloc(void *old, size_t size, int *owned);
+void precopy_free_copy(void *new, int owned);
+void *precopy_enter(void *old, void *new, size_t size, int owned);
+void precopy_leave(void *outer);
+void precopy_hit(void *old);
+
+void precopy_validate(void *prev_handle);
+void precopy_finish(void (*free_old)(void *));
+void precopy_rollback(void);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef RADIX_INTERNAL_H
+#define RADIX_INTERNAL_H
+
+#include <stdlib.h>
+
+/*
+ * The level of a radix table in *slot, allocated (zeroed) if there is none
+ * yet.  Levels are only ever added, so readers need no lock: if two threads
+ * race to add one, the loser frees its copy and uses the winner's.
+ */
+static inline void *radix_alloc_level(void **slot, size_t size)
+{
+  void *level = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (level)
+    return level;
+  void *fresh = calloc(1, size);
+  if (__atomic_compare_exchange_n(slot, &level, fresh, 0, __ATOMIC_ACQ_REL,
+                                  __ATOMIC_ACQUIRE))
+    return fresh;
+  free(fresh);                  /* another thread got there first */
+  return level;
+}
+
+#endif
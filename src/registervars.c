@@ -9,6 +9,17 @@
 
 #include "registervars_internal.h"
 #include "ktthreads_internal.h"
+#include "trace_internal.h"
+
+#ifdef ENABLE_THREADING
+#include <pthread.h>
+
+/* The symbol tables are read far more often than they are written (writes
+   happen almost exclusively from the registration constructors run at dlopen
+   time), so they get their own reader/writer lock rather than sharing the
+   thread-management mutex. */
+static pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
 
 /* At the time the generated registration constructors are called, the kitsune
    library will not yet be prepared to lookup the appropriate transformers for
@@ -102,47 +113,65 @@ void kitsune_register_var(const char *var_name, const char *funcname,
                          void* var_addr, size_t size, int auto_migrate) 
 {
 #ifdef ENABLE_THREADING
-  ktthread_lock();
+  pthread_rwlock_wrlock(&registry_lock);
 #endif  
   char *key = kitsune_get_symbol_key(var_name, funcname, filename, namespace);
   kitsune_register_key(key, var_addr, size, auto_migrate, var_name, funcname, filename, namespace);
   free(key);
 #ifdef ENABLE_THREADING
-  ktthread_unlock();
+  pthread_rwlock_unlock(&registry_lock);
 #endif
 }
 
 
 /**
- * \ingroup public
- * Initiate automigration of all auto-migration-registered variables.
- * 
- * By default, the Kitsune compiler registers all global variables for
- * automigration. This function iterates over these variables, calls any
- * relevant transformation code, and migrates the old state into the
- * corresponding new version variables. When it returns, all variables marked
- * for automigration will contain their old-version values.
- */ 
-void kitsune_do_automigrate(void) {
+ * \ingroup internal
+ * Automigrates every registered variable, stopping early if *cancel is set
+ * (the pre-copy is cut short when the update arrives).
+ */
+void registervars_automigrate(volatile int *cancel)
+{
 	hash_entry* cur;
 	hash_entry* tmp;
     xform_fn_t xf = NULL;
 
-#ifdef ENABLE_THREADING
-  assert(ktthread_is_main());
-  ktthread_lock();
-#endif
   if (kitsune_is_updating()) {
     HASH_ITER(hh_addr, name_to_addr_hash, cur, tmp)	{
+      if (cancel && *cancel)
+        break;
       if (cur->auto_migrate){
         xf = kitsune_get_xform(cur->var_name, cur->funcname, cur->filename, cur->namespace);
+        uint64_t start = xf ? trace_now() : 0;
         kitsune_automigrate_key(cur->name, cur->addr, cur->size, xf);
+        /* only the larger transforms make it onto the timeline */
+        uint64_t end = trace_now();
+        if (end - start >= TRACE_LARGE_NS)
+          trace_span("transform", cur->name, start, end);
       }
     }
 	}
+}
+
+/**
+ * \ingroup public
+ * Initiate automigration of all auto-migration-registered variables.
+ * 
+ * By default, the Kitsune compiler registers all global variables for
+ * automigration. This function iterates over these variables, calls any
+ * relevant transformation code, and migrates the old state into the
+ * corresponding new version variables. When it returns, all variables marked
+ * for automigration will contain their old-version values.
+ */ 
+void kitsune_do_automigrate(void) {
 #ifdef ENABLE_THREADING
-  ktthread_unlock();
+  /* No lock is held across the transformers: automigration runs on the main
+     thread before any child thread is relaunched, and a transformer is free to
+     register or look up variables itself. */
+  assert(ktthread_is_main());
 #endif
+  uint64_t start = trace_now();
+  registervars_automigrate(NULL);
+  trace_span("automigrate", NULL, start, trace_now());
 }
 
 
@@ -153,13 +182,9 @@ void kitsune_do_automigrate(void) {
 void* kitsune_lookup_key_old(const char *key)
 {
 	hash_entry *entry;	
-#ifdef ENABLE_THREADING
-  ktthread_lock();
-#endif
+  /* The old-version tables are immutable between registervars_migrate and
+     registervars_free, so readers do not need to lock them. */
 	HASH_FIND(hh_name, old_name_to_addr_hash, key, strlen(key), entry);
-#ifdef ENABLE_THREADING
-  ktthread_unlock();
-#endif
 	if (entry)
 		return entry->addr;
 	else
@@ -174,11 +199,11 @@ void* kitsune_lookup_key_new(const char *key)
 {
 	hash_entry *entry;
 #ifdef ENABLE_THREADING
-  ktthread_lock();
+  pthread_rwlock_rdlock(&registry_lock);
 #endif
 	HASH_FIND(hh_name, name_to_addr_hash, key, strlen(key), entry);
 #ifdef ENABLE_THREADING
-  ktthread_unlock();
+  pthread_rwlock_unlock(&registry_lock);
 #endif
 	if(entry)
 		return entry->addr;
@@ -194,13 +219,7 @@ void* kitsune_lookup_key_new(const char *key)
  */ 
 char *kitsune_lookup_addr_old(void *addr) {
 	hash_entry *entry;	
-#ifdef ENABLE_THREADING
-  ktthread_lock();
-#endif
 	HASH_FIND(hh_addr, old_addr_to_name_hash, &addr, sizeof(addr), entry);	
-#ifdef ENABLE_THREADING
-  ktthread_unlock();
-#endif
 	if(entry)
 		return entry->name;
 	else
@@ -216,11 +235,11 @@ char *kitsune_lookup_addr_old(void *addr) {
 char *kitsune_lookup_addr_new(void *addr) {
 	hash_entry *entry;	
 #ifdef ENABLE_THREADING
-  ktthread_lock();
+  pthread_rwlock_rdlock(&registry_lock);
 #endif
 	HASH_FIND(hh_addr, addr_to_name_hash, &addr, sizeof(addr), entry);	
 #ifdef ENABLE_THREADING
-  ktthread_unlock();
+  pthread_rwlock_unlock(&registry_lock);
 #endif
 	if(entry)
 		return entry->name;
@@ -228,31 +247,48 @@ char *kitsune_lookup_addr_new(void *addr) {
 		return NULL;
 }
 
-/**
- * \ingroup internal
- * 
- * Delete all entries in the Kitsune symbol table.
- */ 
-void registervars_free(void) 
+static void free_tables(hash_entry **by_name, hash_entry **by_addr)
 {
 	hash_entry* cur;
 	hash_entry* tmp;
 
-#ifdef ENABLE_THREADING
-  ktthread_lock();
-#endif
-	HASH_ITER(hh_name, old_name_to_addr_hash, cur, tmp) {
-		HASH_DELETE(hh_name, old_name_to_addr_hash, cur);		
+	HASH_ITER(hh_name, *by_name, cur, tmp) {
+		HASH_DELETE(hh_name, *by_name, cur);		
 	}
-	HASH_ITER(hh_addr, old_addr_to_name_hash, cur, tmp)	{
-		HASH_DELETE(hh_addr, old_addr_to_name_hash, cur);
+	HASH_ITER(hh_addr, *by_addr, cur, tmp)	{
+		HASH_DELETE(hh_addr, *by_addr, cur);
 		free(cur->name);
 		free(cur);
 	}
-	old_name_to_addr_hash = old_addr_to_name_hash = NULL;
-#ifdef ENABLE_THREADING
-  ktthread_unlock();
-#endif
+	*by_name = *by_addr = NULL;
+}
+
+/**
+ * \ingroup internal
+ * 
+ * Delete all entries in the Kitsune symbol table.
+ */ 
+void registervars_free(void) 
+{
+  /* Called by the main thread once every child thread is parked in
+     ktthread_finish_update, so nothing can be reading the old tables.  After
+     a rollback the old tables are our own, which are still in use. */
+  if (old_name_to_addr_hash == name_to_addr_hash)
+    old_name_to_addr_hash = old_addr_to_name_hash = NULL;
+  else
+    free_tables(&old_name_to_addr_hash, &old_addr_to_name_hash);
+}
+
+/**
+ * \ingroup internal
+ * 
+ * The update to this version is being rolled back: delete this version's own
+ * symbol table, leaving the previous version's alone.
+ */ 
+void registervars_discard(void)
+{
+  free_tables(&name_to_addr_hash, &addr_to_name_hash);
+  old_name_to_addr_hash = old_addr_to_name_hash = NULL;
 }
 
 //remember the old hash from the previous version
@@ -265,10 +301,7 @@ void registervars_free(void)
  */
 void registervars_migrate(void)
 {
-#ifdef ENABLE_THREADING
-  ktthread_lock();
-#endif
-
+  /* Runs from kitsune_init_inplace before any child thread is relaunched. */
   hash_entry** lookup_name_hash = kitsune_get_val("name_to_addr_hash");
   hash_entry** lookup_addr_hash = kitsune_get_val("addr_to_name_hash");
   
@@ -276,8 +309,4 @@ void registervars_migrate(void)
   
   old_name_to_addr_hash = *lookup_name_hash;
   old_addr_to_name_hash = *lookup_addr_hash;
-    
-#ifdef ENABLE_THREADING
-  ktthread_unlock();
-#endif
 }
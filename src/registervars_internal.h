@@ -2,6 +2,8 @@
 #define EKIDEN_STATICVARS_INTERNAL_H_
 
 void registervars_free(void);
+void registervars_discard(void);
 void registervars_migrate(void);
+void registervars_automigrate(volatile int *cancel);
 
 #endif
@@ -96,7 +96,12 @@ static void free_stack_node(stack_node *node)
 
 void stackvars_move_to_heap(void)
 {
-  stack_node **top = get_top();
+  stackvars_move_to_heap_from((void **)get_top());
+}
+
+/* As above, for the stack of the thread whose top of stack is *top. */
+void stackvars_move_to_heap_from(void **top)
+{
   stack_node *cur = *top;
 
   while (cur) {
@@ -117,6 +122,9 @@ void stackvars_flip(void)
     stack_node **top_old_ver = kitsune_get_val("stackvars_top");
     assert(top_old_ver);
     *old_top = *top_old_ver;
+    /* After a rollback the old version's stack is our own. */
+    if (top_old_ver == &stackvars_top)
+      stackvars_top = NULL;
 #ifdef ENABLE_THREADING
   } else {
     *old_top = *top;
@@ -185,10 +193,10 @@ void stackvars_note_formal(const char *name, void *addr, size_t size)
 
 static void var_summary(const char *category, var_node *vars) 
 {
-  kitsune_log("%s\n", category);
+  kitsune_log_debug(KT_LOG_UPDATE, "%s\n", category);
   var_node *cur = vars;
   while (cur) {
-    kitsune_log("  %s\n", cur->name);
+    kitsune_log_debug(KT_LOG_UPDATE, "  %s\n", cur->name);
     cur = cur->next;
   }
 }
@@ -197,9 +205,9 @@ void stackvars_summary(void)
 {
   stack_node **top = get_top();
   stack_node *cur = *top;
-  kitsune_log("Dumping the stack...\n");
+  kitsune_log_debug(KT_LOG_UPDATE, "Dumping the stack...\n");
   while (cur) {
-    kitsune_log("%s\n", cur->fun_name);
+    kitsune_log_debug(KT_LOG_UPDATE, "%s\n", cur->fun_name);
     var_summary("formals", cur->formals);
     var_summary("locals", cur->locals);
     cur = cur->next;
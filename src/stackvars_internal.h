@@ -3,6 +3,7 @@
 
 void *stackvars_stack_init(void);
 void stackvars_move_to_heap(void);
+void stackvars_move_to_heap_from(void **top);
 void stackvars_free(void);
 void stackvars_flip(void);
 
@@ -0,0 +1,224 @@
+/*
+ * The update timeline.  With KITSUNE_TRACE=FILE in the environment, the
+ * runtime records when each phase of an update began and ended, and on which
+ * thread: the request, each thread's quiescence, the longjmp to the driver
+ * and its dlopen of the next version, the migration steps, the larger
+ * transforms, the relaunch of the threads and their way back to their update
+ * points, and the dlclose of the old version.  Events are kept in a buffer
+ * handed from version to version (the old version's records end in the new
+ * one) and written out once the update is done, in the Chrome trace event
+ * format: load FILE in chrome://tracing or ui.perfetto.dev.
+ *
+ * FILE is a JSON array that is never closed, which both viewers accept, so
+ * that every update can append to it.  Recording takes no lock (it may happen
+ * in a signal handler); an event that finds the buffer full is dropped and
+ * counted.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <dlfcn.h>
+
+#include "kitsune_internal.h"
+#include "trace_internal.h"
+
+#define TRACE_EVENTS 4096
+#define TRACE_NAME 48
+
+typedef struct {
+  uint64_t start_ns;
+  uint64_t end_ns;              /* unused for an instant */
+  int pid;
+  int tid;
+  char instant;
+  char ready;                   /* filled in, not yet written */
+  char name[TRACE_NAME];
+} trace_event;
+
+typedef struct {
+  FILE *out;
+  int written;                  /* events written to out so far */
+  int flushing;
+  uint64_t head;                /* events ever recorded */
+  uint64_t tail;                /* events ever written out */
+  uint64_t dropped;
+  uint64_t left_ns;             /* when a version last longjmp'd out */
+  trace_event events[TRACE_EVENTS];
+} trace_state;
+
+/* Passed from version to version (see trace_init); NULL when not tracing. */
+trace_state *kitsune_trace = NULL;
+
+uint64_t trace_now(void)
+{
+  struct timespec ts;
+  if (!kitsune_trace)
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Copy src into the TRACE_NAME bytes of dst from index at on, truncating it
+   if need be, and return where it ends.  A plain byte copy, since record may
+   run in a signal handler, where snprintf is not safe to call. */
+static size_t copy_name(char *dst, size_t at, const char *src)
+{
+  while (*src && at < TRACE_NAME - 1)
+    dst[at++] = *src++;
+  dst[at] = '\0';
+  return at;
+}
+
+static void record(int instant, const char *name, const char *detail,
+                   uint64_t start_ns, uint64_t end_ns)
+{
+  trace_state *t = kitsune_trace;
+  if (!t || !start_ns)
+    return;
+  uint64_t slot = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+  do {
+    if (slot - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) >= TRACE_EVENTS) {
+      __atomic_fetch_add(&t->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&t->head, &slot, slot + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  trace_event *e = &t->events[slot % TRACE_EVENTS];
+  e->start_ns = start_ns;
+  e->end_ns = end_ns;
+  e->pid = getpid();
+  e->tid = syscall(SYS_gettid);
+  e->instant = instant;
+  size_t len = copy_name(e->name, 0, name);
+  if (detail)
+    copy_name(e->name, copy_name(e->name, len, " "), detail);
+  __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record that the phase name (followed by detail, if not NULL) ran on this
+ * thread from start_ns to end_ns, as trace_now gave them.
+ */
+void trace_span(const char *name, const char *detail, uint64_t start_ns,
+                uint64_t end_ns)
+{
+  record(0, name, detail, start_ns, end_ns);
+}
+
+/**
+ * Record that name ran on this thread from start_ns until now, and return
+ * now: the start of whatever comes next.
+ */
+uint64_t trace_step(const char *name, uint64_t start_ns)
+{
+  uint64_t now = trace_now();
+  record(0, name, NULL, start_ns, now);
+  return now;
+}
+
+/**
+ * Record that name happened now.
+ */
+void trace_instant(const char *name)
+{
+  record(1, name, NULL, trace_now(), 0);
+}
+
+static void write_name(FILE *out, const char *name)
+{
+  for (; *name; name++) {
+    if (*name == '"' || *name == '\\')
+      fputc('\\', out);
+    if ((unsigned char)*name >= ' ')
+      fputc(*name, out);
+  }
+}
+
+/**
+ * Write out the events recorded so far.  Called when an update is done, and
+ * at exit.
+ */
+void trace_flush(void)
+{
+  trace_state *t = kitsune_trace;
+  int busy = 0;
+  if (!t || !__atomic_compare_exchange_n(&t->flushing, &busy, 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  uint64_t head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+  while (t->tail != head) {
+    trace_event *e = &t->events[t->tail % TRACE_EVENTS];
+    if (!__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE))
+      break;                    /* still being filled in */
+    fprintf(t->out, "%s{\"name\":\"", t->written++ ? ",\n" : "");
+    write_name(t->out, e->name);
+    if (e->instant)
+      fprintf(t->out, "\",\"cat\":\"kitsune\",\"ph\":\"i\",\"s\":\"p\","
+              "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+              e->start_ns / 1000.0, e->pid, e->tid);
+    else
+      fprintf(t->out, "\",\"cat\":\"kitsune\",\"ph\":\"X\",\"ts\":%.3f,"
+              "\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+              e->start_ns / 1000.0, (e->end_ns - e->start_ns) / 1000.0,
+              e->pid, e->tid);
+    __atomic_store_n(&e->ready, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->tail, t->tail + 1, __ATOMIC_RELEASE);
+  }
+  fflush(t->out);
+  if (t->dropped)
+    kitsune_log_warn(KT_LOG_UPDATE, "trace: %lu events dropped, the buffer was full.",
+                     (unsigned long)__atomic_exchange_n(&t->dropped, 0, __ATOMIC_RELAXED));
+  __atomic_store_n(&t->flushing, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Note that this version is about to longjmp back to the driver, which will
+ * load the next one (or re-enter the previous one, on a rollback).
+ */
+void trace_leave(void)
+{
+  if (kitsune_trace)
+    kitsune_trace->left_ns = trace_now();
+}
+
+/**
+ * Take the timeline over from the previous version, putting the trip through
+ * the driver on it, or start one if KITSUNE_TRACE names a file.
+ */
+void trace_init(void)
+{
+  if (kitsune_is_updating()) {
+    trace_state **prev = kitsune_get_val("kitsune_trace");
+    if (prev && *prev)
+      kitsune_trace = *prev;
+    void *driver = dlopen(NULL, RTLD_LAZY);
+    unsigned long long *times = driver ? dlsym(driver, "kitsune_driver_times") : NULL;
+    if (kitsune_trace && times && kitsune_trace->left_ns) {
+      trace_span("longjmp", NULL, kitsune_trace->left_ns, times[0]);
+      if (!kitsune_is_rolling_back())
+        trace_span("dlopen", NULL, times[0], times[1]);
+      kitsune_trace->left_ns = 0;
+    }
+  } else if (!kitsune_trace && getenv("KITSUNE_TRACE")) {
+    FILE *out = fopen(getenv("KITSUNE_TRACE"), "w");
+    trace_state *t = out ? calloc(1, sizeof(trace_state)) : NULL;
+    if (!t) {
+      kitsune_log_error(KT_LOG_UPDATE, "trace: cannot write %s; not tracing.",
+                        getenv("KITSUNE_TRACE"));
+      if (out)
+        fclose(out);
+      return;
+    }
+    t->out = out;
+    fputs("[\n", out);
+    kitsune_trace = t;
+  }
+  if (kitsune_trace)
+    atexit(trace_flush);
+}
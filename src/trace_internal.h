@@ -0,0 +1,20 @@
+#ifndef TRACE_INTERNAL_H
+#define TRACE_INTERNAL_H
+
+#include <stdint.h>
+
+/* Transforms of single variables shorter than this are left off. */
+#define TRACE_LARGE_NS 100000
+
+void trace_init(void);
+void trace_flush(void);
+void trace_leave(void);
+
+/* The time for trace_span, or 0 (which it ignores) when not tracing. */
+uint64_t trace_now(void);
+void trace_span(const char *name, const char *detail, uint64_t start_ns,
+                uint64_t end_ns);
+uint64_t trace_step(const char *name, uint64_t start_ns);
+void trace_instant(const char *name);
+
+#endif
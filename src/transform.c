@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <assert.h>
+#include <time.h>
 
 #include "uthash.h"
 
@@ -10,8 +11,22 @@
 #include "addresscheck_internal.h"
 #include "ktthreads_internal.h"
 #include "vmareas_internal.h"
+#include "pageclass_internal.h"
 #include "bench_internal.h"
 #include "alloctrack_internal.h"
+#include "transform_internal.h"
+#include "precopy_internal.h"
+#include "typedheap_internal.h"
+#include "trace_internal.h"
+#include "interpose_internal.h"
+
+#ifdef ENABLE_THREADING
+#include <pthread.h>
+
+/* Pointer mappings are looked up for every pointer traversed but only added
+   once per object, so they are guarded by their own reader/writer lock. */
+static pthread_rwlock_t xform_mappings_lock = PTHREAD_RWLOCK_INITIALIZER;
+#endif
 
 typedef struct
 {
@@ -23,22 +38,108 @@ typedef struct
 rename_hash_entry* rename_hash = NULL;
 
 static void transform_perform_free(void * old) {
-//  kitsune_log("performing free");
-  vmarea *area = vmareas_lookup(old);
-  alarea *alint = alloctrack_lookup(old);
-  if(alint){
+  kitsune_log_trace(KT_LOG_TRANSFORM, "performing free of %p", old);
+  if (pageclass_tracked(old) && alloctrack_lookup(old)) {
     kitsune_free(old);
     return;
   }
-  if (vmareas_get_type(area) == HEAP) {
+  /* from malloc, even if in one of its mmapped arenas */
+  if (interpose_lookup(old, NULL) || pageclass_type(old) == HEAP) {
     free(old);
   } else {
-    char *printable = vmareas_to_str(area);
-    kitsune_log("free for non-heap pointer skipped (%s)", printable);
+    char *printable = vmareas_to_str(vmareas_lookup(old));
+    kitsune_log_debug(KT_LOG_TRANSFORM, "free for non-heap pointer skipped (%s)", printable);
     free(printable); 
   }
 }
 
+/* Until the update commits (see kitsune_rollback) the old objects that were
+   deep-copied are kept, so that the old version can still be resumed; this
+   list pairs each of them with its new copy.  Only the main thread transforms
+   before the commit, but it may sweep typed objects on several threads (see
+   kitsune_transform_typed). */
+typedef struct deferred_free {
+  void *old;
+  void *new;
+  size_t size;
+  struct deferred_free *next;
+} deferred_free;
+
+static deferred_free *deferred_frees = NULL;
+#ifdef ENABLE_THREADING
+static pthread_mutex_t deferred_frees_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Set once old state has been transformed in place, after which there is
+   nothing left to roll back to. */
+static int old_state_modified = 0;
+
+static void transform_retire(void *old, void *new, size_t size)
+{
+  if (kitsune_update_committed()) {
+    transform_perform_free(old);
+    return;
+  }
+  deferred_free *d = malloc(sizeof(deferred_free));
+  d->old = old;
+  d->new = new;
+  d->size = size;
+#ifdef ENABLE_THREADING
+  pthread_mutex_lock(&deferred_frees_lock);
+#endif
+  d->next = deferred_frees;
+  deferred_frees = d;
+#ifdef ENABLE_THREADING
+  pthread_mutex_unlock(&deferred_frees_lock);
+#endif
+}
+
+/* The update has committed: release the old objects that were kept for a
+   rollback, logging what keeping them cost. */
+void transform_commit(void)
+{
+  struct timespec start, end;
+  size_t count = 0, bytes = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (deferred_frees) {
+    deferred_free *d = deferred_frees;
+    deferred_frees = d->next;
+    count++;
+    bytes += d->size;
+    transform_perform_free(d->old);
+    free(d);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (count)
+    kitsune_log_info(KT_LOG_TRANSFORM,
+                     "transform: kept %lu old objects (%lu bytes) until commit; "
+                     "freeing them took %.3f ms", (unsigned long)count,
+                     (unsigned long)bytes, (end.tv_sec - start.tv_sec) * 1000.0 +
+                     (end.tv_nsec - start.tv_nsec) / 1000000.0);
+}
+
+/* The update is being abandoned: free the new copies made so far and forget
+   the old objects, which stay with the old version.  Returns false if old
+   state was modified in place, which cannot be undone. */
+int transform_rollback(void)
+{
+  if (old_state_modified)
+    return 0;
+  precopy_rollback();
+  while (deferred_frees) {
+    deferred_free *d = deferred_frees;
+    deferred_frees = d->next;
+    if (alloctrack_block_at(d->new))
+      kitsune_free(d->new);
+    else
+      free(d->new);
+    free(d);
+  }
+  transform_free();
+  return 1;
+}
+
 void transform_register_renaming(const char *old_key, const char *new_key)
 {
 #ifdef ENABLE_THREADING
@@ -82,7 +183,7 @@ void transform_init(void) {
 void delete_hm_entries();
 void transform_free(void) {
 #ifdef ENABLE_THREADING
-  ktthread_lock();
+  pthread_rwlock_wrlock(&xform_mappings_lock);
 #endif
   struct closure_list *next, *cur = allocated_closures;
   while (cur) {
@@ -94,13 +195,14 @@ void transform_free(void) {
   }
   allocated_closures = NULL;
 
+  precopy_finish(transform_perform_free);
   delete_hm_entries();
 
   /* release all the memory freed during transformation */
   vmareas_free();
 
 #ifdef ENABLE_THREADING
-  ktthread_unlock();
+  pthread_rwlock_unlock(&xform_mappings_lock);
 #endif
 }
 
@@ -137,14 +239,15 @@ closure *transform_make_closure(xf f, copy_opt copy_opt,
   struct closure_list *new_top = malloc(sizeof(struct closure_list));
   new_top->c = c;
 
-  /* Accesses to shared kitsune resources requires mutual exclusion */
+  /* Closures are only ever pushed until transform_free, so the list can be
+     maintained as a lock-free stack. */
 #ifdef ENABLE_THREADING
-  ktthread_lock();
-#endif
+  do {
+    new_top->next = allocated_closures;
+  } while (!__sync_bool_compare_and_swap(&allocated_closures, new_top->next, new_top));
+#else
   new_top->next = allocated_closures;
   allocated_closures = new_top;  
-#ifdef ENABLE_THREADING
-  ktthread_unlock();
 #endif
   return c;
 }
@@ -174,11 +277,11 @@ void delete_hm_entries(){
 void *transform_find_mapping(void *from) {
   xform_mapping_entry *entry;	
 #ifdef ENABLE_THREADING
-  ktthread_lock();
+  pthread_rwlock_rdlock(&xform_mappings_lock);
 #endif
 	HASH_FIND_PTR(xform_mappings_head, &from, entry);	
 #ifdef ENABLE_THREADING
-  ktthread_unlock();
+  pthread_rwlock_unlock(&xform_mappings_lock);
 #endif
 	if (entry)
 		return entry->addr;
@@ -191,11 +294,48 @@ void transform_add_mapping(void *from, void *to) {
 	new_entry->key = from;
 	new_entry->addr = to;
 #ifdef ENABLE_THREADING
-  ktthread_lock();
+  pthread_rwlock_wrlock(&xform_mappings_lock);
 #endif
 	HASH_ADD_PTR(xform_mappings_head, key, new_entry);
 #ifdef ENABLE_THREADING
-  ktthread_unlock();
+  pthread_rwlock_unlock(&xform_mappings_lock);
+#endif
+}
+
+/* Map from to to unless from is already mapped (by another thread, say).
+   Returns what from is mapped to. */
+static void *transform_claim_mapping(void *from, void *to) {
+  xform_mapping_entry *entry;
+#ifdef ENABLE_THREADING
+  pthread_rwlock_wrlock(&xform_mappings_lock);
+#endif
+  HASH_FIND_PTR(xform_mappings_head, &from, entry);
+  if (entry) {
+    to = entry->addr;
+  } else {
+    entry = malloc(sizeof(xform_mapping_entry));
+    entry->key = from;
+    entry->addr = to;
+    HASH_ADD_PTR(xform_mappings_head, key, entry);
+  }
+#ifdef ENABLE_THREADING
+  pthread_rwlock_unlock(&xform_mappings_lock);
+#endif
+  return to;
+}
+
+void transform_remove_mapping(void *from) {
+  xform_mapping_entry *entry;
+#ifdef ENABLE_THREADING
+  pthread_rwlock_wrlock(&xform_mappings_lock);
+#endif
+  HASH_FIND_PTR(xform_mappings_head, &from, entry);
+  if (entry) {
+    HASH_DEL(xform_mappings_head, entry);
+    free(entry);
+  }
+#ifdef ENABLE_THREADING
+  pthread_rwlock_unlock(&xform_mappings_lock);
 #endif
 }
 
@@ -211,6 +351,7 @@ void transform_ptr(void *in, void *out, int num_gen_args, void **args) {
 
   void *lookup;
   if ((lookup = transform_find_mapping(*(void **)in))) {
+    precopy_hit(*(void **)in);
     *(void **)out = lookup;
   } else {
 #ifdef ENABLE_DEBUG
@@ -224,15 +365,15 @@ void transform_ptr(void *in, void *out, int num_gen_args, void **args) {
     void *out_elem = NULL;
     int needtofree = 0;
     if ((symbol = kitsune_lookup_addr_old(in_elem))) {
-      kitsune_log("transform_ptr: pointer to non-heap data found [%s]", symbol);
+      kitsune_log_trace(KT_LOG_TRANSFORM, "transform_ptr: pointer to non-heap data found [%s]", symbol);
 
       if (!target_xf->deep_copy) {
-        kitsune_log("WARN: transform_ptr: shallow copy requested for non-heap data.");
+        kitsune_log_warn(KT_LOG_TRANSFORM, "transform_ptr: shallow copy requested for non-heap data.");
       }
 
       char *mapped_symbol = transform_mapped_name(symbol);
       if (mapped_symbol) {
-        kitsune_log("transform_ptr: symbol [%s] was mapped to [%s]", symbol, mapped_symbol);
+        kitsune_log_trace(KT_LOG_TRANSFORM, "transform_ptr: symbol [%s] was mapped to [%s]", symbol, mapped_symbol);
         symbol = mapped_symbol;
       }
       lookup = kitsune_lookup_key_new(symbol);
@@ -241,21 +382,118 @@ void transform_ptr(void *in, void *out, int num_gen_args, void **args) {
     } else {
       if (target_xf->deep_copy) {
         bench_xform_alloc(((closure *)args[0])->size_new);
-        out_elem = malloc(((closure *)args[0])->size_new);
-        needtofree=1;
+        if (precopy_active()) {
+          /* typed objects stay typed (see precopy_alloc) */
+          out_elem = precopy_alloc(in_elem, ((closure *)args[0])->size_new, &needtofree);
+        } else {
+          out_elem = malloc(((closure *)args[0])->size_new);
+          needtofree = PRECOPY_HEAP;
+        }
       } else { /* use the same memory */
+        precopy_abandon();
         out_elem = in_elem;
+        if (!kitsune_update_committed())
+          old_state_modified = 1;
       }
     }
+    /* A typed sweep may have got to it in the meantime. */
+    lookup = transform_claim_mapping(in_elem, out_elem);
+    if (lookup != out_elem) {
+      precopy_free_copy(out_elem, needtofree);
+      *(void **)out = lookup;
+      return;
+    }
     *(void **)out = out_elem;
-    transform_add_mapping(in_elem, out_elem);
+    if (precopy_active()) {
+      /* The copy is kept (or dropped) by precopy_validate and precopy_finish. */
+      void *outer = precopy_enter(in_elem, out_elem, target_xf->size_old, needtofree);
+      XF_INVOKE(target_xf, in_elem, out_elem);
+      precopy_leave(outer);
+      return;
+    }
     XF_INVOKE(target_xf, in_elem, out_elem);
     if(needtofree){
-      transform_perform_free(in_elem);
+      transform_retire(in_elem, out_elem, target_xf->size_old);
     }
   }
 }
 
+typedef struct {
+  void *old;
+  void *new;
+} typed_pair;
+
+typedef struct {
+  const char *new_type;
+  closure *xf;
+  typed_pair *pairs;
+  size_t npairs;
+} typed_sweep;
+
+/* First pass: give each object its new copy, so that the pointers between
+   the objects are all mapped before any of them is transformed. */
+static void transform_typed_map(void *old, void *arg) {
+  typed_sweep *s = arg;
+
+  if (transform_find_mapping(old))
+    return;
+  void *new = kitsune_malloc_typed(s->xf->size_new, s->new_type);
+  if (transform_claim_mapping(old, new) != new) {
+    kitsune_free(new);
+    return;
+  }
+  size_t i = __atomic_fetch_add(&s->npairs, 1, __ATOMIC_RELAXED);
+  s->pairs[i].old = old;
+  s->pairs[i].new = new;
+}
+
+/* Second pass: transform them. */
+static void transform_typed_invoke(size_t i, void *arg) {
+  typed_sweep *s = arg;
+  typed_pair *p = &s->pairs[i];
+
+  bench_xform_alloc(s->xf->size_new);
+  XF_INVOKE(s->xf, p->old, p->new);
+  transform_retire(p->old, p->new, s->xf->size_old);
+}
+
+/**
+ * \ingroup public
+ *
+ * Transform every object the previous version allocated with
+ * kitsune_malloc_typed(..., old_type) into a new object of new_type, through
+ * xf, by sweeping old_type's arena rather than waiting for the migration to
+ * reach each object through a pointer.  Every object is given its new copy
+ * (and its pointer mapping) before any is transformed, so pointers between
+ * them, and pointers to them migrated later, find the copies without
+ * recursing.  With threading, the sweep runs on several threads at once, so
+ * xf must not rely on running alone.  Call it before migrating anything
+ * that points at the objects.  Returns the number of objects transformed.
+ */
+size_t kitsune_transform_typed(const char *old_type, const char *new_type, closure *xf) {
+  struct timespec start, end;
+  typed_sweep s = { new_type, xf, NULL, 0 };
+
+  /* The pre-copy reaches them through pointers instead. */
+  if (precopy_active())
+    return 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  s.pairs = malloc(sizeof(typed_pair) * (typedheap_count(old_type) + 1));
+  typedheap_sweep(old_type, transform_typed_map, &s);
+  typedheap_parallel(s.npairs, 64, transform_typed_invoke, &s);
+  free(s.pairs);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  trace_span("transform", old_type,
+             start.tv_sec * 1000000000ull + start.tv_nsec,
+             end.tv_sec * 1000000000ull + end.tv_nsec);
+  kitsune_log_info(KT_LOG_TRANSFORM,
+                   "transform: swept %lu objects of type %s in %.3f ms",
+                   (unsigned long)s.npairs, old_type,
+                   (end.tv_sec - start.tv_sec) * 1000.0 +
+                   (end.tv_nsec - start.tv_nsec) / 1000000.0);
+  return s.npairs;
+}
+
 void transform_fptr(void *in, void *out, int num_gen_args, void **args) {
   assert(num_gen_args == 0);
 
@@ -268,23 +506,22 @@ void transform_fptr(void *in, void *out, int num_gen_args, void **args) {
   } else {
     char *symbol;
     if ((symbol = kitsune_lookup_addr_old(in_elem))) {
-      kitsune_log("transform_fptr: pointer to non-heap data found [%s]", symbol);
+      kitsune_log_trace(KT_LOG_TRANSFORM, "transform_fptr: pointer to non-heap data found [%s]", symbol);
 
       char *mapped_symbol = transform_mapped_name(symbol);
       if (mapped_symbol) {
-        kitsune_log("transform_fptr: symbol [%s] was mapped to [%s]", symbol, mapped_symbol);
+        kitsune_log_trace(KT_LOG_TRANSFORM, "transform_fptr: symbol [%s] was mapped to [%s]", symbol, mapped_symbol);
         symbol = mapped_symbol;
       }
 
       kitsune_assert((lookup = kitsune_lookup_key_new(symbol)), 
                      "transform_fptr: no mapping found for %s\n", symbol);
-      kitsune_log("transform_fptr: mapping address %p", lookup);
+      kitsune_log_trace(KT_LOG_TRANSFORM, "transform_fptr: mapping address %p", lookup);
       *(void **)out = lookup;
-      kitsune_log("transform_fptr: mapping %p -> %p", in_elem, lookup);
+      kitsune_log_trace(KT_LOG_TRANSFORM, "transform_fptr: mapping %p -> %p", in_elem, lookup);
       transform_add_mapping(in_elem, lookup);
     } else {
-      kitsune_log("transform_fptr: could not find function corresponding to address %x\n", in_elem);
-      assert(0);
+      kitsune_assert(0, "transform_fptr: could not find function corresponding to address %p\n", in_elem);
     }
   }
 }
@@ -53,6 +53,10 @@ void transform_array(void *in, void *out, int num_args, void **args);
 void transform_ptrarray(void *in, void *out, int num_args, void **args);
 void transform_ntarray(void *in, void *out, int num_args, void **args);
 void transform_fptr(void *in, void *out, int num_args, void **args);
+void transform_heaplist(void *in, void *out, int num_args, void **args);
+
+size_t kitsune_transform_typed(const char *old_type, const char *new_type,
+                               closure *xf);
 
 
 /**
@@ -144,6 +148,15 @@ void transform_fptr(void *in, void *out, int num_args, void **args);
 #define XF_FPTR() \
   XF_LIFT(transform_fptr, XF_DEEP, (sizeof(void*)), (sizeof(void*)))
 
+/**
+ * \ingroup internal
+ *
+ * Treat the target as a kitsune_heaplist (ktheaptrack.h) of size sz whose
+ * elements are transformed by elem_xf.
+ */
+#define XF_HEAPLIST(sz, elem_xf) \
+  XF_CLOSURE(transform_heaplist, XF_DEEP, sz, sz, elem_xf)
+
 #ifdef E_NOANNOT
 #define E_PTR
 #define E_OPAQUE
@@ -4,5 +4,8 @@
 
 void transform_init(void);
 void transform_free(void);
+void transform_commit(void);
+int  transform_rollback(void);
+void transform_remove_mapping(void *from);
 
 #endif
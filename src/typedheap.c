@@ -0,0 +1,429 @@
+/*
+ * Typed arenas.  kitsune_malloc_typed allocates every object of a type from
+ * an arena of its own: chunks of equal slots, each an alloc_header followed
+ * by the object, carved off in address order.  An update can then find all of
+ * the previous version's objects of a type by sweeping its chunks, rather
+ * than by following pointers to them, so kitsune_transform_typed can
+ * transform them in address order and on several threads.
+ *
+ * Chunks are stamped with the epoch (one per version) they were carved in,
+ * and a sweep only visits chunks from earlier epochs.  Slots freed before an
+ * update are held back until it commits, so that nothing the new version
+ * allocates lands where a sweep looks.
+ *
+ * A type that grows from one version to the next gets a new arena, sized for
+ * the new version, in front of the old ones of the same name; a sweep visits
+ * them all.
+ *
+ * A pre-copy (see precopy.c) puts its copies in arenas of their own, stamped
+ * with the next version's epoch and kept aside until that version starts.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "uthash.h"
+
+#include "kitsune_internal.h"
+#include "alloctrack_internal.h"
+#include "typedheap_internal.h"
+
+#ifdef ENABLE_THREADING
+#include <pthread.h>
+#define ARENA_LOCK(a) pthread_mutex_lock(&(a)->lock)
+#define ARENA_UNLOCK(a) pthread_mutex_unlock(&(a)->lock)
+
+/* Guards the table of arenas; each arena has its own lock for its slots. */
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SWEEP_MAX_THREADS 8
+#else
+#define ARENA_LOCK(a)
+#define ARENA_UNLOCK(a)
+#endif
+
+#define SLOT_ALIGN 16
+#define CHUNK_BYTES (64 * 1024)
+#define ROUND_UP(n) (((n) + SLOT_ALIGN - 1) & ~(size_t)(SLOT_ALIGN - 1))
+
+typedef struct typed_chunk {
+  struct typed_chunk *next;
+  unsigned int epoch;
+  size_t carved;                /* slots handed out so far */
+  size_t cap;
+} typed_chunk;
+
+#define CHUNK_SLOTS(c) ((char *)(c) + ROUND_UP(sizeof(typed_chunk)))
+
+typedef struct typed_arena {
+  char *type;
+  size_t size;                  /* the largest object a slot holds */
+  size_t stride;
+  unsigned int epoch;           /* the version the arena was made in */
+  struct typed_arena *older;    /* the type's arena before it grew */
+  typed_chunk *chunks;          /* newest first */
+  void *free;                   /* free slots, linked through their objects */
+  void *held;                   /* freed before the update: see typedheap_commit */
+#ifdef ENABLE_THREADING
+  pthread_mutex_t lock;
+#endif
+  UT_hash_handle hh;
+} typed_arena;
+
+typedef struct {
+  unsigned int epoch;
+  typed_arena *arenas;
+  typed_arena *pending;         /* the pre-copy's, for the next epoch */
+} typed_heap;
+
+/* Passed from version to version (see typedheap_init). */
+typed_heap *typed_arenas = NULL;
+
+#define SLOT_NEXT(slot) (*(void **)((char *)(slot) + ALLOC_HEADER_SIZE))
+
+static typed_arena *arena_new(const char *type, size_t size, unsigned int epoch)
+{
+  typed_arena *a = calloc(1, sizeof(typed_arena));
+  a->type = strdup(type);       /* the caller's string goes with its version */
+  a->size = size;
+  /* a free slot's object holds the free list's link */
+  a->stride = ALLOC_HEADER_SIZE + ROUND_UP(size ? size : sizeof(void *));
+  a->epoch = epoch;
+#ifdef ENABLE_THREADING
+  pthread_mutex_init(&a->lock, NULL);
+#endif
+  return a;
+}
+
+/* The arena for objects of size bytes of type: the newest one, made for
+   objects of that size if there is none, or if the type has grown since the
+   newest was made by an earlier version. */
+static typed_arena *arena_for(const char *type, size_t size)
+{
+  typed_arena *a, *older;
+#ifdef ENABLE_THREADING
+  pthread_mutex_lock(&arenas_lock);
+#endif
+  HASH_FIND_STR(typed_arenas->arenas, type, older);
+  a = older;
+  if (!a || (size > a->size && a->epoch != typed_arenas->epoch)) {
+    a = arena_new(type, size, typed_arenas->epoch);
+    a->older = older;
+    if (older)
+      HASH_DEL(typed_arenas->arenas, older);
+    HASH_ADD_KEYPTR(hh, typed_arenas->arenas, a->type, strlen(a->type), a);
+  }
+#ifdef ENABLE_THREADING
+  pthread_mutex_unlock(&arenas_lock);
+#endif
+  return a;
+}
+
+/* Called with a's lock held.  New chunks are stamped with epoch. */
+static void *take_slot(typed_arena *a, unsigned int epoch)
+{
+  void *slot = a->free;
+  if (slot) {
+    a->free = SLOT_NEXT(slot);
+    return slot;
+  }
+  typed_chunk *c = a->chunks;
+  if (!c || c->epoch != epoch || c->carved == c->cap) {
+    size_t cap = CHUNK_BYTES / a->stride;
+    if (cap < 16)
+      cap = 16;
+    c = malloc(ROUND_UP(sizeof(typed_chunk)) + cap * a->stride);
+    if (!c)
+      return NULL;
+    c->epoch = epoch;
+    c->carved = 0;
+    c->cap = cap;
+    c->next = a->chunks;
+    a->chunks = c;
+  }
+  return CHUNK_SLOTS(c) + c->carved++ * a->stride;
+}
+
+/*
+ * Allocate size bytes of an object of the given type (any name the program
+ * uses consistently, e.g. "struct node").  Objects larger than the first one
+ * this version allocated as type (arrays, say) do not fit its slots, and come
+ * from kitsune_malloc instead.
+ */
+void * kitsune_malloc_typed(int size, const char *type)
+{
+  void *caller = __builtin_return_address(0);
+  if (!type || size < 0 || !typed_arenas)
+    return alloctrack_place(malloc(ALLOC_HEADER_SIZE + size), size, NULL, caller);
+  typed_arena *a = arena_for(type, size);
+  if ((size_t)size > a->size)
+    return alloctrack_place(malloc(ALLOC_HEADER_SIZE + size), size, NULL, caller);
+
+  ARENA_LOCK(a);
+  void *slot = take_slot(a, typed_arenas->epoch);
+  ARENA_UNLOCK(a);
+  return alloctrack_place(slot, size, a, caller);
+}
+
+/*
+ * For the pre-copy, which runs in the next version before that version has
+ * set up its allocator, and so asks the running one: a block of size bytes
+ * for the copy of obj, if obj came from kitsune_malloc_typed, or else NULL.
+ * It comes from an arena kept aside for the next version, in chunks of that
+ * version's epoch, so that its sweeps take the copy for one of its own
+ * objects; typedheap_init hands the arena over when the version starts.
+ */
+void *typedheap_precopy_malloc(void *obj, size_t size)
+{
+  typed_arena *owner = alloctrack_owner(obj), *a;
+  if (!owner || !typed_arenas)
+    return NULL;
+#ifdef ENABLE_THREADING
+  pthread_mutex_lock(&arenas_lock);
+#endif
+  HASH_FIND_STR(typed_arenas->pending, owner->type, a);
+  if (!a) {
+    a = arena_new(owner->type, size, typed_arenas->epoch + 1);
+    HASH_ADD_KEYPTR(hh, typed_arenas->pending, a->type, strlen(a->type), a);
+  }
+#ifdef ENABLE_THREADING
+  pthread_mutex_unlock(&arenas_lock);
+#endif
+  if (size > a->size)
+    return NULL;
+
+  ARENA_LOCK(a);
+  void *slot = take_slot(a, a->epoch);
+  ARENA_UNLOCK(a);
+  return alloctrack_place(slot, size, a, __builtin_return_address(0));
+}
+
+/* The type the arena owner holds. */
+const char *typedheap_type(void *owner)
+{
+  return ((typed_arena *)owner)->type;
+}
+
+/* kitsune_free is done with a block from kitsune_malloc_typed. */
+void typedheap_release(void *owner, void *slot)
+{
+  typed_arena *a = owner;
+  ARENA_LOCK(a);
+  SLOT_NEXT(slot) = a->free;
+  a->free = slot;
+  ARENA_UNLOCK(a);
+}
+
+typedef struct {
+  size_t n, batch;
+  size_t next;                  /* the first index not yet claimed */
+  void (*fn)(size_t i, void *arg);
+  void *arg;
+} parallel_loop;
+
+static void *parallel_worker(void *arg)
+{
+  parallel_loop *l = arg;
+  size_t i, end;
+
+  while ((i = __atomic_fetch_add(&l->next, l->batch, __ATOMIC_RELAXED)) < l->n) {
+    end = i + l->batch < l->n ? i + l->batch : l->n;
+    for (; i < end; i++)
+      l->fn(i, l->arg);
+  }
+  return NULL;
+}
+
+/* Call fn on each of 0 .. n-1, handing them out batch at a time to as many
+   threads as there are processors (up to a limit), this one included.
+   Without threading, this is a plain loop. */
+void typedheap_parallel(size_t n, size_t batch, void (*fn)(size_t i, void *arg), void *arg)
+{
+  parallel_loop l = { n, batch ? batch : 1, 0, fn, arg };
+#ifdef ENABLE_THREADING
+  pthread_t threads[SWEEP_MAX_THREADS];
+  long i, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > SWEEP_MAX_THREADS)
+    nthreads = SWEEP_MAX_THREADS;
+  if ((size_t)nthreads > (n + l.batch - 1) / l.batch)
+    nthreads = (n + l.batch - 1) / l.batch;
+  for (i = 1; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, parallel_worker, &l))
+      break;
+  nthreads = i;
+  parallel_worker(&l);
+  for (i = 1; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+#else
+  parallel_worker(&l);
+#endif
+}
+
+static typed_arena *arena_find(const char *type)
+{
+  typed_arena *a = NULL;
+  if (!typed_arenas)
+    return NULL;
+#ifdef ENABLE_THREADING
+  pthread_mutex_lock(&arenas_lock);
+#endif
+  HASH_FIND_STR(typed_arenas->arenas, type, a);
+#ifdef ENABLE_THREADING
+  pthread_mutex_unlock(&arenas_lock);
+#endif
+  return a;
+}
+
+/* Slots in the chunks a sweep of type would visit: at least as many as the
+   objects it would find. */
+size_t typedheap_count(const char *type)
+{
+  typed_arena *a;
+  typed_chunk *c;
+  size_t slots = 0;
+  for (a = arena_find(type); a; a = a->older) {
+    ARENA_LOCK(a);
+    for (c = a->chunks; c; c = c->next)
+      if (c->epoch != typed_arenas->epoch)
+        slots += c->carved;
+    ARENA_UNLOCK(a);
+  }
+  return slots;
+}
+
+typedef struct {
+  typed_chunk *chunk;
+  size_t stride;                /* its arena's */
+} sweep_chunk_ref;
+
+typedef struct {
+  sweep_chunk_ref *chunks;
+  size_t visited;
+  void (*fn)(void *obj, void *arg);
+  void *arg;
+} sweep;
+
+static void sweep_chunk(size_t i, void *arg)
+{
+  sweep *s = arg;
+  typed_chunk *c = s->chunks[i].chunk;
+  size_t stride = s->chunks[i].stride, visited = 0;
+  char *slot = CHUNK_SLOTS(c), *end = slot + c->carved * stride;
+
+  for (; slot < end; slot += stride) {
+    __builtin_prefetch(slot + 4 * stride);
+    void *obj = slot + ALLOC_HEADER_SIZE;
+    if (alloctrack_block_at(obj)) {
+      s->fn(obj, s->arg);
+      visited++;
+    }
+  }
+  __atomic_add_fetch(&s->visited, visited, __ATOMIC_RELAXED);
+}
+
+/*
+ * Call fn on every live object of type that was allocated before the current
+ * version started, in address order within each chunk.  With threading, the
+ * chunks are shared out among several threads, so fn must be thread-safe.
+ * Returns the number of objects fn was called on.
+ */
+size_t typedheap_sweep(const char *type, void (*fn)(void *obj, void *arg), void *arg)
+{
+  typed_arena *newest = arena_find(type), *a;
+  typed_chunk *c;
+  size_t nchunks = 0;
+  sweep s = { NULL, 0, fn, arg };
+
+  if (!newest)
+    return 0;
+  /* Chunks carved from now on (for fn's new objects, say) are not visited,
+     nor is an arena made for them. */
+  for (a = newest; a; a = a->older) {
+    ARENA_LOCK(a);
+    for (c = a->chunks; c; c = c->next)
+      if (c->epoch != typed_arenas->epoch)
+        nchunks++;
+    ARENA_UNLOCK(a);
+  }
+  s.chunks = malloc(sizeof(sweep_chunk_ref) * (nchunks + 1));
+  nchunks = 0;
+  for (a = newest; a; a = a->older) {
+    ARENA_LOCK(a);
+    for (c = a->chunks; c; c = c->next) {
+      if (c->epoch != typed_arenas->epoch) {
+        s.chunks[nchunks].chunk = c;
+        s.chunks[nchunks++].stride = a->stride;
+      }
+    }
+    ARENA_UNLOCK(a);
+  }
+
+  typedheap_parallel(nchunks, 1, sweep_chunk, &s);
+  free(s.chunks);
+  return s.visited;
+}
+
+/* The update has committed (or been rolled back): the slots freed before it
+   can be reused. */
+void typedheap_commit(void)
+{
+  typed_arena *newest, *tmp, *a;
+  if (!typed_arenas)
+    return;
+  HASH_ITER(hh, typed_arenas->arenas, newest, tmp) {
+    for (a = newest; a; a = a->older) {
+      ARENA_LOCK(a);
+      while (a->held) {
+        void *slot = a->held;
+        a->held = SLOT_NEXT(slot);
+        SLOT_NEXT(slot) = a->free;
+        a->free = slot;
+      }
+      ARENA_UNLOCK(a);
+    }
+  }
+}
+
+/* init should be called during startup, before anything is transformed */
+void typedheap_init(void)
+{
+  typed_arena *newest, *tmp, *a;
+
+  if (kitsune_is_updating()) {
+    typed_heap **prev = kitsune_get_val("typed_arenas");
+    if (prev && *prev)
+      typed_arenas = *prev;
+  }
+  if (!typed_arenas) {
+    typed_arenas = calloc(1, sizeof(typed_heap));
+    return;
+  }
+  if (kitsune_is_rolling_back()) {
+    typedheap_commit();
+    return;
+  }
+  if (!kitsune_is_updating())
+    return;
+
+  typed_arenas->epoch++;
+  HASH_ITER(hh, typed_arenas->arenas, newest, tmp) {
+    for (a = newest; a; a = a->older) {
+      while (a->free) {
+        void *slot = a->free;
+        a->free = SLOT_NEXT(slot);
+        SLOT_NEXT(slot) = a->held;
+        a->held = slot;
+      }
+    }
+  }
+  /* The arenas a pre-copy filled for this version become the newest. */
+  HASH_ITER(hh, typed_arenas->pending, a, tmp) {
+    HASH_DEL(typed_arenas->pending, a);
+    HASH_FIND_STR(typed_arenas->arenas, a->type, newest);
+    if (newest)
+      HASH_DEL(typed_arenas->arenas, newest);
+    a->older = newest;
+    HASH_ADD_KEYPTR(hh, typed_arenas->arenas, a->type, strlen(a->type), a);
+  }
+}
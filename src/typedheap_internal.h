@@ -0,0 +1,16 @@
+#ifndef TYPEDHEAP_INTERNAL_H
+#define TYPEDHEAP_INTERNAL_H
+
+#include <stddef.h>
+
+void typedheap_init(void);
+void typedheap_commit(void);
+
+const char *typedheap_type(void *owner);
+void typedheap_release(void *owner, void *slot);
+void *typedheap_precopy_malloc(void *obj, size_t size);
+size_t typedheap_count(const char *type);
+size_t typedheap_sweep(const char *type, void (*fn)(void *obj, void *arg), void *arg);
+void typedheap_parallel(size_t n, size_t batch, void (*fn)(size_t i, void *arg), void *arg);
+
+#endif
@@ -1,177 +1,282 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
-#include <assert.h>
-
-#include <interval.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "kitsune_internal.h"
 #include "vmareas_internal.h"
 
+#ifdef ENABLE_THREADING
+#include <pthread.h>
+
+/* Serializes building the index; lookups only read a published one. */
+static pthread_mutex_t vmareas_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 enum { READ_ATTR = 1, WRITE_ATTR = 2, EXEC_ATTR = 4 };
 typedef unsigned char attr_type;
 
 typedef struct mem_area {
-  void *start;
-  void *end;
+  uintptr_t start;
+  uintptr_t end;
   attr_type attr;
   vmarea_type type;
-  char *label;
+  char *label;                  /* points into the index's copy of the maps */
 } mem_area;
 
+/*
+ * The index is a snapshot of /proc/self/maps: the file's text, read in one
+ * go, and an array of its areas, in the address order the kernel lists them
+ * in.  Labels are NUL-terminated in place rather than copied.  An index is
+ * never changed once published: a refresh publishes a new one and keeps the
+ * old one (whose areas a caller may still hold) until vmareas_free.
+ */
+typedef struct vmareas_index {
+  char *text;
+  size_t len;
+  mem_area *areas;
+  size_t count;
+  struct vmareas_index *retired;
+} vmareas_index;
+
+static vmareas_index *cur_index = NULL;
+
 char *vmareas_to_str(vmarea *a) {
   mem_area *ma = (mem_area *)a;
+  char *result;
+  if (!ma)
+    return strdup("(unmapped)");
   char *r = ma->attr & READ_ATTR ? "r" : "";
   char *w = ma->attr & WRITE_ATTR ? "w" : "";
   char *x = ma->attr & EXEC_ATTR ? "x" : "";
-  char *result;
-  asprintf(&result, "%s [%s%s%s]", ma->label, r, w, x);
+  if (asprintf(&result, "%s [%s%s%s]", ma->label, r, w, x) < 0)
+    return NULL;
   return result;
 }
 int vmareas_get_readable(vmarea *a) {
-  return ((mem_area *)a)->attr & READ_ATTR;
+  return a && ((mem_area *)a)->attr & READ_ATTR;
 }
 int vmareas_get_writable(vmarea *a) {
-  return ((mem_area *)a)->attr & WRITE_ATTR;
+  return a && ((mem_area *)a)->attr & WRITE_ATTR;
 }
 int vmareas_get_executable(vmarea *a) {
-  return ((mem_area *)a)->attr & EXEC_ATTR;
+  return a && ((mem_area *)a)->attr & EXEC_ATTR;
 }
 char *vmareas_get_label(vmarea *a) {
-  return ((mem_area *)a)->label;
+  return a ? ((mem_area *)a)->label : NULL;
 }
-vmarea_type vmareas_get_type(vmarea *a) {
-  return ((mem_area *)a)->type;
-}
-
-static void *area_start(void *r) {
-  return ((mem_area *)r)->start;
+void *vmareas_get_start(vmarea *a) {
+  return a ? (void *)((mem_area *)a)->start : NULL;
 }
-static void *area_end(void *r) {
-  return ((mem_area *)r)->end;
+void *vmareas_get_end(vmarea *a) {
+  return a ? (void *)((mem_area *)a)->end : NULL;
 }
-static int addr_compare(void *p0, void *p1)
-{
-  /* Strictly speaking, we shouldn't be comparing pointers that might point to
-     arbitary addresses (e.g., not in the same array). :) */
-  ptrdiff_t diff = p0 - p1;
-  if (diff == 0)
-    return 0;
-  else if (diff > 0)
-    return 1;
-  else
-    return -1;
+vmarea_type vmareas_get_type(vmarea *a) {
+  return a ? ((mem_area *)a)->type : UNMAPPED;
 }
 
-interval_tree memory_areas;
-
-static void vmareas_add(void *start_addr, void *end_addr, unsigned char attr, char *label)
+vmarea_type vmareas_classify(const char *label)
 {
-  mem_area *new_area = malloc(sizeof(mem_area));
-
-  if (strcmp("[heap]", label) == 0) {
-    new_area->type = HEAP;  
-  } else if (strcmp("[stack]", label) == 0) {
-    new_area->type = STACK;
-  } else if (strstr(".so", label) != NULL) {
-    new_area->type = LIBRARY;
-  } else {
-    new_area->type = OTHER;
-  }
-
-  new_area->attr = attr;
-  new_area->start = start_addr;
-  new_area->end = end_addr;
-  new_area->label = label;
-  interval_tree_insert(&memory_areas, new_area);
+  if (strcmp("[heap]", label) == 0)
+    return HEAP;
+  /* older kernels label thread stacks [stack:TID] */
+  if (strncmp("[stack", label, 6) == 0)
+    return STACK;
+  /* libfoo.so, libfoo.so.6 or "libfoo.so (deleted)", but not libfoo.sock */
+  const char *so = strstr(label, ".so");
+  if (so && (so[3] == '\0' || so[3] == '.' || so[3] == ' '))
+    return LIBRARY;
+  return OTHER;
 }
 
+/* Read all of /proc/self/maps.  The kernel produces it a page or so per
+   read, so this reads into one buffer until EOF rather than line by line. */
+static char *read_maps(size_t *lenp)
+{
+  size_t cap = 64 * 1024, len = 0;
+  char *text = malloc(cap);
+  int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  kitsune_assert(fd >= 0, "Unable to open: /proc/self/maps");
 
-vmarea *vmareas_lookup(void *addr) 
-{  
-  mem_area query;
-  query.start = query.end = addr;
-  return (vmarea *)interval_tree_lookup(&memory_areas, &query);
+  for (;;) {
+    if (cap - len < 4096) {
+      cap *= 2;
+      text = realloc(text, cap);
+    }
+    ssize_t n = read(fd, text + len, cap - len - 1);
+    if (n <= 0)
+      break;
+    len += n;
+  }
+  close(fd);
+  text[len] = '\0';
+  *lenp = len;
+  return text;
 }
 
-static size_t parse_addr(char *buf, size_t pos, size_t max, unsigned long *addrp) {
-  unsigned long result = 0;
-  size_t p = pos;
-  while (p < max) {
-    char c = buf[p];
+static const char *parse_addr(const char *p, uintptr_t *addrp)
+{
+  uintptr_t result = 0;
+  const char *start = p;
+  for (;; p++) {
+    char c = *p;
     if (c >= '0' && c <= '9')
       result = (result << 4) + (c - '0');
     else if (c >= 'a' && c <= 'f')
       result = (result << 4) + 10 + (c - 'a');
     else
       break;
-    p++;
   }
-  kitsune_assert(pos != p, "Failed to parse vm area line address.");
+  kitsune_assert(p != start, "Failed to parse vm area line address.");
   *addrp = result;
   return p;
 }
 
-static size_t skip_chars(char *buf, size_t pos, size_t max, int skip_spaces) {
+/* Parse text (which the index takes over) in place. */
+static vmareas_index *index_build(char *text, size_t len)
+{
+  vmareas_index *idx = calloc(1, sizeof(vmareas_index));
+  size_t lines = 0;
+  char *p;
+
+  for (p = text; (p = memchr(p, '\n', text + len - p)); p++)
+    lines++;
+  idx->text = text;
+  idx->len = len;
+  idx->areas = malloc(sizeof(mem_area) * (lines + 1));
+
+  char *line = text;
+  while (line < text + len) {
+    char *eol = memchr(line, '\n', text + len - line);
+    if (!eol)
+      eol = text + len;
+    *eol = '\0';
+
+    mem_area *a = &idx->areas[idx->count++];
+    const char *q = parse_addr(line, &a->start);
+    kitsune_assert(*q == '-', "Malformed /proc/self/maps line: %s", line);
+    q = parse_addr(q + 1, &a->end);
+    kitsune_assert(*q == ' ' && q + 5 <= eol, "Malformed /proc/self/maps line: %s", line);
+    q++;
+    a->attr = (q[0] == 'r' ? READ_ATTR : 0) | (q[1] == 'w' ? WRITE_ATTR : 0) |
+      (q[2] == 'x' ? EXEC_ATTR : 0);
+    /* skip the permissions, offset, device and inode fields */
+    int field;
+    for (field = 0; field < 4; field++) {
+      while (q < eol && *q != ' ')
+        q++;
+      while (q < eol && *q == ' ')
+        q++;
+    }
+    a->label = (char *)q;
+    a->type = vmareas_classify(a->label);
+    line = eol + 1;
+  }
+  return idx;
+}
 
-  while (pos < max && 
-         ((skip_spaces && buf[pos] == ' ') ||
-          (!skip_spaces && buf[pos] != ' ')))
-    pos++;
-  return pos;
+static mem_area *index_find(vmareas_index *idx, uintptr_t addr)
+{
+  size_t lo = 0, hi = idx->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    mem_area *a = &idx->areas[mid];
+    if (addr < a->start)
+      hi = mid;
+    else if (addr >= a->end)
+      lo = mid + 1;
+    else
+      return a;
+  }
+  return NULL;
 }
 
-void vmareas_parse(void) 
+/* Re-read the maps, reparsing them only if they changed since idx (which may
+   be NULL) was built.  Returns the index to use. */
+static vmareas_index *vmareas_refresh(vmareas_index *seen)
 {
-  FILE *fp = fopen("/proc/self/maps", "r");
-  kitsune_assert(fp != NULL, "Unable to open: /proc/self/maps");
-
-  char line[LINE_MAX];
-  while (fgets(line, LINE_MAX, fp) != NULL) {
-    unsigned long start_addr, end_addr;
-    attr_type attr = 0;
-    size_t pos = 0;
-    size_t len = strlen(line);
-    line[len-1] = 0;
-
-    char *label;
-
-    pos = parse_addr(line, pos, len, &start_addr);
-    assert(line[pos] == '-');
-    pos++;
-    pos = parse_addr(line, pos, len, &end_addr);
-    assert(line[pos] == ' ');
-    pos++;
-    assert(pos+4 <= len);
-    if (line[pos++] == 'r') attr |= READ_ATTR; 
-    if (line[pos++] == 'w') attr |= WRITE_ATTR;
-    if (line[pos++] == 'x') attr |= EXEC_ATTR;
-    pos += 2;
-    pos = skip_chars(line, pos, len, 0);
-    pos++;
-    pos = skip_chars(line, pos, len, 0);
-    pos++;
-    pos = skip_chars(line, pos, len, 0);
-    pos = skip_chars(line, pos, len, 1);
-    label = &line[pos];
-    vmareas_add((void *)start_addr, (void *)end_addr, attr, strdup(label)); 
+#ifdef ENABLE_THREADING
+  pthread_mutex_lock(&vmareas_lock);
+#endif
+  vmareas_index *idx = cur_index;
+  /* someone else refreshed while we waited */
+  if (idx && idx != seen)
+    goto out;
+
+  size_t len;
+  char *text = read_maps(&len);
+  if (idx && idx->len == len && memcmp(idx->text, text, len) == 0) {
+    free(text);
+    goto out;
   }
-  
-  fclose(fp);
+  vmareas_index *fresh = index_build(text, len);
+  fresh->retired = idx;
+  __atomic_store_n(&cur_index, fresh, __ATOMIC_RELEASE);
+  idx = fresh;
+ out:
+#ifdef ENABLE_THREADING
+  pthread_mutex_unlock(&vmareas_lock);
+#endif
+  return idx;
+}
+
+/* Whether addr's page is mapped now: mincore fails with ENOMEM only for
+   unmapped memory, which is cheaper to find out than re-reading the maps. */
+static int page_mapped(void *addr)
+{
+  static long page_size = 0;
+  unsigned char vec;
+  if (!page_size)
+    page_size = sysconf(_SC_PAGESIZE);
+  void *page = (void *)((uintptr_t)addr & ~(uintptr_t)(page_size - 1));
+  return mincore(page, 1, &vec) == 0 || errno != ENOMEM;
+}
+
+/*
+ * The index is built on the first lookup, and refreshed when an address is
+ * not found in it but is mapped now (e.g., by an allocation mmapped since).
+ * Addresses that are still unmapped, such as dangling pointers, miss without
+ * the maps being read again.  An area returned here stays valid until
+ * vmareas_free.
+ */
+vmarea *vmareas_lookup(void *addr)
+{
+  vmareas_index *idx = __atomic_load_n(&cur_index, __ATOMIC_ACQUIRE);
+  mem_area *a = NULL;
+
+  if (idx) {
+    a = index_find(idx, (uintptr_t)addr);
+    if (!a && !page_mapped(addr))
+      return NULL;
+  }
+  if (!a)
+    a = index_find(vmareas_refresh(idx), (uintptr_t)addr);
+  return (vmarea *)a;
 }
 
 /* clear should be called once we reach the target update point */
 void vmareas_free(void)
 {
-  interval_tree_free(&memory_areas);
+  vmareas_index *idx = cur_index;
+  while (idx) {
+    vmareas_index *next = idx->retired;
+    free(idx->text);
+    free(idx->areas);
+    free(idx);
+    idx = next;
+  }
+  cur_index = NULL;
 }
 
-/* init should be called during startup */
+/* init should be called during startup; the maps are only read once they are
+   first needed. */
 void vmareas_init(void)
 {
-  interval_tree_init(&memory_areas, area_start, area_end, addr_compare);
-  vmareas_parse();
+  vmareas_free();
 }
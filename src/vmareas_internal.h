@@ -11,11 +11,14 @@ void vmareas_free(void);
 void vmareas_init(void);
 
 vmarea *vmareas_lookup(void *addr);
+vmarea_type vmareas_classify(const char *label);
 
 int vmareas_get_readable(vmarea *);
 int vmareas_get_writable(vmarea *);
 int vmareas_get_executable(vmarea *);
 char *vmareas_get_label(vmarea *);
+void *vmareas_get_start(vmarea *);
+void *vmareas_get_end(vmarea *);
 vmarea_type vmareas_get_type(vmarea *);
 char *vmareas_to_str(vmarea *a);
 
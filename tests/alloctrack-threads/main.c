@@ -0,0 +1,67 @@
+/*
+ * Several threads allocate and free tracked memory at once; after the update
+ * the new version finds each surviving block from a pointer into its middle
+ * and frees it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <kitsune.h>
+#include <assert.h>
+#include "../../src/alloctrack_internal.h"
+
+#define THREADS 4
+#define BLOCKS 2000
+
+char *blocks[THREADS][BLOCKS];
+
+static void *allocate(void *arg)
+{
+  char **mine = arg;
+  int i;
+
+  for (i = 0; i < BLOCKS; i++) {
+    mine[i] = kitsune_malloc(16 + i % 300);
+    memset(mine[i], i & 0xff, 16 + i % 300);
+  }
+  /* free every other block, while the other threads are still allocating */
+  for (i = 0; i < BLOCKS; i += 2) {
+    kitsune_free(mine[i]);
+    mine[i] = NULL;
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[THREADS];
+  int t, i;
+
+  if (!kitsune_is_updating()) {
+    for (t = 0; t < THREADS; t++)
+      pthread_create(&threads[t], NULL, allocate, blocks[t]);
+    for (t = 0; t < THREADS; t++)
+      pthread_join(threads[t], NULL);
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+  } else {
+    memcpy(blocks, kitsune_get_val("blocks"), sizeof(blocks));
+    for (t = 0; t < THREADS; t++) {
+      for (i = 0; i < BLOCKS; i++) {
+        if (!blocks[t][i])
+          continue;
+        alarea *a = alloctrack_lookup(blocks[t][i] + 10);
+        assert(a && alareas_get_start(a) == blocks[t][i]);
+        assert(blocks[t][i][10] == (char)(i & 0xff));
+        kitsune_free(blocks[t][i]);
+        assert(alloctrack_lookup(blocks[t][i] + 10) == NULL);
+      }
+    }
+    printf("Sucesss...\n");
+    return 0;
+  }
+
+  kitsune_update("test");
+  return 1;
+}
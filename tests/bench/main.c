@@ -0,0 +1,58 @@
+/*
+ * With the driver's -b FILE, each update appends its phase timings and
+ * resource usage to FILE: a row per phase and one for the whole update.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kitsune.h>
+#include <assert.h>
+
+char *ballast;
+
+int main(int argc, char **argv)
+{
+  static const char *phases[] = {
+    "quiesce", "load", "migrate", "restart", "teardown", "total"
+  };
+  char line[256], phase[32];
+  double ms, total = 0;
+  long minflt, majflt, nvcsw, nivcsw;
+  int update, rows = 0;
+
+  if (!kitsune_is_updating()) {
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+    kitsune_update("test");
+    return 1;
+  }
+
+  /* restart: fault some pages in */
+  ballast = malloc(1 << 22);
+  memset(ballast, 1, 1 << 22);
+  /* the update is done, and its row written, once we get here */
+  kitsune_update("test");
+
+  FILE *results = fopen("bench.csv", "r");
+  assert(results);
+  assert(fgets(line, sizeof(line), results));
+  assert(strcmp(line, "update,phase,ms,minflt,majflt,nvcsw,nivcsw\n") == 0);
+  while (fgets(line, sizeof(line), results)) {
+    printf("%s", line);
+    assert(sscanf(line, "%d,%31[a-z],%lf,%ld,%ld,%ld,%ld", &update, phase, &ms,
+                  &minflt, &majflt, &nvcsw, &nivcsw) == 7);
+    assert(update == 1 && strcmp(phase, phases[rows]) == 0);
+    assert(ms >= 0 && minflt >= 0 && majflt >= 0 && nvcsw >= 0 && nivcsw >= 0);
+    if (strcmp(phase, "restart") == 0)
+      assert(minflt >= 1000);   /* 4MB touched */
+    if (strcmp(phase, "total") != 0)
+      total += ms;
+    else
+      assert(ms > 0 && ms - total < 0.001 && total - ms < 0.001);
+    rows++;
+  }
+  fclose(results);
+  assert(rows == 6);
+  printf("Sucesss...\n");
+  return 0;
+}
@@ -0,0 +1,100 @@
+/*
+ * Blocks are charged to the code that allocated them and to their type, and
+ * the charges carry over an update: the new version frees some of the old
+ * version's blocks and finds its census reduced by just those.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kitsune.h>
+#include <assert.h>
+#include "../../src/alloctrack_internal.h"
+
+struct pair {
+  long a, b;
+};
+
+void *big[10];
+void *small[5];
+void *pairs[8];
+
+/* Not static, so that the census can name them. */
+void *alloc_big(void)
+{
+  return kitsune_malloc(100);
+}
+
+void *alloc_small(void)
+{
+  return kitsune_malloc(40);
+}
+
+/* The census line starting with prefix and naming where (if not NULL). */
+static int census_has(const char *census, const char *prefix, const char *where)
+{
+  const char *line;
+  for (line = census; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+    const char *eol = strchr(line, '\n');
+    size_t len = eol ? (size_t)(eol - line) : strlen(line);
+    if (strncmp(line, prefix, strlen(prefix)) != 0)
+      continue;
+    if (!where || memmem(line, len, where, strlen(where)))
+      return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char *census;
+  int i;
+
+  if (!kitsune_is_updating()) {
+    census = kitsune_heap_census();
+    assert(strncmp(census, "recording off\n", 14) == 0);
+    free(census);
+
+    kitsune_alloc_sites(1);
+    for (i = 0; i < 10; i++)
+      big[i] = alloc_big();
+    for (i = 0; i < 5; i++)
+      small[i] = alloc_small();
+    for (i = 0; i < 8; i++)
+      pairs[i] = kitsune_malloc_typed(sizeof(struct pair), "struct pair");
+
+    census = kitsune_heap_census();
+    printf("%s", census);
+    assert(census_has(census, "total 23 1328\n", NULL));
+    assert(census_has(census, "type 15 1200 -\n", NULL));
+    assert(census_has(census, "type 8 128 struct pair\n", NULL));
+    assert(census_has(census, "site 10 1000 - ", "alloc_big"));
+    assert(census_has(census, "site 5 200 - ", "alloc_small"));
+    assert(census_has(census, "site 8 128 struct pair ", "main"));
+    free(census);
+
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+  } else {
+    void **old_big = kitsune_get_val("big");
+    void **old_pairs = kitsune_get_val("pairs");
+    for (i = 0; i < 4; i++)
+      kitsune_free(old_big[i]);
+    for (i = 0; i < 8; i++)
+      kitsune_free(old_pairs[i]);
+
+    census = kitsune_heap_census();
+    printf("%s", census);
+    assert(census_has(census, "total 11 800\n", NULL));
+    assert(census_has(census, "site 6 600 - ", "alloc_big"));
+    /* a site with nothing live is left out */
+    assert(census_has(census, "type 0 0 struct pair\n", NULL));
+    assert(!census_has(census, "site ", "struct pair"));
+    free(census);
+    printf("Sucesss...\n");
+    return 0;
+  }
+
+  kitsune_update("test");
+  return 1;
+}
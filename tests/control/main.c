@@ -0,0 +1,127 @@
+/*
+ * The driver's control socket: malformed commands are refused without
+ * disturbing the process, and an update sent over the socket is taken.  The
+ * next version is preloaded first: status lists it, and the update uses the
+ * copy that was preloaded rather than loading its own.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <kitsune.h>
+#include <assert.h>
+
+static FILE *connect_driver(void)
+{
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/kitsune-%d.sock", getpid());
+  assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  FILE *conn = fdopen(fd, "r+");
+  assert(conn);
+  setvbuf(conn, NULL, _IONBF, 0);
+  return conn;
+}
+
+/* When this copy of the library was loaded, and (in the first version) when
+   the update was asked for. */
+static uint64_t loaded_ns;
+uint64_t update_sent_ns;
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+__attribute__((constructor)) static void note_load(void)
+{
+  loaded_ns = now_ns();
+}
+
+/* Send cmd and return the line that ends its reply ("ok" or "error ..."). */
+static char *command(FILE *conn, const char *cmd, char *line, int size)
+{
+  fprintf(conn, "%s\n", cmd);
+  while (fgets(line, size, conn)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strcmp(line, "ok") == 0 || strncmp(line, "error ", 6) == 0)
+      return line;
+  }
+  assert(!"connection closed");
+  return NULL;
+}
+
+/* Whether the reply to status has line in it. */
+static int status_has(FILE *conn, const char *want)
+{
+  char line[512];
+  int found = 0;
+  fprintf(conn, "status\n");
+  while (fgets(line, sizeof(line), conn)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strcmp(line, want) == 0)
+      found = 1;
+    if (strcmp(line, "ok") == 0)
+      return found;
+  }
+  assert(!"connection closed");
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char line[512], cmd[512];
+  int status;
+
+  if (!kitsune_is_updating()) {
+    FILE *conn = connect_driver();
+    assert(strcmp(command(conn, "update ", line, sizeof(line)),
+                  "error update needs a library path") == 0);
+    assert(strcmp(command(conn, "update    ", line, sizeof(line)),
+                  "error update needs a library path") == 0);
+    assert(strcmp(command(conn, "update", line, sizeof(line)),
+                  "error update needs a library path") == 0);
+    assert(strcmp(command(conn, "update relative.so", line, sizeof(line)),
+                  "error library paths must be absolute") == 0);
+    assert(strcmp(command(conn, "status", line, sizeof(line)), "ok") == 0);
+
+    snprintf(cmd, sizeof(cmd), "preload %s", argv[1]);
+    assert(strcmp(command(conn, cmd, line, sizeof(line)), "ok") == 0);
+    snprintf(cmd, sizeof(cmd), "preloaded %s", argv[1]);
+    assert(status_has(conn, cmd));
+
+    /* now a real one, from a client of our own */
+    update_sent_ns = now_ns();
+    snprintf(cmd, sizeof(cmd), "update %s", argv[1]);
+    if (fork() == 0)
+      _exit(strcmp(command(conn, cmd, line, sizeof(line)), "ok") != 0);
+    fclose(conn);
+    for (;;) {
+      kitsune_update("test");
+      usleep(1000);
+    }
+  }
+
+  /* loaded by the preload, before the update was asked for */
+  assert(loaded_ns < *(uint64_t *)kitsune_get_val("update_sent_ns"));
+  kitsune_update("test");
+  assert(wait(&status) > 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  FILE *conn = connect_driver();
+  snprintf(cmd, sizeof(cmd), "version %s", argv[1]);
+  assert(status_has(conn, cmd));
+  snprintf(cmd, sizeof(cmd), "preloaded %s", argv[1]);
+  assert(!status_has(conn, cmd));
+  printf("Sucesss...\n");
+  return 0;
+}
@@ -0,0 +1,134 @@
+/*
+ * Dry runs over the control socket.  The update is taken in a forked child
+ * while this process carries on in the old version: the reply to a good
+ * version ends in "ok" with the child's phases, and the reply to one that
+ * fails during its startup carries the child's stderr and how it died.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <kitsune.h>
+#include <registervars.h>
+#include <assert.h>
+
+/* Migrated into the dry-run child, which checks it. */
+int loops;
+
+__attribute__((constructor)) static void register_loops(void)
+{
+  kitsune_register_var("loops", NULL, NULL, NULL, &loops, sizeof(loops), 1);
+}
+
+static FILE *connect_driver(void)
+{
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/kitsune-%d.sock", getpid());
+  assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  FILE *conn = fdopen(fd, "r+");
+  assert(conn);
+  setvbuf(conn, NULL, _IONBF, 0);
+  return conn;
+}
+
+/* In a client of our own, send "dryrun path" and exit 0 if the reply ends in
+   want and has lines containing each of has (NULL-terminated).  The
+   dry run is taken at the update points this loop keeps passing; the number
+   of them passed meanwhile is returned. */
+static int dry_run(const char *path, const char *want, const char **has)
+{
+  char line[512];
+  int status, i, start = loops;
+  FILE *conn = connect_driver();
+  pid_t client = fork();
+
+  if (client == 0) {
+    int seen[8] = { 0 };
+    fprintf(conn, "dryrun %s\n", path);
+    while (fgets(line, sizeof(line), conn)) {
+      line[strcspn(line, "\n")] = '\0';
+      for (i = 0; has[i]; i++)
+        seen[i] |= strstr(line, has[i]) != NULL;
+      if (strcmp(line, "ok") == 0 || strncmp(line, "error ", 6) == 0) {
+        if (strcmp(line, want) != 0) {
+          fprintf(stderr, "dryrun %s: %s\n", path, line);
+          _exit(1);
+        }
+        for (i = 0; has[i]; i++)
+          if (!seen[i]) {
+            fprintf(stderr, "dryrun %s: no \"%s\"\n", path, has[i]);
+            _exit(1);
+          }
+        _exit(0);
+      }
+    }
+    _exit(1);
+  }
+  fclose(conn);
+  /* the dry-run child is ours too, and the driver reaps it */
+  while (waitpid(client, &status, WNOHANG) == 0) {
+    kitsune_update("test");
+    loops++;
+    usleep(1000);
+  }
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  return loops - start;
+}
+
+static int status_has(FILE *conn, const char *want)
+{
+  char line[512];
+  int found = 0;
+  fprintf(conn, "status\n");
+  while (fgets(line, sizeof(line), conn)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strcmp(line, want) == 0)
+      found = 1;
+    if (strcmp(line, "ok") == 0)
+      return found;
+  }
+  assert(!"connection closed");
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char cmd[512];
+
+  if (kitsune_is_updating()) {
+    /* only ever reached in a dry-run child */
+#ifdef BAD_VERSION
+    assert(!"bad version");
+#endif
+    assert(*(int *)kitsune_get_val("loops") > 0);
+    kitsune_do_automigrate();
+    assert(loops > 0);
+    kitsune_update("test");
+    assert(!"the dry-run child resumed");
+  }
+
+  const char *good[] = { "phase quiesced ", "phase done ", NULL };
+  assert(dry_run(argv[1], "ok", good) > 0);
+
+  const char *bad[] = { "bad version", NULL };
+  assert(dry_run(argv[2], "error dry run killed by signal 6", bad) > 0);
+
+  /* neither dry run touched this process */
+  FILE *conn = connect_driver();
+  snprintf(cmd, sizeof(cmd), "version %s", argv[0]);
+  assert(status_has(conn, cmd));
+  assert(status_has(conn, "updates 0"));
+  assert(status_has(conn, "state running"));
+  fclose(conn);
+  loops++;
+  kitsune_update("test");
+  printf("Sucesss...\n");
+  return 0;
+}
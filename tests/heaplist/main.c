@@ -0,0 +1,144 @@
+/*
+ * A heaplist with a million addresses: deleting each takes constant time,
+ * iteration sees every address left exactly once, and the next version can
+ * walk and free the list it inherits.  A second list, of real objects, is
+ * carried over as it is and its elements transformed in the next version.
+ * A third is migrated the way generated code does it, through XF_HEAPLIST.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kitsune.h>
+#include <ktheaptrack.h>
+#include "../../src/alloctrack_internal.h"
+#include <assert.h>
+
+#define ADDRS 1000000
+#define ADDR(i) ((void *)(((long)(i) + 1) * 16))
+#define INDEX(p) ((long)(p) / 16 - 1)
+#define OBJS 1000
+
+kitsune_heaplist *list;
+kitsune_heaplist *objs;
+kitsune_heaplist moved;
+
+static void xf_long(void *in, void *out, int nargs, void **args)
+{
+  *(long *)out = *(long *)in * 10;
+}
+
+/* Check the list holds exactly the addresses i with i % 3 != 0. */
+static void check(kitsune_heaplist *l)
+{
+  static char seen[ADDRS];
+  kitsune_heaplist_iterator *tmp;
+  void *cur;
+  long count = 0;
+
+  memset(seen, 0, sizeof(seen));
+  HEAPLIST_FOR_EACH(l, cur, void *, tmp) {
+    long i = INDEX(cur);
+    assert(i >= 0 && i < ADDRS && i % 3 != 0 && !seen[i]);
+    seen[i] = 1;
+    count++;
+  }
+  assert(count == ADDRS - (ADDRS + 2) / 3);
+}
+
+int main(int argc, char **argv)
+{
+  long i;
+
+  if (!kitsune_is_updating()) {
+    list = malloc(sizeof(kitsune_heaplist));
+    kitsune_heaplist_init(list);
+    assert(kitsune_heaplist_isempty(list));
+    for (i = 0; i < ADDRS; i++)
+      NOTE_HEAP(list, ADDR(i));
+    /* an address noted twice is deleted once at a time */
+    NOTE_HEAP(list, ADDR(7));
+    assert(UNNOTE_HEAP(list, ADDR(7)));
+    for (i = 0; i < ADDRS; i += 3)
+      assert(UNNOTE_HEAP(list, ADDR(i)));
+    assert(!UNNOTE_HEAP(list, ADDR(0)));
+    assert(!UNNOTE_HEAP(list, ADDR(ADDRS)));
+    check(list);
+
+    objs = malloc(sizeof(kitsune_heaplist));
+    kitsune_heaplist_init(objs);
+    for (i = 0; i < OBJS; i++) {
+      long *obj = kitsune_malloc(sizeof(long));
+      *obj = i;
+      NOTE_HEAP(objs, obj);
+    }
+    kitsune_heaplist_init(&moved);
+    for (i = 0; i < OBJS; i++) {
+      long *obj = kitsune_malloc(sizeof(long));
+      *obj = i;
+      NOTE_HEAP(&moved, obj);
+    }
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+  } else {
+    kitsune_heaplist *old = *(kitsune_heaplist **)kitsune_get_val("list");
+    check(old);
+    assert(kitsune_heaplist_last(old) != NULL);
+    /* empty it, then fill it again */
+    for (i = 0; i < ADDRS; i++)
+      UNNOTE_HEAP(old, ADDR(i));
+    assert(kitsune_heaplist_isempty(old));
+    assert(kitsune_heaplist_begin(old) == kitsune_heaplist_end(old));
+    NOTE_HEAP(old, ADDR(1));
+    assert(kitsune_heaplist_begin(old)->addr == ADDR(1));
+    kitsune_heaplist_free(old);
+
+    static long *old_addrs[OBJS];
+    static char seen[OBJS];
+    kitsune_heaplist_iterator *tmp;
+    long *obj, n = 0;
+    objs = *(kitsune_heaplist **)kitsune_get_val("objs");
+    HEAPLIST_FOR_EACH(objs, obj, long *, tmp)
+      old_addrs[n++] = obj;
+    assert(n == OBJS);
+    kitsune_heaplist_transform(objs, XF_LIFT(xf_long, XF_DEEP, sizeof(long), sizeof(long)));
+    n = 0;
+    HEAPLIST_FOR_EACH(objs, obj, long *, tmp) {
+      assert(obj != old_addrs[n] && *obj % 10 == 0);
+      assert(*old_addrs[n] * 10 == *obj && !seen[*obj / 10]);
+      seen[*obj / 10] = 1;
+      n++;
+    }
+    assert(n == OBJS);
+    /* the index follows the new addresses */
+    for (i = 0; i < OBJS; i++)
+      assert(!UNNOTE_HEAP(objs, old_addrs[i]));
+    while (!kitsune_heaplist_isempty(objs))
+      assert(UNNOTE_HEAP(objs, kitsune_heaplist_begin(objs)->addr));
+
+    /* the old list is left as it was, for a rollback */
+    kitsune_heaplist *old_moved = kitsune_get_val("moved");
+    kitsune_heaplist_init(&moved);
+    XF_INVOKE(XF_HEAPLIST(sizeof(kitsune_heaplist),
+                          XF_LIFT(xf_long, XF_DEEP, sizeof(long), sizeof(long))),
+              old_moved, &moved);
+    assert(moved.count == OBJS && old_moved->count == OBJS);
+    n = 0;
+    HEAPLIST_FOR_EACH(old_moved, obj, long *, tmp)
+      old_addrs[n++] = obj;
+    n = 0;
+    HEAPLIST_FOR_EACH(&moved, obj, long *, tmp) {
+      assert(obj != old_addrs[n] && *old_addrs[n] * 10 == *obj);
+      n++;
+    }
+    assert(n == OBJS);
+    for (i = 0; i < OBJS; i++)
+      assert(UNNOTE_HEAP(&moved, old_addrs[i]) == 0);
+    while (!kitsune_heaplist_isempty(&moved))
+      assert(UNNOTE_HEAP(&moved, kitsune_heaplist_begin(&moved)->addr));
+    printf("Sucesss...\n");
+    return 0;
+  }
+
+  kitsune_update("test");
+  return 1;
+}
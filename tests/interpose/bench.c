@@ -0,0 +1,50 @@
+/*
+ * Allocation microbenchmark: each thread keeps a window of blocks of mixed
+ * sizes, replacing a random one at a time.  Built both against glibc's
+ * malloc and with the allocation wrappers (see the Makefile).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define WINDOW 1024
+
+static long ops;
+
+static void *churn(void *arg)
+{
+  void *window[WINDOW] = { 0 };
+  unsigned int seed = (unsigned long)arg;
+  long i;
+
+  for (i = 0; i < ops; i++) {
+    int slot = rand_r(&seed) % WINDOW;
+    free(window[slot]);
+    window[slot] = malloc(16 + rand_r(&seed) % 512);
+  }
+  for (i = 0; i < WINDOW; i++)
+    free(window[i]);
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  int nthreads = argc > 1 ? atoi(argv[1]) : 1, t;
+  pthread_t threads[nthreads];
+  struct timespec start, end;
+
+  ops = argc > 2 ? atol(argv[2]) : 1000000;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (t = 0; t < nthreads; t++)
+    pthread_create(&threads[t], NULL, churn, (void *)(long)(t + 1));
+  for (t = 0; t < nthreads; t++)
+    pthread_join(threads[t], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  /* the threads run side by side, so this is each pair's share of a thread */
+  printf("%s: %d threads, %ld malloc/free pairs each: %.1f ns per pair\n",
+         argv[0], nthreads, ops, ns / ops);
+  return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * A version linked with the allocation wrappers: blocks from malloc, calloc,
+ * realloc and posix_memalign on several threads are recorded, and the next
+ * version still finds the survivors (and can free them).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <kitsune.h>
+#include <assert.h>
+#include "../../src/interpose_internal.h"
+
+#define THREADS 4
+#define BLOCKS 5000
+
+void *blocks[THREADS][BLOCKS];
+size_t sizes[THREADS][BLOCKS];
+
+static void *allocate(void *arg)
+{
+  void **mine = arg;
+  size_t *size = sizes[(mine - blocks[0]) / BLOCKS];
+  int i;
+
+  for (i = 0; i < BLOCKS; i++) {
+    size[i] = 8 + i % 1000;
+    switch (i % 4) {
+    case 0: mine[i] = malloc(size[i]); break;
+    case 1: mine[i] = calloc(1, size[i]); break;
+    case 2: assert(posix_memalign(&mine[i], 64, size[i]) == 0); break;
+    case 3:
+      mine[i] = malloc(4);
+      mine[i] = realloc(mine[i], size[i]);
+      break;
+    }
+  }
+  for (i = 0; i < BLOCKS; i += 2) {
+    free(mine[i]);
+    mine[i] = NULL;
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t threads[THREADS];
+  int t, i;
+  size_t size;
+
+  if (!kitsune_is_updating()) {
+    for (t = 0; t < THREADS; t++)
+      pthread_create(&threads[t], NULL, allocate, blocks[t]);
+    for (t = 0; t < THREADS; t++)
+      pthread_join(threads[t], NULL);
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+  } else {
+    memcpy(blocks, kitsune_get_val("blocks"), sizeof(blocks));
+    memcpy(sizes, kitsune_get_val("sizes"), sizeof(sizes));
+    for (t = 0; t < THREADS; t++) {
+      for (i = 0; i < BLOCKS; i++) {
+        if (!blocks[t][i])
+          continue;
+        assert(interpose_lookup(blocks[t][i], &size) && size == sizes[t][i]);
+        free(blocks[t][i]);
+        assert(!interpose_lookup(blocks[t][i], NULL));
+      }
+    }
+    /* never allocated through the wrappers */
+    assert(!interpose_lookup(&size, NULL));
+    printf("Sucesss...\n");
+    return 0;
+  }
+
+  kitsune_update("test");
+  return 1;
+}
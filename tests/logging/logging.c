@@ -20,6 +20,10 @@ int main(int argc, char *argv[]) {
   if (kitsune_is_updating()) {
     printf("Starting up following update.\n");
     kitsune_log("LOG ENTRY 2");
+    /* the levels came across with the update */
+    char *levels = kitsune_get_log_levels();
+    assert(strstr(levels, "update debug\n") && strstr(levels, "alloc info\n"));
+    free(levels);
 
     /* try to open the logfile */
     substr_ptr = strstr(argv[0], ".so");
@@ -44,6 +48,7 @@ int main(int argc, char *argv[]) {
   } else {
     printf("Starting up normally.\n");
     kitsune_log("LOG ENTRY 1");
+    assert(kitsune_set_log_level("update=debug"));
     kitsune_signal_update();    
     kitsune_set_next_version(strdup(argv[1]));
   }
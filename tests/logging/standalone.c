@@ -11,21 +11,78 @@
 #include <dirent.h>
 #include <errno.h>
 #include <libgen.h>
+#include <pthread.h>
 
 #include <kitsune.h>
 #include "../../src/log_internal.h"
 
+#define THREADS 4
+#define MESSAGES 20000
+
+/* Enough messages to fill each thread's ring several times over. */
+static void *logger(void *arg) {
+  int id = (int)(long)arg, i;
+  for (i = 0; i < MESSAGES; i++)
+    kitsune_log("thread %d message %d %s %5.2f %%", id, i, "copied", i / 4.0);
+  return NULL;
+}
+
 int main(int argc, char *argv[]) {
+  pthread_t threads[THREADS];
+  char line[1024], name[16], longest[1000];
+  char unterminated[4] = { 'a', 'b', 'c', 'd' };
+  int i, count = 0;
+
   assert(kitsune_logging_init(argv[0]) == 1);
 
   kitsune_log("Test log entry");
+  for (i = 0; i < THREADS; i++)
+    assert(pthread_create(&threads[i], NULL, logger, (void *)(long)i) == 0);
+  for (i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+  strcpy(name, "on stack");
+  kitsune_log("last: %s %lu %p", name, 1UL << 40, (void *)0x1234);
+  memset(name, 0, sizeof(name));
+  /* only as much of a string as its precision allows is read */
+  kitsune_log("precision: %.*s|%.2s|", 4, unterminated, "xyz");
+  memset(longest, 'x', sizeof(longest) - 1);
+  longest[sizeof(longest) - 1] = '\0';
+  kitsune_log("long: %s|", longest);
+  kitsune_log("wide: %ls|", L"wide");
+
+  assert(!kitsune_set_log_level("loud"));
+  assert(!kitsune_set_log_level("memory=debug"));
+  assert(kitsune_set_log_level("warn,alloc=debug"));
+  kitsune_log_debug(KT_LOG_ALLOC, "alloc debug shown");
+  kitsune_log_debug(KT_LOG_UPDATE, "update debug hidden");
+  kitsune_log_trace(KT_LOG_ALLOC, "alloc trace compiled out");
+  kitsune_log_drain();
 
   char *logname = malloc(sizeof(char) * 128);
   snprintf(logname, sizeof(char) * 128, 
            "/tmp/kitsune/%s.%d", basename(argv[0]), getpid());
   FILE *logfile = fopen(logname, "r");
   assert(logfile);
+  while (fgets(line, sizeof(line), logfile)) {
+    if (strstr(line, "thread 3 message 19999 copied 4999.75 %\n"))
+      count++;
+    if (strstr(line, " message "))
+      count += 2;
+    if (strstr(line, "last: on stack 1099511627776 0x1234\n"))
+      count += 3;
+    if (strstr(line, "[alloc debug] alloc debug shown\n"))
+      count += 5;
+    if (strstr(line, "precision: abcd|xy|\n"))
+      count += 7;
+    if (strstr(line, "long: ") && strlen(strstr(line, "long: ")) == 6 + 512 + 2)
+      count += 11;
+    if (strstr(line, "wide: <bad format>\n"))
+      count += 13;
+    if (strstr(line, "hidden") || strstr(line, "compiled out"))
+      count = -1;
+  }
   fclose(logfile);
+  assert(count == 1 + 2 * THREADS * MESSAGES + 3 + 5 + 7 + 11 + 13);
   
   assert(unlink(logname) == 0);
   printf("Success!\n");
@@ -0,0 +1,73 @@
+/*
+ * A multi-version update over the control socket ("update B C"): each of
+ * the later versions migrates the state once, in order, and the one in the
+ * middle never resumes normal execution.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <kitsune.h>
+#include <assert.h>
+
+/* One digit per version the state has been through. */
+char trail[8] = "1";
+
+static FILE *connect_driver(void)
+{
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/kitsune-%d.sock", getpid());
+  assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  FILE *conn = fdopen(fd, "r+");
+  assert(conn);
+  setvbuf(conn, NULL, _IONBF, 0);
+  return conn;
+}
+
+/* Ask for the update, and exit 0 if it succeeded with both hops done. */
+static void request(FILE *conn, const char *b, const char *c)
+{
+  char line[512];
+  int hops = 0;
+  fprintf(conn, "update %s %s\n", b, c);
+  while (fgets(line, sizeof(line), conn)) {
+    if (strncmp(line, "phase done ", 11) == 0)
+      hops |= strstr(line, " hop 1\n") ? 1 : strstr(line, " hop 2\n") ? 2 : 4;
+    if (strcmp(line, "ok\n") == 0)
+      _exit(hops != 3);
+  }
+  _exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  int status;
+
+  if (!kitsune_is_updating()) {
+    FILE *conn = connect_driver();
+    if (fork() == 0)
+      request(conn, argv[1], argv[2]);
+    fclose(conn);
+    for (;;) {
+      kitsune_update("test");
+      usleep(1000);
+    }
+  }
+
+  strcpy(trail, (char *)kitsune_get_val("trail"));
+  trail[strlen(trail)] = '0' + strlen(trail) + 1;
+  kitsune_update("test");
+  /* only the last version gets past its update point */
+  assert(strcmp(trail, "123") == 0);
+  assert(wait(&status) > 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  printf("Sucesss...\n");
+  return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Pre-copy over the control socket.  The update reuses the copies of the
+ * objects that were not written after the pre-copy, and those copies are
+ * still in the typed arena.  A written object is transformed again, along
+ * with the objects that point at it.  A pre-copy taken from another version
+ * than the one being updated from is thrown away.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <kitsune.h>
+#include <registervars.h>
+#include "../../src/alloctrack_internal.h"
+#include "../../src/typedheap_internal.h"
+#include <assert.h>
+
+#define NODES 4
+
+/* A page or more each, so that a write to one does not dirty the pages of
+   the others (soft-dirty bits are kept per page). */
+struct node {
+  long value;
+  struct node *next;
+  char pad[4096];
+};
+
+struct node *head;
+int generation;
+
+/* This version's copies, in the order they were made. */
+static struct node *made[2 * NODES];
+static int transformed;
+
+static closure *node_xf(void);
+
+static void xf_node(void *in, void *out, int nargs, void **args)
+{
+  struct node *from = in, *to = out;
+  to->value = from->value;
+  made[transformed++] = to;
+  XF_INVOKE(XF_PTR(node_xf()), &from->next, &to->next);
+}
+
+static closure *node_xf(void)
+{
+  return XF_LIFT(xf_node, XF_DEEP, sizeof(struct node), sizeof(struct node));
+}
+
+/* Found by kitsune_get_xform, for the pre-copy and the update alike. */
+void _kitsune_transform_head(void *new_head)
+{
+  XF_INVOKE(XF_PTR(node_xf()), kitsune_get_val("head"), new_head);
+}
+
+__attribute__((constructor)) static void register_head(void)
+{
+  kitsune_register_var("head", NULL, NULL, NULL, &head, sizeof(head), 1);
+}
+
+static FILE *connect_driver(void)
+{
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "/tmp/kitsune-%d.sock", getpid());
+  assert(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+  FILE *conn = fdopen(fd, "r+");
+  assert(conn);
+  setvbuf(conn, NULL, _IONBF, 0);
+  return conn;
+}
+
+/* Pre-copy path, returning how many objects it copied. */
+static int precopy(FILE *conn, const char *path)
+{
+  char line[512];
+  int copied = -1;
+  fprintf(conn, "precopy %s\n", path);
+  while (fgets(line, sizeof(line), conn)) {
+    sscanf(line, "precopy %d", &copied);
+    if (strcmp(line, "ok\n") == 0)
+      return copied;
+    assert(strncmp(line, "error ", 6) != 0);
+  }
+  assert(!"connection closed");
+  return -1;
+}
+
+/* Have a client of our own update to path, and take the update. */
+static void update_to(FILE *conn, const char *path)
+{
+  char line[512];
+  if (fork() == 0) {
+    fprintf(conn, "update %s\n", path);
+    while (fgets(line, sizeof(line), conn))
+      if (strcmp(line, "ok\n") == 0)
+        _exit(0);
+    _exit(1);
+  }
+  fclose(conn);
+  for (;;) {
+    kitsune_update("test");
+    usleep(1000);
+  }
+}
+
+static struct node *nth(int n)
+{
+  struct node *cur = head;
+  while (n--)
+    cur = cur->next;
+  return cur;
+}
+
+int main(int argc, char **argv)
+{
+  int i, status;
+
+  if (!kitsune_is_updating()) {
+    for (i = NODES - 1; i >= 0; i--) {
+      struct node *n = kitsune_malloc_typed(sizeof(struct node), "struct node");
+      n->value = i;
+      n->next = head;
+      head = n;
+    }
+    FILE *conn = connect_driver();
+    assert(precopy(conn, argv[1]) == NODES);
+    /* written after the pre-copy: this copy and those of its parents go */
+    nth(2)->value = 102;
+    update_to(conn, argv[1]);
+  }
+
+  generation = *(int *)kitsune_get_val("generation") + 1;
+  kitsune_do_automigrate();
+  kitsune_update("test");
+  assert(wait(&status) > 0);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  for (i = 0; i < NODES; i++)
+    assert(nth(i)->value == (i == 2 ? 102 : i));
+  assert(nth(NODES - 1)->next == NULL);
+
+  if (generation == 1) {
+    /* the pre-copy made the first four, the update the next three */
+    assert(transformed == NODES + 3);
+    for (i = 0; i < 3; i++)
+      assert(nth(i) == made[NODES + i] && !alloctrack_owner(nth(i)));
+    assert(nth(3) == made[3]);
+    assert(alloctrack_owner(nth(3)) &&
+           strcmp(typedheap_type(alloctrack_owner(nth(3))), "struct node") == 0);
+
+    FILE *conn = connect_driver();
+    assert(precopy(conn, argv[3]) == NODES);
+    update_to(conn, argv[2]);
+  }
+  if (generation == 2) {
+    assert(transformed == NODES);
+    update_to(connect_driver(), argv[3]);
+  }
+
+  /* the pre-copy was taken from generation 1 */
+  assert(transformed == 2 * NODES);
+  for (i = 0; i < NODES; i++) {
+    assert(nth(i) == made[NODES + i]);
+    assert(!alloctrack_block_at(made[i]));
+  }
+  printf("Sucesss...\n");
+  return 0;
+}
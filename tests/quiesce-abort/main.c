@@ -0,0 +1,71 @@
+#include <kitsune.h>
+#include <ktthreads.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+/* A thread keeps away from its update points past the quiescence deadline.
+   The update is then abandoned and both threads carry on in this version.
+   Once the straggler is back at its update point, a second update goes
+   through. */
+
+void *straggler(void *arg);
+
+__attribute__((constructor)) static void register_threads(void)
+{
+  kitsune_register_var("straggler", 0, 0, 0, (void *)straggler, 0, 0);
+}
+
+volatile int stuck = 1;
+volatile int spins = 0;
+int aborted = 0;
+
+void *straggler(void *arg)
+{
+  while (1) {
+    kitsune_update("straggler");
+    /* the kick interrupts the sleep, but not the loop */
+    while (stuck) {
+      spins++;
+      usleep(1000);
+    }
+    usleep(1000);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t t;
+
+  if (!kitsune_is_updating()) {
+    ktthreads_set_quiesce_timeout(50);
+    kitsune_pthread_create(&t, NULL, straggler, NULL);
+    while (spins == 0)
+      usleep(1000);
+
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+    kitsune_update("main");
+    /* still here, in this version: the attempt was abandoned */
+    aborted++;
+    int before = spins;
+    while (spins < before + 10)
+      usleep(1000);
+
+    stuck = 0;
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+    while (1) {
+      kitsune_update("main");
+      usleep(1000);
+    }
+  }
+
+  stuck = 0;
+  assert(*(int *)kitsune_get_val("aborted") == 1);
+  kitsune_update("main");
+  printf("Sucesss...\n");
+  return 0;
+}
@@ -0,0 +1,171 @@
+#include <kitsune.h>
+#include <ktthreads.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../src/alloctrack_internal.h"
+#include <assert.h>
+
+/* Rolling back a threaded update.  The first attempt deep-copies a list of
+   kitsune_malloc'd nodes and then rolls back: this version is re-entered
+   with its own nodes, which the update kept for it, and its thread carries
+   on.  The second attempt transforms an object in place as well, after
+   which kitsune_rollback refuses and the update commits, freeing the old
+   nodes. */
+
+#define NODES 4
+
+struct node {
+  long value;
+  struct node *next;
+};
+
+struct blob {
+  long value;
+};
+
+struct node *head;
+struct blob *shared;
+int attempt = 0;
+volatile int beats = 0;
+
+/* Set by the first version once it has started, so that it can tell being
+   re-entered after a rollback from being the version updated to. */
+static int started = 0;
+static struct node *olds[NODES];
+
+void *worker(void *arg);
+
+static closure *node_xf(void);
+
+static void xf_node(void *in, void *out, int nargs, void **args)
+{
+  struct node *from = in, *to = out;
+  to->value = from->value;
+  XF_INVOKE(XF_PTR(node_xf()), &from->next, &to->next);
+}
+
+static closure *node_xf(void)
+{
+  return XF_LIFT(xf_node, XF_DEEP, sizeof(struct node), sizeof(struct node));
+}
+
+void _kitsune_transform_head(void *new_head)
+{
+  XF_INVOKE(XF_PTR(node_xf()), kitsune_get_val("head"), new_head);
+}
+
+/* On the second attempt shared is updated where it is. */
+static int in_place = 0;
+
+static void xf_blob(void *in, void *out, int nargs, void **args)
+{
+  ((struct blob *)out)->value = ((struct blob *)in)->value + 1;
+}
+
+void _kitsune_transform_shared(void *new_shared)
+{
+  closure *blob_xf = XF_LIFT(xf_blob, in_place ? XF_SHALLOW : XF_DEEP,
+                             sizeof(struct blob), sizeof(struct blob));
+  XF_INVOKE(XF_PTR(blob_xf), kitsune_get_val("shared"), new_shared);
+}
+
+__attribute__((constructor)) static void register_vars(void)
+{
+  kitsune_register_var("worker", 0, 0, 0, (void *)worker, 0, 0);
+  kitsune_register_var("head", NULL, NULL, NULL, &head, sizeof(head), 1);
+  kitsune_register_var("shared", NULL, NULL, NULL, &shared, sizeof(shared), 1);
+}
+
+void *worker(void *arg)
+{
+  while (1) {
+    kitsune_update("worker");
+    beats++;
+    usleep(1000);
+  }
+}
+
+static struct node *nth(struct node *cur, int n)
+{
+  while (n--)
+    cur = cur->next;
+  return cur;
+}
+
+static void wait_for_beats(void)
+{
+  int before = beats;
+  while (beats < before + 10)
+    usleep(1000);
+}
+
+static void update_to(const char *path)
+{
+  kitsune_signal_update();
+  kitsune_set_next_version(strdup(path));
+  for (;;) {
+    kitsune_update("main");
+    usleep(1000);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  pthread_t t;
+  int i;
+
+  if (started) {
+    /* the first attempt was rolled back */
+    for (i = 0; i < NODES; i++)
+      assert(nth(head, i) == olds[i] && olds[i]->value == i &&
+             alloctrack_block_at(olds[i]));
+    assert(shared->value == 7);
+    kitsune_update("main");
+    wait_for_beats();
+    attempt = 1;
+    update_to(argv[1]);
+  }
+
+  if (!kitsune_is_updating()) {
+    for (i = NODES - 1; i >= 0; i--) {
+      struct node *n = kitsune_malloc(sizeof(struct node));
+      n->value = i;
+      n->next = head;
+      head = n;
+      olds[i] = n;
+    }
+    shared = kitsune_malloc(sizeof(struct blob));
+    shared->value = 7;
+    kitsune_pthread_create(&t, NULL, worker, NULL);
+    wait_for_beats();
+    started = 1;
+    update_to(argv[1]);
+  }
+
+  attempt = *(int *)kitsune_get_val("attempt");
+  struct node *old = *(struct node **)kitsune_get_val("head");
+  struct blob *old_shared = *(struct blob **)kitsune_get_val("shared");
+  for (i = 0; i < NODES; i++)
+    olds[i] = nth(old, i);
+  in_place = attempt == 1;
+  kitsune_do_automigrate();
+  for (i = 0; i < NODES; i++)
+    assert(nth(head, i) != olds[i] && nth(head, i)->value == i);
+
+  if (attempt == 0) {
+    kitsune_rollback();
+    assert(!"the update was not rolled back");
+  }
+
+  /* shared was changed in place, so there is no going back */
+  assert(shared == old_shared && shared->value == 8);
+  kitsune_rollback();
+  kitsune_update("main");
+  for (i = 0; i < NODES; i++)
+    assert(!alloctrack_block_at(olds[i]));
+  wait_for_beats();
+  printf("Sucesss...\n");
+  return 0;
+}
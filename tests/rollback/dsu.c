@@ -0,0 +1,11 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <kitsune.h>
+
+void _kitsune_prestart_xform(void) {
+  int *new_x = GET_NEW_GLOBAL(x);
+  *new_x = 106;
+  kitsune_rollback();
+  printf("Rollback failed.\n");
+  exit(1);
+}
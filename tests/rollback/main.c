@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <kitsune.h>
+#include <assert.h>
+
+int x = 100;
+
+int main(int argc, char **argv)
+{
+  if (kitsune_is_updating()) {
+    x = *(int *)kitsune_get_val("x");
+  } else {
+    x = 101;
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+  }
+
+  kitsune_update("test");
+
+  /* The update was rolled back, so this is still the first version. */
+  assert(x == 101);
+  printf("Sucesss...\n");
+  return 0;
+}
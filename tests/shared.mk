@@ -6,3 +6,4 @@ EKDRV = ../../bin/bin/driver
 EKCC = ../../bin/bin/ktcc
 EKJOIN = ../../bin/bin/kttjoin
 EKGEN = ../../bin/bin/xfgen
+EKWRAP = -Wl,--wrap=malloc,--wrap=free,--wrap=calloc,--wrap=realloc,--wrap=posix_memalign
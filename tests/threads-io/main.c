@@ -0,0 +1,161 @@
+#include <kitsune.h>
+#include <ktthreads.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <assert.h>
+
+/* Each child thread blocks indefinitely in one of the update-aware I/O
+   wrappers.  The update can only complete if the runtime wakes them through
+   their eventfd (a SIGUSR2 would make the assertions below fail). */
+
+int kitsune_has_updated(void);
+
+void *epoll_thread(void *arg);
+void *shared_epoll_thread(void *arg);
+void *read_thread(void *arg);
+void *select_thread(void *arg);
+
+/* This test is built without the Kitsune compiler, so the thread start
+   functions have to be registered by hand for the relaunch to find them. */
+__attribute__((constructor)) static void register_threads(void) 
+{
+  kitsune_register_var("epoll_thread", 0, 0, 0, (void *)epoll_thread, 0, 0);
+  kitsune_register_var("shared_epoll_thread", 0, 0, 0, (void *)shared_epoll_thread, 0, 0);
+  kitsune_register_var("read_thread", 0, 0, 0, (void *)read_thread, 0, 0);
+  kitsune_register_var("select_thread", 0, 0, 0, (void *)select_thread, 0, 0);
+}
+
+void *epoll_thread(void *arg) 
+{
+  int epfd = epoll_create1(0);
+  struct epoll_event events[4];
+  while (1) {
+    kitsune_update("epoll");
+    assert(ktthreads_epoll_wait(epfd, events, 4, -1) == 0);
+  }
+}
+
+/* Two threads wait on one epoll set, which holds a pipe that main writes
+   to.  Each must see only the pipe's events, never the other's wakeup. */
+#define PIPE_TAG 42
+int shared_epfd;
+int shared_pipe[2];
+
+void *shared_epoll_thread(void *arg)
+{
+  struct epoll_event events[4];
+  char c;
+  int i, n;
+  while (1) {
+    kitsune_update("shared_epoll");
+    n = ktthreads_epoll_wait(shared_epfd, events, 4, -1);
+    assert(n >= 0);
+    for (i = 0; i < n; i++) {
+      assert(events[i].data.u64 == PIPE_TAG);
+      while (read(shared_pipe[0], &c, 1) == 1)
+        ;
+    }
+  }
+}
+
+static void shared_epoll_init(void)
+{
+  struct epoll_event ev;
+  assert(pipe(shared_pipe) == 0);
+  fcntl(shared_pipe[0], F_SETFL, O_NONBLOCK);
+  shared_epfd = epoll_create1(0);
+  ev.events = EPOLLIN;
+  ev.data.u64 = PIPE_TAG;
+  assert(epoll_ctl(shared_epfd, EPOLL_CTL_ADD, shared_pipe[0], &ev) == 0);
+}
+
+/* Once an update is requested the wrappers return at once, with nothing
+   reported ready. */
+static void check_requested_io(void)
+{
+  struct pollfd p;
+  fd_set set;
+  struct timeval zero = { 0, 0 };
+
+  p.fd = shared_pipe[0];
+  p.events = POLLIN;
+  p.revents = POLLIN;
+  assert(ktthreads_poll(&p, 1, -1) == 0 && p.revents == 0);
+  FD_ZERO(&set);
+  FD_SET(shared_pipe[0], &set);
+  assert(ktthreads_select(shared_pipe[0] + 1, &set, NULL, NULL, &zero) == 0);
+  assert(!FD_ISSET(shared_pipe[0], &set));
+}
+
+/* An unrelated signal, with a restarting handler, must not end the reader's
+   wait: the read would then block where no kick can reach it. */
+pthread_t reader;
+
+static void on_sigusr1(int sig)
+{
+}
+
+void *read_thread(void *arg) 
+{
+  int fds[2];
+  char c;
+  assert(pipe(fds) == 0);
+  while (1) {
+    kitsune_update("read");
+    assert(ktthreads_read(fds[0], &c, 1) == -1 && errno == EINTR);
+  }
+}
+
+void *select_thread(void *arg) 
+{
+  fd_set set;
+  while (1) {
+    kitsune_update("select");
+    FD_ZERO(&set);
+    assert(ktthreads_select(0, &set, NULL, NULL, NULL) == 0);
+  }
+}
+
+int main(int argc, char **argv) 
+{
+  int loops = 0, first = !kitsune_is_updating();
+  pthread_t t;
+
+  /* the threads of either version find the set here */
+  shared_epoll_init();
+  if (!kitsune_is_updating()) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigusr1;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+    kitsune_pthread_create(&t, NULL, epoll_thread, NULL);
+    kitsune_pthread_create(&t, NULL, shared_epoll_thread, NULL);
+    kitsune_pthread_create(&t, NULL, shared_epoll_thread, NULL);
+    kitsune_pthread_create(&reader, NULL, read_thread, NULL);
+    kitsune_pthread_create(&t, NULL, select_thread, NULL);
+  }
+
+  while (1) {
+    kitsune_update("main");
+    usleep(1000);
+    if (write(shared_pipe[1], "x", 1) != 1)
+      return 1;
+    if (++loops == 10 && first)
+      pthread_kill(reader, SIGUSR1);
+    if (loops < 50)
+      continue;
+    if (kitsune_has_updated()) {
+      printf("Success.\n");
+      return 0;
+    }
+    kitsune_set_next_version(strdup(argv[1]));
+    kitsune_signal_update();
+    check_requested_io();
+  }
+}
@@ -0,0 +1,52 @@
+/*
+ * With KITSUNE_TRACE set, an update leaves its phases, from the request to
+ * the dlclose of the old version, on a timeline in the Chrome trace format.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kitsune.h>
+#include <assert.h>
+
+int main(int argc, char **argv)
+{
+  static const char *phases[] = {
+    "\"update requested\"", "\"quiesce test\"", "\"longjmp\"", "\"dlopen\"",
+    "\"stackvars_flip\"", "\"registervars_migrate\"", "\"automigrate\"",
+    "\"to update point\"", "\"dlclose\""
+  };
+  char line[512];
+  int i, seen[sizeof(phases) / sizeof(phases[0])] = { 0 }, events = 0;
+
+  if (!kitsune_is_updating()) {
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+    kitsune_update("test");
+    return 1;
+  }
+
+  kitsune_do_automigrate();
+  /* the update is done, and its timeline written, once we get here */
+  kitsune_update("test");
+
+  FILE *trace = fopen(getenv("KITSUNE_TRACE"), "r");
+  assert(trace);
+  assert(fgets(line, sizeof(line), trace) && strcmp(line, "[\n") == 0);
+  while (fgets(line, sizeof(line), trace)) {
+    assert(strncmp(line, "{\"name\":", 8) == 0);
+    assert(strstr(line, "\"ts\":") && strstr(line, "\"tid\":"));
+    for (i = 0; i < (int)(sizeof(phases) / sizeof(phases[0])); i++)
+      if (strstr(line, phases[i]))
+        seen[i]++;
+    events++;
+  }
+  fclose(trace);
+  printf("%d events\n", events);
+  for (i = 0; i < (int)(sizeof(phases) / sizeof(phases[0])); i++) {
+    if (!seen[i])
+      printf("missing %s\n", phases[i]);
+    assert(seen[i]);
+  }
+  printf("Sucesss...\n");
+  return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Objects allocated by type are transformed by sweeping their arena at the
+ * update, before the list that points at them is migrated; the list then
+ * finds every node already transformed.  The nodes grow at the first update,
+ * and the second finds them all again, along with the ones the second
+ * version added, in the arena made for the larger nodes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <kitsune.h>
+#include <assert.h>
+#include "../../src/alloctrack_internal.h"
+
+#define NODES 20000
+#define ADDED 5000
+
+/* "struct node", as the first version has it ... */
+struct node {
+  long val;
+  struct node *next;
+};
+
+/* ... and as it grows in the later ones. */
+struct big_node {
+  long val;
+  struct big_node *next;
+  long orig;
+  long pad[5];
+};
+
+void *head;
+int generation;
+static int xf_calls;
+
+static closure *grow_xf(void);
+static closure *big_xf(void);
+
+static void xf_grow(void *in, void *out, int nargs, void **args)
+{
+  struct node *old = in;
+  struct big_node *new = out;
+  new->val = old->val * 2;
+  new->orig = old->val;
+  XF_INVOKE(XF_PTR(grow_xf()), &old->next, &new->next);
+  __sync_fetch_and_add(&xf_calls, 1);
+}
+
+static closure *grow_xf(void)
+{
+  return XF_LIFT(xf_grow, XF_DEEP, sizeof(struct node), sizeof(struct big_node));
+}
+
+static void xf_big(void *in, void *out, int nargs, void **args)
+{
+  struct big_node *old = in, *new = out;
+  *new = *old;
+  XF_INVOKE(XF_PTR(big_xf()), &old->next, &new->next);
+  __sync_fetch_and_add(&xf_calls, 1);
+}
+
+static closure *big_xf(void)
+{
+  return XF_LIFT(xf_big, XF_DEEP, sizeof(struct big_node), sizeof(struct big_node));
+}
+
+int main(int argc, char **argv)
+{
+  struct node *n, **tail = (struct node **)&head;
+  struct big_node *b, **btail;
+  long i, count;
+  size_t swept;
+
+  if (!kitsune_is_updating()) {
+    generation = 1;
+    for (i = 0; i < NODES; i++) {
+      n = kitsune_malloc_typed(sizeof(struct node), "struct node");
+      n->val = i;
+      /* every third node is dropped again, leaving holes in the arena */
+      if (i % 3 == 0) {
+        kitsune_free(n);
+        continue;
+      }
+      *tail = n;
+      tail = &n->next;
+    }
+    *tail = NULL;
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[1]));
+    kitsune_update("test");
+    return 1;
+  }
+
+  generation = *(int *)kitsune_get_val("generation") + 1;
+  if (generation == 2) {
+    swept = kitsune_transform_typed("struct node", "struct node", grow_xf());
+    assert(swept == NODES - (NODES + 2) / 3);
+    assert(xf_calls == swept);
+    XF_INVOKE(XF_PTR(grow_xf()), kitsune_get_val("head"), &head);
+    /* every node was already mapped by the sweep */
+    assert(xf_calls == swept);
+    /* the survivors were 1, 2, 4, 5, 7, ... */
+    for (i = 1, count = 0, b = head; b; b = b->next, count++) {
+      assert(b->val == 2 * i && b->orig == i);
+      i += i % 3 == 2 ? 2 : 1;
+    }
+    assert(count == swept);
+
+    /* the larger nodes this version allocates are swept at the next update */
+    for (btail = (struct big_node **)&head; *btail; btail = &(*btail)->next)
+      ;
+    for (i = 0; i < ADDED; i++) {
+      b = kitsune_malloc_typed(sizeof(struct big_node), "struct node");
+      b->val = b->orig = -i;
+      *btail = b;
+      btail = &b->next;
+    }
+    *btail = NULL;
+    /* this update is done once we get back to the update point */
+    kitsune_update("test");
+    kitsune_signal_update();
+    kitsune_set_next_version(strdup(argv[2]));
+    kitsune_update("test");
+    return 1;
+  }
+
+  swept = kitsune_transform_typed("struct node", "struct node", big_xf());
+  assert(swept == NODES - (NODES + 2) / 3 + ADDED);
+  assert(xf_calls == swept);
+  XF_INVOKE(XF_PTR(big_xf()), kitsune_get_val("head"), &head);
+  assert(xf_calls == swept);
+  for (count = 0, b = head; b; b = b->next, count++)
+    assert(b->orig > 0 ? b->val == 2 * b->orig : b->val == b->orig);
+  assert(count == swept);
+  printf("Sucesss...\n");
+  return 0;
+}
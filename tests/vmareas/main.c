@@ -0,0 +1,52 @@
+/*
+ * How vmareas labels memory, and that an address missed while unmapped is
+ * found once it has been mapped.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <assert.h>
+
+#include "../../src/vmareas_internal.h"
+
+int main(int argc, char **argv)
+{
+  int on_stack = 0;
+
+  assert(vmareas_classify("[heap]") == HEAP);
+  assert(vmareas_classify("[stack]") == STACK);
+  assert(vmareas_classify("[stack:1234]") == STACK);
+  assert(vmareas_classify("/usr/lib/libfoo.so") == LIBRARY);
+  assert(vmareas_classify("/usr/lib/libfoo.so.6") == LIBRARY);
+  assert(vmareas_classify("/usr/lib/libfoo.so (deleted)") == LIBRARY);
+  assert(vmareas_classify("/tmp/libfoo.sock") == OTHER);
+  assert(vmareas_classify("/tmp/foo.solid") == OTHER);
+  assert(vmareas_classify("") == OTHER);
+
+  vmareas_init();
+  assert(vmareas_get_type(vmareas_lookup(&on_stack)) == STACK);
+  assert(vmareas_get_type(vmareas_lookup((void *)printf)) == LIBRARY);
+
+  /* reserve an address, then give it back so that it is unmapped */
+  long page = sysconf(_SC_PAGESIZE);
+  char *addr = mmap(NULL, page, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(addr != MAP_FAILED);
+  assert(munmap(addr, page) == 0);
+  assert(vmareas_lookup(addr) == NULL);
+  assert(vmareas_lookup(addr + 8) == NULL);
+  assert(vmareas_get_type(vmareas_lookup(addr)) == UNMAPPED);
+
+  assert(mmap(addr, page, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == addr);
+  vmarea *area = vmareas_lookup(addr + 8);
+  assert(area && vmareas_get_start(area) <= (void *)addr &&
+         vmareas_get_type(area) == OTHER && vmareas_get_writable(area));
+  vmareas_free();
+
+  printf("Sucesss...\n");
+  return 0;
+}
@@ -150,6 +150,12 @@ let path_elem_from_type = function
   | TUnion (name, gen_in) -> Some (Xftypes.PUnion name, gen_in)
   | _ -> None
 
+(* The runtime's address lists (ktheaptrack.h) hide their elements from the
+   comparison; xfgen migrates them with XF_HEAPLIST. *)
+let is_heaplist_path = function
+  | Xftypes.PStruct "kitsune_heaplist" | Xftypes.PTypedef "kitsune_heaplist" -> true
+  | _ -> false
+
 (* Following are comparison functions for each of the sub-parts of the
    program elements for which we support comparison. *)
 
@@ -212,6 +218,8 @@ and compareTypes (ctx:compcontext) t0 t1 (through_ptr:bool) =
               | Some _ -> 
                 failwith "compareTypes - unexpected rule"         
               | None when from_path = to_path ->
+                if is_heaplist_path from_path && gen_in0 <> [] then
+                  compcontext_set_requires_shallow_xform ctx;
                 compcontext_add_type_comp ctx through_ptr ([from_path], [to_path]);
                 compareGenericIn ctx gen_in0 gen_in1 through_ptr
               | None -> 
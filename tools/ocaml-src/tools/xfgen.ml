@@ -433,6 +433,23 @@ let generate_trans_func calling_gen_ctx compare_ctx e =
         assert (gv0 = gv1);
         (compute_gen_arg_var_name gv0)
 
+      (* Address lists hide their elements behind E_OPAQUE; rebuild them
+         from the transformed elements when @t needs transforming. *)
+      | (TStruct (nm0, [gd0]) | TNamed (nm0, [gd0])), (TStruct (nm1, [gd1]) | TNamed (nm1, [gd1]))
+          when nm0 = "kitsune_heaplist" && nm1 = "kitsune_heaplist" ->
+        let genin_needs_xform gd0 gd1 =
+          match gd0, gd1 with
+            | ProgramType t0', ProgramType t1' ->
+              check_toplevel_type (fun k -> Hashtbl.mem compare_ctx.requires_full_xform k ||
+                                             Hashtbl.mem compare_ctx.requires_shallow_xform k) t0' t1'
+            | _ -> true
+        in
+        if genin_needs_xform gd0 gd1 then
+          "XF_HEAPLIST(" ^ sizeof (render_type (gencontext_set_renamer gen_ctx new_rename) t1 false None) ^ ", " ^
+            (generate_genin_xform gen_ctx gd0 gd1 len_base) ^ ")"
+        else
+          "XF_RAW(" ^ sizeof (render_type (gencontext_set_renamer gen_ctx new_rename) t1 false None) ^ ")"
+
       (* Ultimately, the following two cases will produce errors.
          Need to decide whether to issue the errors here or wait
          until they occur in the recursive call... for now, the